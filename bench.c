@@ -0,0 +1,452 @@
+/*
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//
+// iploc-bench runs lookup workloads against every search engine and
+// prints one JSON object per (engine, workload, cache state) line, so
+// results can be diffed between releases. Workloads:
+//
+//   uniform   IPs drawn uniformly from the whole IPv4 space
+//   zipf      Zipf (s = 1) skewed draws from a hot set of random IPs
+//   sorted    the uniform IPs in ascending order
+//   replay    IPs read from a file, one dotted quad per line (-r)
+//
+// Each workload is run cold (right after flushing the CPU caches, over
+// the first COLD_OPS lookups) and warm (after a full warm-up pass).
+// Every lookup is timed individually with CLOCK_MONOTONIC, and the
+// measured clock overhead is subtracted before taking percentiles.
+// Throughput runs also report data TLB misses per lookup when perf
+// events are available, and -p loads every engine with the memory
+// placement options huge, lock and numa (comma separated) to compare.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "iploc.h"
+
+#define COLD_OPS 10000
+#define ZIPF_HOT 100000
+#define FLUSH_SIZE (256 << 20)
+
+#define PANIC(reason) do { \
+    fprintf(stderr, "%s\n", reason); \
+    exit(-1); \
+} while(0)
+
+typedef struct {
+    const char *name;
+    uint32_t flags;
+} engine_t;
+
+static const engine_t engines[] = {
+    {"packed", 0},
+    {"generic", IP_DB_GENERIC},
+    {"decode", IP_DB_DECODE},
+    {"compact", IP_DB_COMPACT},
+    {"eytzinger", IP_DB_EYTZINGER},
+    {"simd", IP_DB_SIMD},
+    {"direct", IP_DB_DIRECT},
+};
+
+typedef struct {
+    const char *name;
+    uint32_t *ips;
+    size_t n;
+} workload_t;
+
+static uint32_t rng_state = 2463534241u;
+
+static uint32_t fast_rand()
+{
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rng_state = x;
+}
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_uint32(const void *x, const void *y)
+{
+    uint32_t a = *(const uint32_t*)x, b = *(const uint32_t*)y;
+    return a < b ? -1 : a > b;
+}
+
+// ------------------------------------------------------------------
+// Workload generators.
+
+static void gen_uniform(workload_t *w, size_t n)
+{
+    size_t i;
+    w->name = "uniform";
+    w->n = n;
+    w->ips = malloc(sizeof(uint32_t) * n);
+    for (i = 0; i < n; ++i) {
+        w->ips[i] = fast_rand();
+    }
+}
+
+static void gen_sorted(workload_t *w, size_t n)
+{
+    gen_uniform(w, n);
+    w->name = "sorted";
+    qsort(w->ips, n, sizeof(uint32_t), cmp_uint32);
+}
+
+static void gen_zipf(workload_t *w, size_t n)
+{
+    uint32_t hot[ZIPF_HOT];
+    double *cdf = malloc(sizeof(double) * ZIPF_HOT);
+    double sum = 0;
+    size_t i;
+
+    for (i = 0; i < ZIPF_HOT; ++i) {
+        hot[i] = fast_rand();
+        sum += 1.0 / (i + 1);
+        cdf[i] = sum;
+    }
+
+    w->name = "zipf";
+    w->n = n;
+    w->ips = malloc(sizeof(uint32_t) * n);
+    for (i = 0; i < n; ++i) {
+        double u = (double)fast_rand() / 4294967296.0 * sum;
+        size_t lo = 0, hi = ZIPF_HOT - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        w->ips[i] = hot[lo];
+    }
+    free(cdf);
+}
+
+static int gen_replay(workload_t *w, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    size_t cap = 1 << 16;
+    char line[256];
+    w->name = "replay";
+    w->n = 0;
+    w->ips = malloc(sizeof(uint32_t) * cap);
+
+    while (fgets(line, sizeof(line), fp)) {
+        struct in_addr addr;
+        line[strcspn(line, "\r\n")] = 0;
+        if (inet_pton(AF_INET, line, &addr) != 1) {
+            continue;
+        }
+        if (w->n == cap) {
+            cap *= 2;
+            w->ips = realloc(w->ips, sizeof(uint32_t) * cap);
+        }
+        w->ips[w->n++] = ntohl(addr.s_addr);
+    }
+
+    fclose(fp);
+    return w->n ? 0 : -1;
+}
+
+// ------------------------------------------------------------------
+// Evict the DB from the CPU caches by streaming through a buffer
+// larger than any last level cache.
+
+static void flush_caches()
+{
+    static volatile char *buf;
+    size_t i;
+
+    if (!buf) {
+        buf = malloc(FLUSH_SIZE);
+    }
+    for (i = 0; i < FLUSH_SIZE; i += 64) {
+        buf[i] = (char)i;
+    }
+}
+
+// ------------------------------------------------------------------
+// Median cost of reading the clock, subtracted from every sample.
+
+static uint32_t clock_overhead()
+{
+    uint32_t samples[1001];
+    int i;
+    for (i = 0; i < 1001; ++i) {
+        uint64_t t0 = now_ns();
+        samples[i] = now_ns() - t0;
+    }
+    qsort(samples, 1001, sizeof(uint32_t), cmp_uint32);
+    return samples[500];
+}
+
+// ------------------------------------------------------------------
+// Look up every IP of the workload once, untimed, to bring the tables
+// it touches into the caches and TLB.
+
+static void warm_up(ip_db_t *db, const workload_t *w)
+{
+    size_t i;
+    const char *text;
+    uint32_t len;
+
+    for (i = 0; i < w->n; ++i) {
+        ip_locate_ref(db, w->ips[i], &text, &len);
+    }
+}
+
+// ------------------------------------------------------------------
+// Time |n| lookups one by one and print their latency distribution.
+
+static void run(ip_db_t *db, const char *engine, const workload_t *w,
+                const char *cache, size_t n, uint32_t overhead, uint32_t *lat)
+{
+    size_t i;
+    uint64_t total = 0;
+    const char *text;
+    uint32_t len;
+    unsigned long sink = 0;
+
+    for (i = 0; i < n; ++i) {
+        uint64_t t0 = now_ns();
+        if (ip_locate_ref(db, w->ips[i], &text, &len) == 0) {
+            sink += len;
+        }
+        uint64_t d = now_ns() - t0;
+        lat[i] = d > overhead ? d - overhead : 0;
+        total += lat[i];
+    }
+
+    qsort(lat, n, sizeof(uint32_t), cmp_uint32);
+    printf("{\"engine\":\"%s\",\"workload\":\"%s\",\"cache\":\"%s\","
+           "\"ops\":%zu,\"mean_ns\":%.1f,\"p50_ns\":%u,\"p99_ns\":%u,"
+           "\"p999_ns\":%u,\"max_ns\":%u,\"footprint\":%zu,\"sink\":%lu}\n",
+           engine, w->name, cache, n, (double)total / n,
+           lat[n/2], lat[n*99/100], lat[n*999/1000], lat[n-1],
+           ip_db_footprint(db), sink);
+    fflush(stdout);
+}
+
+// ------------------------------------------------------------------
+// Open a counter of data TLB load misses of this thread, or return -1
+// when perf events are not available (e.g. in a container).
+
+static int open_dtlb_counter()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// ------------------------------------------------------------------
+// Time the whole workload in one go, without per-lookup clock reads.
+
+static void run_throughput(ip_db_t *db, const char *engine, const workload_t *w)
+{
+    size_t i;
+    const char *text;
+    uint32_t len;
+    unsigned long sink = 0;
+    uint64_t misses = 0;
+    int fd = open_dtlb_counter();
+
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    uint64_t t0 = now_ns();
+    for (i = 0; i < w->n; ++i) {
+        if (ip_locate_ref(db, w->ips[i], &text, &len) == 0) {
+            sink += len;
+        }
+    }
+    uint64_t d = now_ns() - t0;
+
+    char tlb[32] = "null";
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) == sizeof(misses)) {
+            snprintf(tlb, sizeof(tlb), "%.3f", (double)misses / w->n);
+        }
+        close(fd);
+    }
+
+    printf("{\"engine\":\"%s\",\"workload\":\"%s\",\"cache\":\"throughput\","
+           "\"ops\":%zu,\"mean_ns\":%.1f,\"ops_per_sec\":%.0f,"
+           "\"dtlb_misses_per_op\":%s,\"sink\":%lu}\n",
+           engine, w->name, w->n, (double)d / w->n, w->n * 1e9 / d, tlb, sink);
+    fflush(stdout);
+}
+
+// ------------------------------------------------------------------
+// Parse a comma separated list of placement options.
+
+static int parse_placement(const char *list, uint32_t *flags)
+{
+    char buf[64];
+    char *tok, *save;
+
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (strcmp(tok, "huge") == 0) {
+            *flags |= IP_DB_HUGEPAGES;
+        } else if (strcmp(tok, "lock") == 0) {
+            *flags |= IP_DB_LOCK;
+        } else if (strcmp(tok, "numa") == 0) {
+            *flags |= IP_DB_NUMA;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-x] [-n ops] [-e engine] [-p placement] [-r ip-list] "
+                    "[IP DB file]\n"
+                    "engines: packed generic decode compact eytzinger simd direct\n"
+                    "placement: huge, lock, numa or a comma separated list\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    const char *replay = NULL;
+    const char *only = NULL;
+    const char *placement = "default";
+    uint32_t extended = 0, place = 0;
+    size_t n = 1000000;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-x") == 0) {
+            extended = IP_DB_EXTENDED;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            placement = argv[++i];
+            if (parse_placement(placement, &place) != 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            replay = argv[++i];
+        } else if (argv[i][0] == '-' || path) {
+            usage(argv[0]);
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (!path) {
+        path = extended ? "17monipdb.datx" : "17monipdb.dat";
+    }
+    if (n < COLD_OPS) {
+        n = COLD_OPS;
+    }
+
+    workload_t workloads[4];
+    int nworkloads = 3;
+    gen_uniform(&workloads[0], n);
+    gen_zipf(&workloads[1], n);
+    gen_sorted(&workloads[2], n);
+
+    if (replay) {
+        if (gen_replay(&workloads[3], replay) != 0 || workloads[3].n < COLD_OPS) {
+            fprintf(stderr, "Need at least %d IPs in %s\n", COLD_OPS, replay);
+            return 1;
+        }
+        nworkloads = 4;
+    }
+
+    uint32_t overhead = clock_overhead();
+    uint32_t *lat = malloc(sizeof(uint32_t) * (replay && workloads[3].n > n ? workloads[3].n : n));
+    size_t e;
+
+    for (e = 0; e < sizeof(engines)/sizeof(engines[0]); ++e) {
+        if (only && strcmp(only, engines[e].name) != 0) {
+            continue;
+        }
+
+        uint64_t t0 = now_ns();
+        ip_db_t *db = ip_db_init_ex(path, extended | place | engines[e].flags);
+        ip_db_stats_t st;
+        if (!db || ip_db_stats(db, &st, NULL, NULL) != 0) {
+            PANIC("Failed to init ip db");
+        }
+        printf("{\"engine\":\"%s\",\"placement\":\"%s\",\"load_ms\":%.2f,"
+               "\"footprint\":%zu,\"huge_pages\":%d,\"locked\":%zu,\"replicas\":%d}\n",
+               engines[e].name, placement, (now_ns() - t0) / 1e6, st.mem_total,
+               st.huge_pages, st.mem_locked, st.numa_replicas);
+
+        int k;
+        for (k = 0; k < nworkloads; ++k) {
+            workload_t *w = &workloads[k];
+            flush_caches();
+            run(db, engines[e].name, w, "cold", COLD_OPS, overhead, lat);
+            warm_up(db, w);
+            run(db, engines[e].name, w, "warm", w->n, overhead, lat);
+            run_throughput(db, engines[e].name, w);
+        }
+
+        ip_db_destroy(&db);
+    }
+
+    for (i = 0; i < nworkloads; ++i) {
+        free(workloads[i].ips);
+    }
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "iploc.h"
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[1], "-x") != 0)) {
+        printf("Usage: %s [-x] db-file native-db-file\n", argv[0]);
+        return 1;
+    }
+
+    const char *file = argv[argc - 2];
+    const char *out = argv[argc - 1];
+    uint32_t flags = (argc == 4 ? IP_DB_EXTENDED : 0) | IP_DB_LOC_IDS;
+    ip_db_t *ipdb = ip_db_init_ex(file, flags);
+
+    if (!ipdb) {
+        fprintf(stderr, "Failed to init ip db from %s\n", file);
+        return -1;
+    }
+
+    if (ip_db_compile(ipdb, out) != 0) {
+        fprintf(stderr, "Failed to write native ip db to %s\n", out);
+        ip_db_destroy(&ipdb);
+        return -1;
+    }
+
+    printf("%s: %u entries, %u locations\n", out, ip_db_count(ipdb), ip_db_loc_count(ipdb));
+    ip_db_destroy(&ipdb);
+    return 0;
+}
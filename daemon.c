@@ -0,0 +1,605 @@
+/*
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//
+// iploc-daemon loads a DB once and serves lookups to local processes
+// over a Unix socket, speaking the batched binary protocol of proto.h.
+// Each worker thread runs its own epoll loop: all of them watch the
+// listening socket (EPOLLEXCLUSIVE wakes one per connection) and then
+// serve the connections they accepted. Requests are answered in order,
+// so clients can pipeline. SIGHUP reloads the DB without stopping
+// service and bumps the DB generation told in replies, SIGINT/SIGTERM
+// shut down, and with -i the daemon reports
+// throughput and latency on stderr every interval.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "iploc.h"
+#include "proto.h"
+
+#define READ_SIZE (64 << 10)
+#define OUT_HIGH (4 << 20)      // stop reading a connection past this much pending output
+#define MAX_EVENTS 64
+#define LAT_BUCKETS 40          // service time histogram, bucket k < 2^(k+1) nsec
+
+typedef struct {
+    int fd;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    char *out;
+    size_t out_pos;     // bytes of |out| already written
+    size_t out_len;
+    size_t out_cap;
+    uint32_t events;    // events currently registered
+} conn_t;
+
+// Counters of a worker, written by it alone and read by the stats
+// reporter; relaxed atomics keep the reads tear-free at no cost.
+typedef struct {
+    _Atomic uint64_t requests;
+    _Atomic uint64_t ips;
+    _Atomic uint64_t errors;
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t accepted;
+    _Atomic uint64_t closed;
+    _Atomic uint64_t lat[LAT_BUCKETS];
+} stats_t;
+
+typedef struct server_s server_t;
+
+typedef struct {
+    server_t *srv;
+    int epfd;
+    pthread_t tid;
+    ip_db_reader_t *reader;
+    uint32_t *ips;      // aligned copy of a request's items
+    ip_text_t *texts;
+    stats_t stats;
+} __attribute__((aligned(64))) worker_t;
+
+// The DB of a generation. Two slots, by parity, cover the DB a reader
+// may pin while a reload swaps in the next one.
+typedef struct {
+    _Atomic(ip_db_t*) db;
+    _Atomic uint32_t generation;
+} gen_slot_t;
+
+struct server_s {
+    ip_db_handle_t *handle;
+    gen_slot_t gens[2];
+    _Atomic uint32_t generation;    // of the current DB
+    int listen_fd;
+    int stop_pipe[2];
+    int nworkers;
+    worker_t *workers;
+    uint64_t start_ns;
+};
+
+// epoll tags of the two shared descriptors; connections use their conn_t.
+static char listen_tag, stop_tag;
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void bump(_Atomic uint64_t *c, uint64_t n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline uint64_t get(_Atomic uint64_t *c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static void reserve(char **buf, size_t *cap, size_t len, size_t extra)
+{
+    if (len + extra > *cap) {
+        size_t n = *cap ? *cap : READ_SIZE;
+        while (n < len + extra) {
+            n *= 2;
+        }
+        *buf = realloc(*buf, n);
+        *cap = n;
+    }
+}
+
+// ------------------------------------------------------------------
+// Sum the counters of all workers into |total|.
+
+static void collect(server_t *srv, stats_t *total)
+{
+    int i, k;
+    memset(total, 0, sizeof(*total));
+    for (i = 0; i < srv->nworkers; ++i) {
+        stats_t *s = &srv->workers[i].stats;
+        bump(&total->requests, get(&s->requests));
+        bump(&total->ips, get(&s->ips));
+        bump(&total->errors, get(&s->errors));
+        bump(&total->bytes_in, get(&s->bytes_in));
+        bump(&total->bytes_out, get(&s->bytes_out));
+        bump(&total->accepted, get(&s->accepted));
+        bump(&total->closed, get(&s->closed));
+        for (k = 0; k < LAT_BUCKETS; ++k) {
+            bump(&total->lat[k], get(&s->lat[k]));
+        }
+    }
+}
+
+// ------------------------------------------------------------------
+// Upper bound of the service time below which a fraction |q| of the
+// requests counted in |lat| fall.
+
+static uint64_t percentile(_Atomic uint64_t *lat, uint64_t n, double q)
+{
+    uint64_t seen = 0, want = (uint64_t)(n * q);
+    int k;
+    if (n == 0) {
+        return 0;
+    }
+    for (k = 0; k < LAT_BUCKETS; ++k) {
+        seen += get(&lat[k]);
+        if (seen > want) {
+            break;
+        }
+    }
+    return 2ull << (k < LAT_BUCKETS ? k : LAT_BUCKETS - 1);
+}
+
+// ------------------------------------------------------------------
+// Format the daemon stats as one JSON object. Return its length.
+
+static int stats_json(server_t *srv, char *buf, size_t size)
+{
+    stats_t t;
+    collect(srv, &t);
+
+    double secs = (now_ns() - srv->start_ns) / 1e9;
+    uint64_t n = get(&t.requests);
+    return snprintf(buf, size,
+            "{\"uptime_sec\":%.1f,\"workers\":%d,\"connections\":%lu,\"accepted\":%lu,"
+            "\"requests\":%lu,\"ips\":%lu,\"errors\":%lu,\"bytes_in\":%lu,\"bytes_out\":%lu,"
+            "\"ips_per_sec\":%.0f,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu}",
+            secs, srv->nworkers, get(&t.accepted) - get(&t.closed), get(&t.accepted),
+            n, get(&t.ips), get(&t.errors), get(&t.bytes_in), get(&t.bytes_out),
+            get(&t.ips) / secs, percentile(t.lat, n, 0.5), percentile(t.lat, n, 0.99),
+            percentile(t.lat, n, 0.999));
+}
+
+// ------------------------------------------------------------------
+// Get the generation of a DB pinned from the handle.
+
+static uint32_t generation_of(server_t *srv, ip_db_t *db)
+{
+    int k = atomic_load(&srv->gens[0].db) == db ? 0 : 1;
+    return atomic_load(&srv->gens[k].generation);
+}
+
+// ------------------------------------------------------------------
+// Load the DB again and swap it in as the next generation.
+// Return 0 on success, and -1 if the DB cannot be loaded, in which
+// case the current DB stays in place.
+
+static int reload(server_t *srv, const char *path, uint32_t flags)
+{
+    ip_db_t *db = ip_db_init_ex(path, flags);
+    if (!db) {
+        return -1;
+    }
+
+    // The slot of the generation before the current one is free: its
+    // DB was destroyed once no reader held it. Fill it before readers
+    // can pin |db|.
+    uint32_t g = atomic_load(&srv->generation) + 1;
+    atomic_store(&srv->gens[g & 1].generation, g);
+    atomic_store(&srv->gens[g & 1].db, db);
+    if (ip_db_handle_swap(srv->handle, db) != 0) {
+        atomic_store(&srv->gens[g & 1].db, NULL);
+        ip_db_destroy(&db);
+        return -1;
+    }
+    atomic_store(&srv->generation, g);
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Append the reply to one request to the output of |c|.
+
+static void serve(worker_t *w, conn_t *c, const iploc_msg_t *req, const char *payload)
+{
+    uint64_t t0 = now_ns();
+    iploc_msg_t rep = *req;
+    size_t hdr = c->out_len, i, n = req->count;
+    int ok = 1, stale = 0;
+
+    reserve(&c->out, &c->out_cap, c->out_len, sizeof(rep));
+    c->out_len += sizeof(rep);
+
+    rep.generation = atomic_load(&w->srv->generation);
+    if (req->op == IPLOC_OP_STATS) {
+        char json[1024];
+        n = stats_json(w->srv, json, sizeof(json));
+        reserve(&c->out, &c->out_cap, c->out_len, n);
+        memcpy(c->out + c->out_len, json, n);
+        c->out_len += n;
+    } else if ((req->op == IPLOC_OP_IDS || req->op == IPLOC_OP_TEXTS ||
+                req->op == IPLOC_OP_LOCS) &&
+               n <= IPLOC_MAX_BATCH && req->len == n * sizeof(uint32_t)) {
+        ip_db_t *db = ip_db_pin(w->reader);
+        rep.generation = generation_of(w->srv, db);
+        memcpy(w->ips, payload, req->len);
+
+        if (req->generation != 0 && req->generation != rep.generation) {
+            ok = 0;
+            stale = 1;
+            n = 0;
+        } else if (req->op == IPLOC_OP_IDS) {
+            reserve(&c->out, &c->out_cap, c->out_len, n * sizeof(uint32_t));
+            uint32_t *ids = (uint32_t*)(c->out + c->out_len);
+            for (i = 0; i < n; ++i) {
+                uint32_t id;
+                id = ip_locate_id(db, w->ips[i], &id) == 0 ? id : IPLOC_NO_ID;
+                memcpy(&ids[i], &id, sizeof(id));
+            }
+            c->out_len += n * sizeof(uint32_t);
+        } else {
+            if (req->op == IPLOC_OP_TEXTS) {
+                ip_locate_batch(db, w->ips, n, w->texts);
+            } else {
+                for (i = 0; i < n; ++i) {
+                    if (ip_db_loc_text(db, w->ips[i], &w->texts[i]) != 0) {
+                        w->texts[i].text = NULL;
+                    }
+                }
+            }
+
+            for (i = 0; i < n; ++i) {
+                uint16_t len = w->texts[i].text ? w->texts[i].len : 0;
+                reserve(&c->out, &c->out_cap, c->out_len, sizeof(len) + len);
+                memcpy(c->out + c->out_len, &len, sizeof(len));
+                memcpy(c->out + c->out_len + sizeof(len), w->texts[i].text, len);
+                c->out_len += sizeof(len) + len;
+            }
+        }
+        ip_db_unpin(w->reader);
+    } else {
+        ok = 0;
+        n = 0;
+    }
+
+    rep.status = ok ? IPLOC_STATUS_OK : stale ? IPLOC_STATUS_STALE : IPLOC_STATUS_ERROR;
+    rep.count = !ok ? 0 : req->op == IPLOC_OP_STATS ? 1 : n;
+    rep.len = c->out_len - hdr - sizeof(rep);
+    memcpy(c->out + hdr, &rep, sizeof(rep));
+
+    uint64_t d = now_ns() - t0;
+    int k = 63 - __builtin_clzll(d | 1);
+    bump(&w->stats.lat[k < LAT_BUCKETS ? k : LAT_BUCKETS - 1], 1);
+    bump(&w->stats.requests, 1);
+    bump(&w->stats.ips, req->op == IPLOC_OP_STATS ? 0 : rep.count);
+    bump(&w->stats.errors, !ok);
+}
+
+static void close_conn(worker_t *w, conn_t *c)
+{
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+    bump(&w->stats.closed, 1);
+}
+
+// ------------------------------------------------------------------
+// Register interest in input while output is below the high water mark,
+// and in writability while output is pending.
+
+static void update_events(worker_t *w, conn_t *c)
+{
+    size_t pending = c->out_len - c->out_pos;
+    uint32_t events = (pending < OUT_HIGH ? EPOLLIN : 0) | (pending ? EPOLLOUT : 0);
+    if (events != c->events) {
+        struct epoll_event ev = {events, {.ptr = c}};
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+}
+
+// ------------------------------------------------------------------
+// Write as much pending output as the socket takes.
+// Return 0 on success, -1 if the connection failed.
+
+static int flush_out(worker_t *w, conn_t *c)
+{
+    while (c->out_pos < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? 0 : -1;
+        }
+        c->out_pos += n;
+        bump(&w->stats.bytes_out, n);
+    }
+    c->out_pos = c->out_len = 0;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Read what is available and serve every complete request.
+// Return 0 on success, -1 if the connection is done.
+
+static int on_readable(worker_t *w, conn_t *c)
+{
+    reserve(&c->in, &c->in_cap, c->in_len, READ_SIZE);
+    ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+    if (n <= 0) {
+        return n < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    c->in_len += n;
+    bump(&w->stats.bytes_in, n);
+
+    size_t pos = 0;
+    while (c->in_len - pos >= sizeof(iploc_msg_t)) {
+        iploc_msg_t req;
+        memcpy(&req, c->in + pos, sizeof(req));
+        if (req.len > IPLOC_MAX_BATCH * sizeof(uint32_t)) {
+            return -1;
+        }
+        if (c->in_len - pos < sizeof(req) + req.len) {
+            break;
+        }
+        serve(w, c, &req, c->in + pos + sizeof(req));
+        pos += sizeof(req) + req.len;
+    }
+
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return flush_out(w, c);
+}
+
+static void on_accept(worker_t *w)
+{
+    for (;;) {
+        int fd = accept4(w->srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+
+        conn_t *c = calloc(1, sizeof(conn_t));
+        struct epoll_event ev = {EPOLLIN, {.ptr = c}};
+        if (!c || epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        bump(&w->stats.accepted, 1);
+    }
+}
+
+static void* worker(void *arg)
+{
+    worker_t *w = (worker_t*)arg;
+    struct epoll_event evs[MAX_EVENTS];
+
+    for (;;) {
+        int i, n = epoll_wait(w->epfd, evs, MAX_EVENTS, -1);
+        for (i = 0; i < n; ++i) {
+            void *tag = evs[i].data.ptr;
+            if (tag == &stop_tag) {
+                return NULL;
+            }
+            if (tag == &listen_tag) {
+                on_accept(w);
+                continue;
+            }
+
+            conn_t *c = (conn_t*)tag;
+            int rc = 0;
+            if (evs[i].events & EPOLLOUT) {
+                rc = flush_out(w, c);
+            }
+            if (rc == 0 && (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                rc = on_readable(w, c);
+            }
+            if (rc != 0) {
+                close_conn(w, c);
+            } else {
+                update_events(w, c);
+            }
+        }
+    }
+}
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 1024) != 0) {
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-x] [-s socket] [-j threads] [-i seconds] [IP DB file]\n"
+            "Serves lookups on |socket| (default " IPLOC_SOCKET ").\n"
+            "SIGHUP reloads the DB, -i prints stats every interval.\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *db_path = NULL;
+    const char *sock_path = IPLOC_SOCKET;
+    uint32_t flags = IP_DB_MMAP | IP_DB_SIMD | IP_DB_LOC_IDS;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int interval = 0;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-x") == 0) {
+            flags |= IP_DB_EXTENDED;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            sock_path = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            interval = atoi(argv[++i]);
+        } else if (argv[i][0] == '-' || db_path) {
+            usage(argv[0]);
+        } else {
+            db_path = argv[i];
+        }
+    }
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (!db_path) {
+        db_path = flags & IP_DB_EXTENDED ? "17monipdb.datx" : "17monipdb.dat";
+    }
+
+    ip_db_t *db = ip_db_init_ex(db_path, flags);
+    if (!db) {
+        fprintf(stderr, "Failed to init ip db from %s\n", db_path);
+        return -1;
+    }
+
+    server_t srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.handle = ip_db_handle_new(db);
+    srv.gens[1].db = db;
+    srv.gens[1].generation = 1;
+    srv.generation = 1;
+    srv.listen_fd = listen_on(sock_path);
+    if (srv.listen_fd < 0 || pipe(srv.stop_pipe) != 0) {
+        fprintf(stderr, "Cannot listen on %s\n", sock_path);
+        return -1;
+    }
+
+    // Workers inherit a mask blocking the signals the main thread waits for.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    srv.nworkers = threads;
+    srv.workers = aligned_alloc(64, sizeof(worker_t) * threads);
+    memset(srv.workers, 0, sizeof(worker_t) * threads);
+    srv.start_ns = now_ns();
+
+    for (i = 0; i < threads; ++i) {
+        worker_t *w = &srv.workers[i];
+        w->srv = &srv;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->reader = ip_db_reader_new(srv.handle);
+        w->ips = malloc(sizeof(uint32_t) * IPLOC_MAX_BATCH);
+        w->texts = malloc(sizeof(ip_text_t) * IPLOC_MAX_BATCH);
+
+        struct epoll_event ev = {EPOLLIN | EPOLLEXCLUSIVE, {.ptr = &listen_tag}};
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, srv.listen_fd, &ev);
+        struct epoll_event stop = {EPOLLIN, {.ptr = &stop_tag}};
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, srv.stop_pipe[0], &stop);
+        pthread_create(&w->tid, NULL, worker, w);
+    }
+
+    fprintf(stderr, "serving %s on %s with %d threads\n", db_path, sock_path, threads);
+
+    struct timespec timeout = {interval, 0};
+    uint64_t last_ips = 0, last_ns = srv.start_ns;
+    for (;;) {
+        int sig = interval > 0 ? sigtimedwait(&set, NULL, &timeout) : sigwaitinfo(&set, NULL);
+        if (sig == SIGHUP) {
+            int rc = reload(&srv, db_path, flags);
+            fprintf(stderr, "reload %s: %s, generation %u\n", db_path,
+                    rc == 0 ? "ok" : "failed", atomic_load(&srv.generation));
+        } else if (sig == SIGINT || sig == SIGTERM) {
+            break;
+        } else if (sig < 0 && errno == EAGAIN) {
+            char json[1024];
+            stats_t t;
+            stats_json(&srv, json, sizeof(json));
+            collect(&srv, &t);
+            uint64_t ips = get(&t.ips), ns = now_ns();
+            fprintf(stderr, "%s ips_per_sec_now=%.0f\n", json, (ips - last_ips) * 1e9 / (ns - last_ns));
+            last_ips = ips;
+            last_ns = ns;
+        }
+    }
+
+    if (write(srv.stop_pipe[1], "", 1) != 1) {
+        perror("write");
+    }
+    for (i = 0; i < threads; ++i) {
+        worker_t *w = &srv.workers[i];
+        pthread_join(w->tid, NULL);
+        close(w->epfd);
+        ip_db_reader_release(&w->reader);
+        free(w->ips);
+        free(w->texts);
+    }
+
+    close(srv.listen_fd);
+    unlink(sock_path);
+    free(srv.workers);
+    ip_db_handle_destroy(&srv.handle);
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iploc.h"
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-x] [-X] old-db-file new-db-file\n"
+           "Prints each IP range whose location changed, then the old (-) and\n"
+           "new (+) location. -x and -X read the old and new 17MON files as datx.\n", prog);
+    exit(1);
+}
+
+static int print_diff(const ip_diff_t *d, void *arg)
+{
+    char first[16], last[16];
+    ip_format_v4(d->range.first, first);
+    ip_format_v4(d->range.last, last);
+    *(uint64_t*)arg += (uint64_t)d->range.last - d->range.first + 1;
+    return printf("@ %s %s\n- %.*s\n+ %.*s\n", first, last, (int)d->before.len,
+                  d->before.text, (int)d->after.len, d->after.text) < 0;
+}
+
+int main(int argc, const char *argv[])
+{
+    const char *file[2] = {NULL, NULL};
+    int extended[2] = {0, 0}, n = 0, i;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-x") == 0) {
+            extended[0] = 1;
+        } else if (strcmp(argv[i], "-X") == 0) {
+            extended[1] = 1;
+        } else if (argv[i][0] == '-' || n == 2) {
+            usage(argv[0]);
+        } else {
+            file[n++] = argv[i];
+        }
+    }
+
+    if (n != 2) {
+        usage(argv[0]);
+    }
+
+    ip_db_t *db[2];
+    for (i = 0; i < 2; ++i) {
+        db[i] = ip_db_init_ex(file[i], IP_DB_MMAP | (extended[i] ? IP_DB_EXTENDED : 0));
+        if (!db[i]) {
+            fprintf(stderr, "Failed to init ip db from %s\n", file[i]);
+            return -1;
+        }
+    }
+
+    struct timespec t0, t1;
+    uint64_t ips = 0;
+    size_t count;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = ip_db_diff(db[0], db[1], print_diff, &ips, &count);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (rc != 0) {
+        fprintf(stderr, "Failed to diff %s and %s\n", file[0], file[1]);
+    } else {
+        fprintf(stderr, "%zu ranges changed, %llu IPs, %.2f msec\n", count,
+                (unsigned long long)ips,
+                (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    }
+
+    ip_db_destroy(&db[0]);
+    ip_db_destroy(&db[1]);
+    return rc;
+}
@@ -22,35 +22,62 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "iploc.h"
 
-int main(int argc, const char *argv[])
+static const char *formats[] = {"tsv", "csv", "cidr", "jsonl"};
+
+static void usage(const char *prog)
 {
-    if (argc < 2 || (argc >= 3 && strcmp(argv[1], "-x") != 0)) {
-        printf("Usage: %s [-x] db-file\n", argv[0]);
-        return 1;
-    }
+    printf("Usage: %s [-x] [-f tsv|csv|cidr|jsonl] [-j threads] db-file\n"
+           "Without -f, the last IP of each range and its location are dumped.\n", prog);
+    exit(1);
+}
 
-    ip_db_t *ipdb = NULL;
+int main(int argc, const char *argv[])
+{
     const char *file = NULL;
+    int extended = 0, format = -1, threads = 1, i;
 
-    if (argc == 2) {
-        file = argv[1];
-        ipdb = ip_db_init(file);
-    } else {
-        file = argv[2];
-        ipdb = ip_db_init_x(file);
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-x") == 0) {
+            extended = 1;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            ++i;
+            for (format = 3; format >= 0 && strcmp(argv[i], formats[format]) != 0; --format);
+            if (format < 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (argv[i][0] == '-' || file) {
+            usage(argv[0]);
+        } else {
+            file = argv[i];
+        }
     }
 
+    if (!file) {
+        usage(argv[0]);
+    }
+
+    ip_db_t *ipdb = extended ? ip_db_init_x(file) : ip_db_init(file);
     if (!ipdb) {
         fprintf(stderr, "Failed to init ip db from %s\n", file);
         return -1;
     }
 
-    ip_db_dump(ipdb);
+    int rc = 0;
+    if (format < 0) {
+        ip_db_dump(ipdb);
+    } else if (ip_db_export(ipdb, STDOUT_FILENO, format, threads) != 0) {
+        fprintf(stderr, "Failed to export ip db from %s\n", file);
+        rc = -1;
+    }
+
     ip_db_destroy(&ipdb);
-    return 0;
+    return rc;
 }
-
@@ -0,0 +1,464 @@
+/*
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//
+// iploc-enrich appends the location of an IP column to every line of
+// a log. The input is mapped (or read from stdin in large chunks) and
+// cut into line aligned chunks, which a pool of worker threads enrich
+// with batched lookups. Chunks are written back in input order, each
+// with a single write, and throughput is reported on stderr.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "iploc.h"
+
+#define CHUNK_SIZE (4 << 20)
+#define BATCH 256
+
+typedef enum { JOB_FREE, JOB_READY, JOB_DONE } job_state_t;
+
+typedef struct {
+    const char *in;     // input lines, always ending with a complete line
+    size_t in_len;
+    char *buf;          // storage for |in| when reading from a stream
+    char *out;          // enriched lines
+    size_t out_len;
+    size_t out_cap;
+    size_t lines;
+    job_state_t state;
+} job_t;
+
+typedef struct {
+    ip_db_t *db;
+    char delim;
+    int field;          // 1-based index of the IP column
+    job_t *jobs;
+    size_t njobs;
+    size_t submitted;   // jobs handed to workers so far
+    size_t taken;       // jobs picked up by workers so far
+    int eof;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+} pool_t;
+
+static void out_reserve(job_t *job, size_t extra)
+{
+    if (job->out_len + extra > job->out_cap) {
+        size_t cap = job->out_cap ? job->out_cap : CHUNK_SIZE;
+        while (cap < job->out_len + extra) {
+            cap *= 2;
+        }
+        job->out = realloc(job->out, cap);
+        job->out_cap = cap;
+    }
+}
+
+// ------------------------------------------------------------------
+// Find the IP column of a line. Return its length, or -1 if the line
+// has fewer columns.
+
+static long find_field(const char *line, size_t len, char delim, int field, const char **start)
+{
+    const char *p = line, *end = line + len;
+
+    while (--field > 0) {
+        p = memchr(p, delim, end - p);
+        if (!p) {
+            return -1;
+        }
+        ++p;
+    }
+
+    const char *stop = memchr(p, delim, end - p);
+    *start = p;
+    return (stop ? stop : end) - p;
+}
+
+// ------------------------------------------------------------------
+// Enrich a batch of lines: look up the IPs of those that have one
+// (|ips| holds them in order) at once, then append each line followed
+// by the delimiter and its location ("-" if unknown or without IP).
+
+static void flush_batch(pool_t *pool, job_t *job, const char **lines,
+                        size_t *lens, const char *has_ip, uint32_t *ips, size_t n)
+{
+    ip_text_t locs[BATCH];
+    size_t i, k = 0;
+
+    for (i = 0; i < n; ++i) {
+        k += has_ip[i];
+    }
+    ip_locate_batch(pool->db, ips, k, locs);
+
+    for (i = 0, k = 0; i < n; ++i) {
+        const ip_text_t *loc = has_ip[i] ? &locs[k++] : NULL;
+        const char *text = loc && loc->text ? loc->text : "-";
+        size_t tlen = loc && loc->text ? loc->len : 1;
+
+        out_reserve(job, lens[i] + tlen + 2);
+        char *o = job->out + job->out_len;
+        memcpy(o, lines[i], lens[i]);
+        o += lens[i];
+        *o++ = pool->delim;
+        memcpy(o, text, tlen);
+        o += tlen;
+        *o++ = '\n';
+        job->out_len = o - job->out;
+    }
+}
+
+static void enrich_job(pool_t *pool, job_t *job)
+{
+    const char *lines[BATCH];
+    size_t lens[BATCH];
+    uint32_t ips[BATCH];
+    char has_ip[BATCH];
+    size_t n = 0, k = 0;
+    const char *p = job->in, *end = job->in + job->in_len;
+
+    job->out_len = 0;
+    job->lines = 0;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        size_t len = (eol ? eol : end) - p;
+        const char *ip;
+        long iplen = find_field(p, len, pool->delim, pool->field, &ip);
+
+        lines[n] = p;
+        lens[n] = len;
+        has_ip[n] = iplen >= 0 && ip_parse_v4(ip, iplen, &ips[k]) == 0;
+        k += has_ip[n];
+
+        if (++n == BATCH) {
+            flush_batch(pool, job, lines, lens, has_ip, ips, n);
+            n = k = 0;
+        }
+
+        job->lines++;
+        p = eol ? eol + 1 : end;
+    }
+
+    if (n) {
+        flush_batch(pool, job, lines, lens, has_ip, ips, n);
+    }
+}
+
+static void* worker(void *arg)
+{
+    pool_t *pool = (pool_t*)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->taken == pool->submitted && !pool->eof) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->taken == pool->submitted) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        job_t *job = &pool->jobs[pool->taken++ % pool->njobs];
+        pthread_mutex_unlock(&pool->lock);
+
+        enrich_job(pool, job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// ------------------------------------------------------------------
+// Wait for the oldest job to finish, write it out and free its slot.
+
+static size_t retire(pool_t *pool, size_t seq, int out)
+{
+    job_t *job = &pool->jobs[seq % pool->njobs];
+
+    pthread_mutex_lock(&pool->lock);
+    while (job->state != JOB_DONE) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    write_all(out, job->out, job->out_len);
+    job->state = JOB_FREE;
+    return job->lines;
+}
+
+static void submit(pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs[pool->submitted % pool->njobs].state = JOB_READY;
+    pool->submitted++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// ------------------------------------------------------------------
+// Fill a job from a stream: the carried over partial line, then as
+// much input as fits, cut after the last complete line.
+// Return 0 at end of input.
+
+static int fill_from_stream(job_t *job, int fd, char *carry, size_t *carry_len)
+{
+    if (!job->buf) {
+        job->buf = malloc(CHUNK_SIZE * 2);
+    }
+
+    size_t len = *carry_len;
+    memcpy(job->buf, carry, len);
+
+    while (len < CHUNK_SIZE) {
+        ssize_t n = read(fd, job->buf + len, CHUNK_SIZE * 2 - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+
+    // A line longer than a whole buffer is cut where the buffer ends,
+    // and without more input the partial line is the last one.
+    char *eol = len ? memrchr(job->buf, '\n', len) : NULL;
+    size_t cut = eol ? (size_t)(eol - job->buf) + 1 : len;
+
+    if (len < CHUNK_SIZE) {
+        cut = len;
+    }
+
+    *carry_len = len - cut;
+    memcpy(carry, job->buf + cut, *carry_len);
+    job->in = job->buf;
+    job->in_len = cut;
+    return cut > 0;
+}
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-x] [-d db-file] [-t delim] [-f field] [-j threads] [-o output] [input]\n"
+            "Appends the location of the IP in column |field| (1-based, default 1,\n"
+            "columns split by |delim|, default space) to every line.\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *db_path = NULL;
+    const char *in_path = NULL;
+    const char *out_path = NULL;
+    uint32_t flags = IP_DB_SIMD | IP_DB_MMAP;
+    pool_t pool;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.delim = ' ';
+    pool.field = 1;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-x") == 0) {
+            flags |= IP_DB_EXTENDED;
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            db_path = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            ++i;
+            pool.delim = strcmp(argv[i], "\\t") == 0 ? '\t' : argv[i][0];
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            pool.field = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (argv[i][0] == '-' && argv[i][1] != 0) {
+            usage(argv[0]);
+        } else if (in_path) {
+            usage(argv[0]);
+        } else {
+            in_path = argv[i];
+        }
+    }
+
+    if (pool.field < 1 || pool.delim == 0 || pool.delim == '\n') {
+        usage(argv[0]);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (!db_path) {
+        db_path = flags & IP_DB_EXTENDED ? "17monipdb.datx" : "17monipdb.dat";
+    }
+
+    pool.db = ip_db_init_ex(db_path, flags);
+    if (!pool.db) {
+        fprintf(stderr, "Failed to init ip db from %s\n", db_path);
+        return -1;
+    }
+
+    int in = 0;
+    if (in_path && strcmp(in_path, "-") != 0) {
+        in = open(in_path, O_RDONLY);
+        if (in < 0) {
+            fprintf(stderr, "Cannot open %s\n", in_path);
+            return -1;
+        }
+    }
+
+    int out = 1;
+    if (out_path) {
+        out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            fprintf(stderr, "Cannot open %s\n", out_path);
+            return -1;
+        }
+    }
+
+    // Regular files are mapped, anything else is streamed.
+    struct stat st;
+    const char *map = NULL;
+    size_t map_len = 0, map_pos = 0;
+    if (fstat(in, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map_len = st.st_size;
+        map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, in, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        } else {
+            madvise((void*)map, map_len, MADV_SEQUENTIAL);
+        }
+    }
+
+    pool.njobs = threads * 2;
+    pool.jobs = calloc(pool.njobs, sizeof(job_t));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    for (i = 0; i < threads; ++i) {
+        pthread_create(&tids[i], NULL, worker, &pool);
+    }
+
+    char *carry = map ? NULL : malloc(CHUNK_SIZE * 2);
+    size_t carry_len = 0;
+    size_t written = 0, lines = 0, bytes = 0;
+    double start = now_sec();
+
+    for (;;) {
+        if (pool.submitted - written == pool.njobs) {
+            lines += retire(&pool, written++, out);
+        }
+
+        job_t *job = &pool.jobs[pool.submitted % pool.njobs];
+        if (map) {
+            if (map_pos == map_len) {
+                break;
+            }
+            size_t len = map_len - map_pos;
+            if (len > CHUNK_SIZE) {
+                const char *eol = memchr(map + map_pos + CHUNK_SIZE, '\n', len - CHUNK_SIZE);
+                len = eol ? (size_t)(eol - (map + map_pos)) + 1 : len;
+            }
+            job->in = map + map_pos;
+            job->in_len = len;
+            map_pos += len;
+        } else if (!fill_from_stream(job, in, carry, &carry_len)) {
+            break;
+        }
+
+        bytes += job->in_len;
+        submit(&pool);
+    }
+
+    while (written < pool.submitted) {
+        lines += retire(&pool, written++, out);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.eof = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+
+    double secs = now_sec() - start;
+    fprintf(stderr, "enriched %zu lines, %zu bytes in %.3f sec: %.1f MB/s, %.0f lines/s, %d threads\n",
+            lines, bytes, secs, bytes / secs / 1e6, lines / secs, threads);
+
+    for (i = 0; i < (int)pool.njobs; ++i) {
+        free(pool.jobs[i].buf);
+        free(pool.jobs[i].out);
+    }
+    free(pool.jobs);
+    free(tids);
+    free(carry);
+    if (map) {
+        munmap((void*)map, map_len);
+    }
+    if (out != 1) {
+        close(out);
+    }
+    ip_db_destroy(&pool.db);
+    return 0;
+}
@@ -21,11 +21,26 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include "iploc.h"
 
 typedef unsigned char byte;
@@ -69,14 +84,69 @@ static inline uint decode_uint32_le(byte *b)
 struct _ip_db_t
 {
     byte extended;      // datx or dat?
+    byte mapped;        // raw is a read-only file mapping rather than a heap copy
+    byte hint_inplace;  // hint points into raw rather than a decoded copy
     uint hindex_size;   // size of the index of a hint
     uint hint_size;     // size of bytes total hint area occupies
     uint index_num;     // total number of indexed IP in the DB
+    uint merged_num;    // entries merged into their successor (IP_DB_COMPACT)
     uint index_size;    // size of an index chunk
     uint *hint;         // hint for the number of indexed IP in each IP segment
-    byte *raw;          // raw data copied from 17MON DB file
+    byte *raw;          // raw data copied (or mapped) from 17MON DB file
+    size_t raw_len;     // size of raw in bytes
     byte *index;        // pointer to the first index
     byte *text;         // pointer to ip description section
+    byte *text_base;    // base the text offsets of the index are relative to
+    uint *keys;         // decoded IP of each index entry (IP_DB_DECODE)
+    uint *offsets;      // decoded text offset of each entry
+    uint16_t *lens;     // decoded text length of each entry
+    byte *pool;         // joined texts of the selected .ipdb columns
+    size_t pool_len;
+    uint *ey_keys;      // keys of each hint range in Eytzinger order (IP_DB_EYTZINGER)
+    uint *ey_pos;       // index position of each slot of ey_keys
+    uint *ey_base;      // start slot of each hint range in ey_keys
+    uint (*search)(ip_db_t *db, uint ip_val);   // search engine in use
+    void (*locate)(ip_db_t *db, uint ip_val, const char **text, uint *len); // search and text
+    uint (*count_below)(const uint *keys, uint ip_val); // SIMD kernel (IP_DB_SIMD)
+    uint *tbl24;        // entry of each /24, or a tbl8 chunk if split (IP_DB_DIRECT)
+    uint *tbl8;         // entry of each IP in split /24s, 256 per chunk
+    uint tbl8_num;      // number of tbl8 chunks
+    uint *loc_of;       // location id of each entry (IP_DB_LOC_IDS)
+    uint *loc_offset;   // text offset of each unique location
+    uint16_t *loc_len;  // text length of each unique location
+    uint loc_num;       // number of unique locations
+    uint *field_base;   // first slot of each location in field_pos (IP_DB_FIELDS)
+    uint *field_pos;    // start of each field of a location, then len+1
+    uint *inv_slots;    // group id + 1 of each hash slot, 0 if empty (IP_DB_INVERTED)
+    uint inv_cap;       // number of hash slots, a power of 2
+    uint *inv_loc;      // location whose field names each group
+    uint *inv_field;    // field number naming each group, or IP_FIELD_TEXT
+    uint *inv_base;     // first slot of each group in inv_entries
+    uint *inv_entries;  // index entries of each group, ascending
+    uint inv_num;       // number of groups
+    uint64_t load_ns;   // time taken to load the DB
+    uint v6_num;        // number of IPv6 ranges, gaps included (ip_db_load_v6)
+    uint *v6_hint;      // first range ending in each /16, IP_V6_BUCKETS + 1
+    uint *v6_sub;       // 1 + chunk of v6_chunks splitting each /16, or 0
+    uint *v6_chunks;    // first range ending in each /24 of a crowded /16
+    uint v6_chunk_num;
+    uint64_t *v6_hi;    // upper half of the last IP of each range
+    uint64_t *v6_lo;    // lower half of the last IP of each range
+    uint *v6_offset;    // text offset of each range, IP_V6_GAP if unassigned
+    uint16_t *v6_len;   // text length of each range
+    char *v6_text;      // IPv6 range file the texts point into
+    size_t v6_text_len;
+    byte *region;       // single mapping holding the tables (IP_DB_HUGEPAGES, replicas)
+    size_t region_len;
+    byte huge;          // region backed by transparent (1) or explicit (2) huge pages
+    size_t locked;      // bytes locked in memory (IP_DB_LOCK)
+    struct _ip_db_t **replicas; // copy for each NUMA node, if several (IP_DB_NUMA)
+    uint node_num;      // number of slots of replicas
+    int *node_of_cpu;   // NUMA node of each CPU
+    uint cpu_num;
+#ifdef IPLOC_STATS
+    struct _ip_stats_slot_t *stats; // per-thread lookup counters
+#endif
 };
 
 // ------------------------------------------------------------------
@@ -104,6 +174,98 @@ ip_db_hint_get_high(ip_db_t *db, uint ip_val)
     return (hid == limit ? db->index_num-1 : db->hint[hid+1]);
 }
 
+// ------------------------------------------------------------------
+// Lookup instrumentation, compiled in with -DIPLOC_STATS. Each thread
+// counts into its own cache line sized slot of the DB (threads beyond
+// IP_STATS_SLOTS share slots, and may then lose a few counts), and the
+// search engines count their probes in a thread local depth. Without
+// IPLOC_STATS all of it compiles away.
+
+#ifdef IPLOC_STATS
+
+#define IP_STATS_SLOTS 64
+
+typedef struct _ip_stats_slot_t {
+    _Atomic uint64_t lookups;
+    _Atomic uint64_t failures;
+    _Atomic uint64_t depth[IP_STATS_DEPTHS];
+    _Atomic uint64_t *_Atomic buckets;  // lookups, then total depth, of each hint bucket
+} __attribute__((aligned(64))) ip_stats_slot_t;
+
+static __thread uint ip_stats_depth;    // probes of the current search
+static __thread uint ip_stats_slot_id;  // slot + 1 of this thread, 0 until assigned
+static atomic_uint ip_stats_threads;
+
+#define IP_STATS_PROBE() (++ip_stats_depth)
+
+// ------------------------------------------------------------------
+// Add to a counter only its owner thread updates: relaxed atomics keep
+// concurrent snapshots tear-free, and compile to a plain add.
+
+static inline void
+ip_stats_add(_Atomic uint64_t *c, uint64_t n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline ip_stats_slot_t*
+ip_stats_slot(ip_db_t *db)
+{
+    if (ip_stats_slot_id == 0) {
+        ip_stats_slot_id = atomic_fetch_add(&ip_stats_threads, 1) % IP_STATS_SLOTS + 1;
+    }
+    return &db->stats[ip_stats_slot_id - 1];
+}
+
+// ------------------------------------------------------------------
+// Count a search of |ip_val| that took |depth| probes.
+
+static void
+ip_stats_record(ip_db_t *db, uint ip_val, uint depth)
+{
+    ip_stats_slot_t *s = ip_stats_slot(db);
+    ip_stats_add(&s->lookups, 1);
+    ip_stats_add(&s->depth[depth < IP_STATS_DEPTHS ? depth : IP_STATS_DEPTHS-1], 1);
+
+    // Bucket counters are allocated by the first thread to need them.
+    _Atomic uint64_t *b = atomic_load_explicit(&s->buckets, memory_order_acquire);
+    if (!b) {
+        uint hint_num = 1 << (8*db->hindex_size);
+        _Atomic uint64_t *fresh = calloc(2*hint_num, sizeof(uint64_t)), *none = NULL;
+        if (!fresh) {
+            return;
+        }
+        if (atomic_compare_exchange_strong(&s->buckets, &none, fresh)) {
+            b = fresh;
+        } else {
+            free(fresh);
+            b = none;
+        }
+    }
+
+    uint hid = ip_val >> (8*(4-db->hindex_size));
+    ip_stats_add(&b[2*hid], 1);
+    ip_stats_add(&b[2*hid+1], depth);
+}
+
+// ------------------------------------------------------------------
+// Count |n| failed lookups.
+
+static inline void
+ip_stats_fail(ip_db_t *db, uint n)
+{
+    if (db && db->stats) {
+        ip_stats_add(&ip_stats_slot(db)->failures, n);
+    }
+}
+
+#else
+
+#define IP_STATS_PROBE() ((void)0)
+
+#endif
+
 // ------------------------------------------------------------------
 // ip_db_index_get_ip returns the value of the nth-indexed IP
 
@@ -143,7 +305,58 @@ ip_db_index_get_text_len(ip_db_t *db, uint n)
 static inline const char*
 ip_db_get_text(ip_db_t *db, uint offset)
 {
-    return (const char*)(db->text + offset - db->hint_size);
+    return (const char*)(db->text_base + offset);
+}
+
+// ------------------------------------------------------------------
+// ip_db_key returns the IP of the nth entry, from the decoded key
+// array if there is one.
+
+static inline uint
+ip_db_key(ip_db_t *db, uint n)
+{
+    return db->keys ? db->keys[n] : ip_db_index_get_ip(db, n);
+}
+
+// ------------------------------------------------------------------
+// ip_db_key_addr returns the address ip_db_key reads for the nth
+// entry, for prefetching.
+
+static inline const void*
+ip_db_key_addr(ip_db_t *db, uint n)
+{
+    return db->keys ? (const void*)(db->keys + n)
+                    : (const void*)(db->index + n*db->index_size);
+}
+
+// ------------------------------------------------------------------
+// ip_db_entry_text returns the description text of the nth entry.
+
+static inline const char*
+ip_db_entry_text(ip_db_t *db, uint n)
+{
+    return ip_db_get_text(db, db->offsets ? db->offsets[n]
+                                          : ip_db_index_get_offset(db, n));
+}
+
+// ------------------------------------------------------------------
+// ip_db_entry_len returns the description text length of the nth
+// entry.
+
+static inline uint
+ip_db_entry_len(ip_db_t *db, uint n)
+{
+    return db->lens ? db->lens[n] : ip_db_index_get_text_len(db, n);
+}
+
+// ------------------------------------------------------------------
+// Allocate a cache line aligned array.
+
+static void*
+ip_db_alloc_aligned(size_t size)
+{
+    void *p = NULL;
+    return posix_memalign(&p, 64, size) == 0 ? p : NULL;
 }
 
 // ------------------------------------------------------------------
@@ -157,6 +370,69 @@ ip_db_new()
     return db;
 }
 
+// ------------------------------------------------------------------
+// ip_db_in_raw tells whether |p| points into the raw data of the DB,
+// as tables of a native DB do.
+
+static inline int
+ip_db_in_raw(ip_db_t *db, const void *p)
+{
+    const byte *b = (const byte*)p;
+    return db->raw && b >= db->raw && b < db->raw + db->raw_len;
+}
+
+static inline int
+ip_db_in_region(ip_db_t *db, const void *p)
+{
+    const byte *b = (const byte*)p;
+    return db->region && b >= db->region && b < db->region + db->region_len;
+}
+
+// ------------------------------------------------------------------
+// ip_db_owned tells whether |p| was allocated on its own for the DB,
+// as opposed to pointing into its raw data or its packed region.
+
+static inline int
+ip_db_owned(ip_db_t *db, const void *p)
+{
+    return p && !ip_db_in_raw(db, p) && !ip_db_in_region(db, p);
+}
+
+// ------------------------------------------------------------------
+// Free a table of the DB unless it points into the raw data.
+
+static void
+ip_db_free(ip_db_t *db, void *p)
+{
+    if (ip_db_owned(db, p)) {
+        free(p);
+    }
+}
+
+// ------------------------------------------------------------------
+// Free the IPv6 range table of the DB.
+
+static void
+ip_db_free_v6(ip_db_t *db)
+{
+    free(db->v6_hint);
+    free(db->v6_sub);
+    free(db->v6_chunks);
+    free(db->v6_hi);
+    free(db->v6_lo);
+    free(db->v6_offset);
+    free(db->v6_len);
+    free(db->v6_text);
+    db->v6_hint = db->v6_sub = db->v6_chunks = NULL;
+    db->v6_chunk_num = 0;
+    db->v6_hi = db->v6_lo = NULL;
+    db->v6_offset = NULL;
+    db->v6_len = NULL;
+    db->v6_text = NULL;
+    db->v6_text_len = 0;
+    db->v6_num = 0;
+}
+
 // ------------------------------------------------------------------
 // Destroy an ip_db_t object and reclaim allocated memory as needed.
 
@@ -166,12 +442,62 @@ ip_db_destroy(ip_db_t **db)
     if (*db) {
         ip_db_t *p  = *db;
 
+        if (!p->hint_inplace) {
+            ip_db_free(p, p->hint);
+        }
+
+        ip_db_free(p, p->keys);
+        ip_db_free(p, p->offsets);
+        ip_db_free(p, p->lens);
+        ip_db_free(p, p->pool);
+        ip_db_free(p, p->ey_keys);
+        ip_db_free(p, p->ey_pos);
+        ip_db_free(p, p->ey_base);
+        ip_db_free(p, p->tbl24);
+        ip_db_free(p, p->tbl8);
+        ip_db_free(p, p->loc_of);
+        ip_db_free(p, p->loc_offset);
+        ip_db_free(p, p->loc_len);
+        ip_db_free(p, p->field_base);
+        ip_db_free(p, p->field_pos);
+        free(p->inv_slots);
+        free(p->inv_loc);
+        free(p->inv_field);
+        free(p->inv_base);
+        free(p->inv_entries);
+        ip_db_free_v6(p);
+
+#ifdef IPLOC_STATS
+        if (p->stats) {
+            int i;
+            for (i = 0; i < IP_STATS_SLOTS; ++i) {
+                free(p->stats[i].buckets);
+            }
+            free(p->stats);
+        }
+#endif
+
         if (p->raw) {
-            free(p->raw);
+            if (p->mapped) {
+                munmap(p->raw, p->raw_len);
+            } else if (!ip_db_in_region(p, p->raw)) {
+                free(p->raw);
+            }
         }
 
-        if (p->hint) {
-            free(p->hint);
+        // Replicas share every table but their packed region.
+        uint i;
+        for (i = 0; i < p->node_num; ++i) {
+            if (p->replicas[i]) {
+                munmap(p->replicas[i]->region, p->replicas[i]->region_len);
+                free(p->replicas[i]);
+            }
+        }
+        free(p->replicas);
+        free(p->node_of_cpu);
+
+        if (p->region) {
+            munmap(p->region, p->region_len);
         }
 
         free(p);
@@ -180,22 +506,22 @@ ip_db_destroy(ip_db_t **db)
 }
 
 // ------------------------------------------------------------------
-// Create and then initialize an ip_db_t object (implementation).
+// Read the whole DB file into a private heap buffer.
 
-ip_db_t*
-ip_db_init_impl(const char *path, byte extended)
+static int
+ip_db_read_file(ip_db_t *db, const char *path)
 {
     FILE *fp = fopen(path, "rb");
 
     if (!fp) {
         printf("Cannot open %s\n", path);
-        return NULL;
+        return -1;
     }
 
     if (fseek(fp, 0, SEEK_END) != 0) {
         printf("Cannot seek to the end of %s\n", path);
         fclose(fp);
-        return NULL;
+        return -1;
     }
 
     long flen = ftell(fp);
@@ -203,151 +529,4161 @@ ip_db_init_impl(const char *path, byte extended)
     if (fseek(fp, 0, SEEK_SET) != 0) {
         printf("Cannot seek to the start of %s\n", path);
         fclose(fp);
-        return NULL;
+        return -1;
     }
 
-    ip_db_t *db = ip_db_new();
     db->raw = (byte*)malloc(flen);
+    db->raw_len = flen;
 
     if (fread(db->raw, flen, 1, fp) != 1) {
         printf("Failed to read %s\n", path);
         fclose(fp);
-        ip_db_destroy(&db);
-        return NULL;
+        return -1;
     }
 
     fclose(fp);
+    return 0;
+}
 
-    db->extended = extended;
-    uint hindex_size = extended ? 2 : 1;
-    db->hindex_size = hindex_size;
-    db->index_size = 4 + 3 + hindex_size;
+// ------------------------------------------------------------------
+// Map the whole DB file read-only. The mapping is shared, so every
+// process mapping the same file is backed by the same page cache.
 
-    uint hint_num = 1 << (hindex_size*8);
-    uint hint_size = sizeof(uint) * hint_num;
-    db->hint = malloc(hint_size);
-    db->hint_size = hint_size;
+static int
+ip_db_map_file(ip_db_t *db, const char *path)
+{
+    int fd = open(path, O_RDONLY);
 
-    int i = 0;
-    byte *pos = db->raw + 4;
-    for (; i < hint_num; i++) {
-        db->hint[i] = decode_uint32_le(pos);
-        pos += 4;
+    if (fd < 0) {
+        printf("Cannot open %s\n", path);
+        return -1;
     }
 
-    uint text_offset = decode_uint32_be(db->raw);
-    db->text = db->raw + text_offset;
-    db->index = db->raw + 4 + hint_size;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        printf("Cannot stat %s\n", path);
+        close(fd);
+        return -1;
+    }
 
-    // There's a reserved area in the end of the index area. Its size
-    // is equal to |hint_size|.
-    db->index_num = ((db->text - db->index) - hint_size) / db->index_size;
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
 
-    return db;
+    if (p == MAP_FAILED) {
+        printf("Failed to map %s\n", path);
+        return -1;
+    }
+
+    db->raw = (byte*)p;
+    db->raw_len = st.st_size;
+    db->mapped = 1;
+    return 0;
 }
 
 // ------------------------------------------------------------------
-// Create and then initialize an ip_db_t object using a 17MON DB file.
+// ip_db_search_packed returns the position of the index entry that
+// covers |ip_val|. Binary Search over the packed index is under the
+// hood, with the entry stride and hint shift of the DB read at runtime.
+// Only used with IP_DB_GENERIC, to measure the specialized variants
+// below against.
 
-ip_db_t*
-ip_db_init(const char *path)
+static uint
+ip_db_search_packed(ip_db_t *db, uint ip_val)
 {
-    return ip_db_init_impl(path, 0);
+    uint low = ip_db_hint_get_low(db, ip_val);
+    uint high = ip_db_hint_get_high(db, ip_val);
+
+    while (low < high) {
+        uint mid = low + (high - low)/2;
+        uint ip_indexed = ip_db_index_get_ip(db, mid);
+        IP_STATS_PROBE();
+
+        if (ip_val > ip_indexed) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return high;
 }
 
 // ------------------------------------------------------------------
-// Create and then initialize an ip_db_t object using an extended
-// 17MON DB file.
+// IP_DB_SEARCH_PACKED defines ip_db_search_packed_<fmt>, which returns
+// the position of the index entry that covers |ip_val| by binary search
+// over the packed index. The hint index width is a constant of each
+// format, so the entry stride and the hint shift fold at compile time
+// instead of being loaded from the DB in the loop.
 
-ip_db_t*
-ip_db_init_x(const char *path)
-{
-    return ip_db_init_impl(path, 1);
+#define IP_DB_SEARCH_PACKED(fmt, HINDEX_SIZE)                               \
+static uint                                                                 \
+ip_db_search_packed_##fmt(ip_db_t *db, uint ip_val)                         \
+{                                                                           \
+    const uint index_size = 4 + 3 + (HINDEX_SIZE);                          \
+    const uint limit = (1 << (8*(HINDEX_SIZE))) - 1;                        \
+    const byte *index = db->index;                                          \
+    uint hid = ip_val >> (8*(4 - (HINDEX_SIZE)));                           \
+    uint low = db->hint[hid];                                               \
+    uint high = hid == limit ? db->index_num - 1 : db->hint[hid+1];         \
+                                                                            \
+    while (low < high) {                                                    \
+        uint mid = low + (high - low)/2;                                    \
+        uint ip_indexed = decode_uint32_be((byte*)index + mid*index_size);  \
+        IP_STATS_PROBE();                                                   \
+                                                                            \
+        if (ip_val > ip_indexed) {                                          \
+            low = mid + 1;                                                  \
+        } else {                                                            \
+            high = mid;                                                     \
+        }                                                                   \
+    }                                                                       \
+                                                                            \
+    return high;                                                            \
 }
 
+IP_DB_SEARCH_PACKED(dat, 1)
+IP_DB_SEARCH_PACKED(datx, 2)
+
 // ------------------------------------------------------------------
-// Get the host representation of an ipv4 address. Return 0 on 
-// malformed input.
+// Run |search| on the DB, counting the search when instrumented.
 
 static inline uint
-get_ip_val(const char *ipv4)
+ip_db_search_with(ip_db_t *db, uint (*search)(ip_db_t*, uint), uint ip_val)
 {
-    struct in_addr addr;
-    return inet_pton(AF_INET, ipv4, &addr) == 1 ? ntohl(addr.s_addr) : 0;
+#ifdef IPLOC_STATS
+    ip_stats_depth = 0;
+    uint n = search(db, ip_val);
+    ip_stats_record(db, ip_val, ip_stats_depth);
+    return n;
+#else
+    return search(db, ip_val);
+#endif
 }
 
 // ------------------------------------------------------------------
-// Search an ipv4 address in DB and return related description text.
-// Return 0 on success, and -1 if any input is invalid.
+// Run the search engine of the DB, counting the search when
+// instrumented.
 
-int
-ip_locate(ip_db_t *db, const char *ipv4, char *result)
+static inline uint
+ip_db_search(ip_db_t *db, uint ip_val)
 {
-    return ip_locate_v(db, get_ip_val(ipv4), result);
+    return ip_db_search_with(db, db->search, ip_val);
 }
 
 // ------------------------------------------------------------------
-// IP search implementation. Binary Search is under the hood.
-// Return 0 on success, and -1 if any input is invalid.
+// Find the text of the entry covering |ip_val|, whatever the engine.
+// This is the |locate| of every DB but packed ones.
 
-int
-ip_locate_v(ip_db_t *db, uint32_t ip_val, char *result)
+static void
+ip_db_locate_any(ip_db_t *db, uint ip_val, const char **text, uint *len)
 {
-    if (db == NULL || ip_val == 0 || result == NULL) {
-        return -1;
-    }
+    uint n = ip_db_search(db, ip_val);
+    *text = ip_db_entry_text(db, n);
+    *len = ip_db_entry_len(db, n);
+}
+
+// ------------------------------------------------------------------
+// IP_DB_LOCATE_PACKED defines ip_db_locate_packed_<fmt>, the |locate|
+// of a packed DB of one format: its search inlined, and the text
+// offset and length decoded at a constant position and width.
+
+#define IP_DB_LOCATE_PACKED(fmt, HINDEX_SIZE, EXTENDED)                     \
+static void                                                                 \
+ip_db_locate_packed_##fmt(ip_db_t *db, uint ip_val, const char **text,      \
+                          uint *len)                                        \
+{                                                                           \
+    uint n = ip_db_search_with(db, ip_db_search_packed_##fmt, ip_val);      \
+    byte *pos = db->index + n*(4 + 3 + (HINDEX_SIZE));                      \
+    *text = (const char*)db->text_base + decode_uint24_le(pos + 4);         \
+    *len = (EXTENDED) ? decode_uint16_be(pos + 7) : pos[7];                 \
+}
 
+IP_DB_LOCATE_PACKED(dat, 1, 0)
+IP_DB_LOCATE_PACKED(datx, 2, 1)
+
+// ------------------------------------------------------------------
+// ip_db_search_keys is the counterpart of ip_db_search_packed_* over
+// the decoded key array, which keeps the whole search within a dense
+// array of native integers.
+
+static uint
+ip_db_search_keys(ip_db_t *db, uint ip_val)
+{
+    const uint *keys = db->keys;
     uint low = ip_db_hint_get_low(db, ip_val);
     uint high = ip_db_hint_get_high(db, ip_val);
 
     while (low < high) {
         uint mid = low + (high - low)/2;
-        uint ip_indexed = ip_db_index_get_ip(db, mid);
+        IP_STATS_PROBE();
 
-        if (ip_val > ip_indexed) {
+        if (ip_val > keys[mid]) {
             low = mid + 1;
         } else {
             high = mid;
         }
     }
 
-    uint offset = ip_db_index_get_offset(db, high);
-    uint len = ip_db_index_get_text_len(db, high);
-    const char *text = ip_db_get_text(db, offset);
+    return high;
+}
+
+// ------------------------------------------------------------------
+// ip_db_search_eytzinger is the counterpart of ip_db_search_packed_*
+// over the Eytzinger layout of the hint range. Slot k of a range has
+// its children at 2k and 2k+1, so the search descends without
+// branching on the comparison, and the 16 slots 4 levels down share a
+// cache line which is prefetched ahead. Prefetching past the end of
+// the array is harmless as prefetches never fault.
+
+static uint
+ip_db_search_eytzinger(ip_db_t *db, uint ip_val)
+{
+    uint hid = ip_val >> (8*(4-db->hindex_size));
+    uint base = db->ey_base[hid];
+    uint n = db->ey_base[hid+1] - base - 1;
+    const uint *t = db->ey_keys + base;
+    uint k = 1;
+
+    while (k <= n) {
+        __builtin_prefetch(t + 16*k);
+        k = 2*k + (t[k] < ip_val);
+        IP_STATS_PROBE();
+    }
+
+    // Drop the trailing right turns plus the final left one to get the
+    // last slot where the search turned left, i.e. the first key that
+    // is not below |ip_val|. k == 0 means no such key.
+    k >>= __builtin_ffs(~k);
+    return k ? db->ey_pos[base + k] : ip_db_hint_get_high(db, ip_val);
+}
+
+// ------------------------------------------------------------------
+// Fill slots of an Eytzinger layout with keys[i..] in order. Return
+// the next key position to consume.
+
+static uint
+ip_db_eytzinger_fill(ip_db_t *db, uint *t, uint *pos, uint n, uint k, uint i, uint first)
+{
+    if (k <= n) {
+        i = ip_db_eytzinger_fill(db, t, pos, n, 2*k, i, first);
+        t[k] = ip_db_key(db, first + i);
+        pos[k] = first + i;
+        i = ip_db_eytzinger_fill(db, t, pos, n, 2*k+1, i + 1, first);
+    }
+    return i;
+}
+
+// ------------------------------------------------------------------
+// Lay out the keys of each hint range [low, high) in Eytzinger order.
+// A search falling off every key of the range resolves to |high|,
+// exactly as the binary search does. Return 0 on success, -1 on
+// allocation failure.
+
+static int
+ip_db_build_eytzinger(ip_db_t *db)
+{
+    uint hint_num = 1 << (8*db->hindex_size);
+    size_t slots = 0;
+    uint hid;
+
+    db->ey_base = malloc(sizeof(uint) * (hint_num + 1));
+    if (!db->ey_base) {
+        return -1;
+    }
+
+    // Each range gets an unused slot 0 so that its root is slot 1.
+    for (hid = 0; hid < hint_num; ++hid) {
+        uint ip_val = hid << (8*(4-db->hindex_size));
+        uint low = ip_db_hint_get_low(db, ip_val);
+        uint high = ip_db_hint_get_high(db, ip_val);
+        db->ey_base[hid] = slots;
+        slots += 1 + (low < high ? high - low : 0);
+    }
+    db->ey_base[hint_num] = slots;
+
+    db->ey_keys = ip_db_alloc_aligned(sizeof(uint) * slots);
+    db->ey_pos = ip_db_alloc_aligned(sizeof(uint) * slots);
+    if (!db->ey_keys || !db->ey_pos) {
+        return -1;
+    }
+
+    for (hid = 0; hid < hint_num; ++hid) {
+        uint base = db->ey_base[hid];
+        uint n = db->ey_base[hid+1] - base - 1;
+        uint low = ip_db_hint_get_low(db, hid << (8*(4-db->hindex_size)));
+        ip_db_eytzinger_fill(db, db->ey_keys + base, db->ey_pos + base, n, 1, 0, low);
+    }
 
-    strncpy(result, text, len);
-    result[len] = 0;
     return 0;
 }
 
 // ------------------------------------------------------------------
-// Dump the whole DB to stdout.
-//
+// Number of keys the SIMD kernels compare at once. Searches narrow a
+// range with plain binary search until it fits in one window.
 
-void ip_db_dump(ip_db_t *db)
+#define IP_SIMD_SPAN 32
+
+#if defined(__SSE2__)
+
+// ------------------------------------------------------------------
+// SSE2 kernel, 4 keys per compare. SSE2 only has signed compares, so
+// both sides are biased by 2^31 first.
+
+static uint
+ip_count_below_sse2(const uint *keys, uint ip_val)
 {
-    fprintf(stderr, "extended=%u, index_num=%u\n", db->extended, db->index_num);
+    const __m128i bias = _mm_set1_epi32(0x80000000);
+    const __m128i x = _mm_xor_si128(_mm_set1_epi32(ip_val), bias);
+    __m128i acc = _mm_setzero_si128();
+    uint i;
 
-    char buf[65536];
-    uint i = 0;
+    for (i = 0; i < IP_SIMD_SPAN; i += 4) {
+        __m128i k = _mm_loadu_si128((const __m128i*)(keys + i));
+        acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(x, _mm_xor_si128(k, bias)));
+    }
 
-    for (; i < db->index_num; ++i) {
-        uint ip_val = ip_db_index_get_ip(db, i);
-        struct in_addr in;
-        in.s_addr = htonl(ip_val);
-        char *ip = inet_ntoa(in);
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(acc);
+}
 
-        uint offset = ip_db_index_get_offset(db, i);
-        uint len = ip_db_index_get_text_len(db, i);
-        const char *text = ip_db_get_text(db, offset);
+// ------------------------------------------------------------------
+// AVX2 kernel, 8 keys per compare. Only used when the CPU supports it.
+
+__attribute__((target("avx2")))
+static uint
+ip_count_below_avx2(const uint *keys, uint ip_val)
+{
+    const __m256i bias = _mm256_set1_epi32(0x80000000);
+    const __m256i x = _mm256_xor_si256(_mm256_set1_epi32(ip_val), bias);
+    uint i, n = 0;
+
+    for (i = 0; i < IP_SIMD_SPAN; i += 8) {
+        __m256i k = _mm256_loadu_si256((const __m256i*)(keys + i));
+        __m256i lt = _mm256_cmpgt_epi32(x, _mm256_xor_si256(k, bias));
+        n += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(lt)));
+    }
+    return n;
+}
+
+#else
+
+// ------------------------------------------------------------------
+// Scalar kernel: count how many of the IP_SIMD_SPAN keys are below
+// |ip_val|. Keys are sorted, so the count is the lower bound within
+// the window.
+
+static uint
+ip_count_below_scalar(const uint *keys, uint ip_val)
+{
+    uint i, n = 0;
+    for (i = 0; i < IP_SIMD_SPAN; ++i) {
+        n += keys[i] < ip_val;
+    }
+    return n;
+}
 
-#ifdef DEBUG
-        printf("idx=%u,offset=%u,len=%u\n", i, offset, len);
 #endif
-        strncpy(buf, text, len);
-        buf[len] = 0;
 
-        printf("%s\t\t%s\n", ip, buf);
+// ------------------------------------------------------------------
+// Pick the fastest kernel the running CPU supports.
+
+static uint (*ip_count_below_select(void))(const uint*, uint)
+{
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return ip_count_below_avx2;
     }
+    return ip_count_below_sse2;
+#else
+    return ip_count_below_scalar;
+#endif
 }
 
+// ------------------------------------------------------------------
+// ip_db_search_simd is the counterpart of ip_db_search_keys that
+// finishes the search with one SIMD window count in place of the last
+// log2(IP_SIMD_SPAN) dependent probes.
+
+static uint
+ip_db_search_simd(ip_db_t *db, uint ip_val)
+{
+    const uint *keys = db->keys;
+    uint low = ip_db_hint_get_low(db, ip_val);
+    uint high = ip_db_hint_get_high(db, ip_val);
+
+    while (low < high && high - low >= IP_SIMD_SPAN) {
+        uint mid = low + (high - low)/2;
+        IP_STATS_PROBE();
+
+        if (ip_val > keys[mid]) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low >= high) {
+        return high;
+    }
+
+    // Every key before |low| is below |ip_val|, so the window count is
+    // the distance to the global lower bound, capped by the window.
+    IP_STATS_PROBE();
+    uint n = db->count_below(keys + low, ip_val);
+    return n < high - low ? low + n : high;
+}
+
+// ------------------------------------------------------------------
+// Flag marking a tbl24 slot that refers to a tbl8 chunk rather than
+// an index entry.
+
+#define IP_TBL8_FLAG 0x80000000
+
+// ------------------------------------------------------------------
+// ip_db_search_direct looks the IP up in the DIR-24-8 tables: one load
+// for a /24 covered by a single entry, two when the /24 is split.
+
+static uint
+ip_db_search_direct(ip_db_t *db, uint ip_val)
+{
+    uint e = db->tbl24[ip_val >> 8];
+    IP_STATS_PROBE();
+    if (e & IP_TBL8_FLAG) {
+        e = db->tbl8[((e & ~IP_TBL8_FLAG) << 8) | (ip_val & 0xff)];
+        IP_STATS_PROBE();
+    }
+    return e;
+}
+
+// ------------------------------------------------------------------
+// Advance |p| to the entry covering |ip_val| within the hint range
+// bounded by |high|. The caller walks IPs in ascending order.
+
+static inline uint
+ip_db_sweep(ip_db_t *db, uint p, uint high, uint ip_val)
+{
+    while (p < high && ip_db_key(db, p) < ip_val) {
+        ++p;
+    }
+    return p;
+}
+
+// ------------------------------------------------------------------
+// Build the DIR-24-8 tables with one ascending sweep over the index.
+// A /24 whose first and last IP resolve to the same entry is stored
+// directly, any other gets a 256 slot tbl8 chunk. Return 0 on success,
+// -1 on allocation failure or if the index is too large to flag.
+
+static int
+ip_db_build_direct(ip_db_t *db)
+{
+    if (db->index_num >= IP_TBL8_FLAG) {
+        return -1;
+    }
+
+    db->tbl24 = ip_db_alloc_aligned(sizeof(uint) << 24);
+    if (!db->tbl24) {
+        return -1;
+    }
+
+    uint cap = 1024;
+    uint b, j, p = 0;
+    db->tbl8 = malloc(sizeof(uint) * 256 * cap);
+    if (!db->tbl8) {
+        return -1;
+    }
+
+    for (b = 0; b < (1 << 24); ++b) {
+        uint start = b << 8;
+        uint low = ip_db_hint_get_low(db, start);
+        uint high = ip_db_hint_get_high(db, start);
+
+        if (p < low || p > high) {
+            p = low;
+        }
+
+        p = ip_db_sweep(db, p, high, start);
+        if (ip_db_sweep(db, p, high, start | 0xff) == p) {
+            db->tbl24[b] = p;
+            continue;
+        }
+
+        if (db->tbl8_num == cap) {
+            uint *t = realloc(db->tbl8, sizeof(uint) * 256 * cap * 2);
+            if (!t) {
+                return -1;
+            }
+            db->tbl8 = t;
+            cap *= 2;
+        }
+
+        uint *chunk = db->tbl8 + 256 * db->tbl8_num;
+        uint q = p;
+        for (j = 0; j < 256; ++j) {
+            q = ip_db_sweep(db, q, high, start | j);
+            chunk[j] = q;
+        }
+
+        db->tbl24[b] = IP_TBL8_FLAG | db->tbl8_num++;
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// FNV-1a hash of a text.
+
+static inline uint
+ip_text_hash(const char *text, uint len)
+{
+    uint h = 2166136261u;
+    uint i;
+    for (i = 0; i < len; ++i) {
+        h = (h ^ (byte)text[i]) * 16777619u;
+    }
+    return h;
+}
+
+// ------------------------------------------------------------------
+// Deduplicate the texts referenced by the index into a dense table of
+// locations, and map every entry to its location id. Entries sharing
+// an (offset, len) pair with the previous entry skip the hashing, and
+// any other is matched by content. Return 0 on success, -1 on
+// allocation failure.
+
+static int
+ip_db_build_locations(ip_db_t *db)
+{
+    uint n = db->index_num;
+    uint cap = 1024;
+    while (cap < 2*n) {
+        cap <<= 1;
+    }
+
+    uint *slots = malloc(sizeof(uint) * cap);    // location id + 1, 0 if empty
+    db->loc_of = malloc(sizeof(uint) * (n ? n : 1));
+    db->loc_offset = malloc(sizeof(uint) * (n ? n : 1));
+    db->loc_len = malloc(sizeof(uint16_t) * (n ? n : 1));
+
+    if (!slots || !db->loc_of || !db->loc_offset || !db->loc_len) {
+        free(slots);
+        return -1;
+    }
+    memset(slots, 0, sizeof(uint) * cap);
+
+    uint i, prev_offset = 0, prev_len = 0;
+    for (i = 0; i < n; ++i) {
+        uint offset = db->offsets ? db->offsets[i] : ip_db_index_get_offset(db, i);
+        uint len = ip_db_entry_len(db, i);
+
+        if (i > 0 && offset == prev_offset && len == prev_len) {
+            db->loc_of[i] = db->loc_of[i-1];
+            continue;
+        }
+        prev_offset = offset;
+        prev_len = len;
+
+        const char *text = ip_db_get_text(db, offset);
+        uint h = ip_text_hash(text, len) & (cap - 1);
+
+        for (;; h = (h + 1) & (cap - 1)) {
+            uint id = slots[h];
+            if (id == 0) {
+                id = db->loc_num++;
+                db->loc_offset[id] = offset;
+                db->loc_len[id] = len;
+                slots[h] = id + 1;
+                db->loc_of[i] = id;
+                break;
+            }
+
+            id -= 1;
+            if (db->loc_len[id] == len &&
+                (db->loc_offset[id] == offset ||
+                 memcmp(ip_db_get_text(db, db->loc_offset[id]), text, len) == 0)) {
+                db->loc_of[i] = id;
+                break;
+            }
+        }
+    }
+
+    free(slots);
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Split every unique location text at its tabs once, so lookups can
+// hand out fields without scanning. Location i owns the slots from
+// field_base[i] to field_base[i+1]-1: the start of each of its fields
+// followed by its length + 1. Fields past IP_FIELDS_MAX are folded
+// into the last one. Return 0 on success, -1 on allocation failure.
+
+static int
+ip_db_build_fields(ip_db_t *db)
+{
+    uint i, j, total = 0;
+
+    for (i = 0; i < db->loc_num; ++i) {
+        const char *text = ip_db_get_text(db, db->loc_offset[i]);
+        uint count = 1;
+        for (j = 0; j < db->loc_len[i]; ++j) {
+            count += text[j] == '\t';
+        }
+        total += (count < IP_FIELDS_MAX ? count : IP_FIELDS_MAX) + 1;
+    }
+
+    db->field_base = malloc(sizeof(uint) * (db->loc_num + 1));
+    db->field_pos = malloc(sizeof(uint) * (total ? total : 1));
+    if (!db->field_base || !db->field_pos) {
+        return -1;
+    }
+
+    uint slot = 0;
+    for (i = 0; i < db->loc_num; ++i) {
+        const char *text = ip_db_get_text(db, db->loc_offset[i]);
+        uint len = db->loc_len[i];
+        uint count = 1;
+
+        db->field_base[i] = slot;
+        db->field_pos[slot++] = 0;
+        for (j = 0; j < len && count < IP_FIELDS_MAX; ++j) {
+            if (text[j] == '\t') {
+                db->field_pos[slot++] = j + 1;
+                count++;
+            }
+        }
+        db->field_pos[slot++] = len + 1;
+    }
+    db->field_base[db->loc_num] = slot;
+
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Get field |field| of a location, or its whole text for IP_FIELD_TEXT.
+// The field must exist.
+
+static inline const char*
+ip_db_loc_key(ip_db_t *db, uint loc, uint field, uint *len)
+{
+    const char *text = ip_db_get_text(db, db->loc_offset[loc]);
+    if (field == IP_FIELD_TEXT) {
+        *len = db->loc_len[loc];
+        return text;
+    }
+
+    const uint *pos = db->field_pos + db->field_base[loc];
+    *len = pos[field+1] - pos[field] - 1;
+    return text + pos[field];
+}
+
+// ------------------------------------------------------------------
+// Hash slot of a (field, text) key of the inverted index.
+
+static inline uint
+ip_inv_hash(uint field, const char *text, uint len)
+{
+    return ip_text_hash(text, len) ^ (field * 2654435761u);
+}
+
+// ------------------------------------------------------------------
+// Find the group of a (field, text) key. Return its id, or -1.
+
+static int
+ip_db_find_group(ip_db_t *db, uint field, const char *text, uint len)
+{
+    uint mask = db->inv_cap - 1;
+    uint h = ip_inv_hash(field, text, len) & mask;
+
+    for (;; h = (h + 1) & mask) {
+        uint g = db->inv_slots[h];
+        if (g == 0) {
+            return -1;
+        }
+
+        g -= 1;
+        uint key_len;
+        const char *key = ip_db_loc_key(db, db->inv_loc[g], db->inv_field[g], &key_len);
+        if (db->inv_field[g] == field && key_len == len && memcmp(key, text, len) == 0) {
+            return g;
+        }
+    }
+}
+
+// ------------------------------------------------------------------
+// Build the inverted index: one group per distinct whole location text
+// and per distinct (field number, field text) pair, each listing the
+// index entries it covers in ascending order. Location l uses the
+// field_pos slots from field_base[l] to remember its groups: one per
+// field, then one for its whole text. Requires the field table.
+// Return 0 on success, -1 on allocation failure.
+
+static int
+ip_db_build_inverted(ip_db_t *db)
+{
+    uint n = db->index_num, slots = db->field_base[db->loc_num];
+    uint i, j;
+
+    db->inv_cap = 1024;
+    while (db->inv_cap < 2*slots) {
+        db->inv_cap <<= 1;
+    }
+
+    uint *group_of = malloc(sizeof(uint) * slots);
+    uint *loc_count = calloc(db->loc_num ? db->loc_num : 1, sizeof(uint));
+    db->inv_slots = calloc(db->inv_cap, sizeof(uint));
+    db->inv_loc = malloc(sizeof(uint) * slots);
+    db->inv_field = malloc(sizeof(uint) * slots);
+    db->inv_base = calloc(slots + 1, sizeof(uint));
+
+    if (!group_of || !loc_count || !db->inv_slots || !db->inv_loc ||
+        !db->inv_field || !db->inv_base) {
+        free(group_of);
+        free(loc_count);
+        return -1;
+    }
+
+    uint mask = db->inv_cap - 1;
+    for (i = 0; i < db->loc_num; ++i) {
+        uint base = db->field_base[i];
+        uint count = db->field_base[i+1] - base - 1;
+
+        for (j = 0; j <= count; ++j) {
+            uint field = j < count ? j : IP_FIELD_TEXT, len;
+            const char *text = ip_db_loc_key(db, i, field, &len);
+            uint h = ip_inv_hash(field, text, len) & mask;
+
+            for (;; h = (h + 1) & mask) {
+                uint g = db->inv_slots[h];
+                if (g == 0) {
+                    g = db->inv_num++;
+                    db->inv_loc[g] = i;
+                    db->inv_field[g] = field;
+                    db->inv_slots[h] = g + 1;
+                    group_of[base + j] = g;
+                    break;
+                }
+
+                g -= 1;
+                uint key_len;
+                const char *key = ip_db_loc_key(db, db->inv_loc[g], db->inv_field[g], &key_len);
+                if (db->inv_field[g] == field && key_len == len &&
+                    memcmp(key, text, len) == 0) {
+                    group_of[base + j] = g;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Count the entries of each group, then lay them out by prefix sums.
+    for (i = 0; i < n; ++i) {
+        loc_count[db->loc_of[i]]++;
+    }
+
+    uint total = 0;
+    for (i = 0; i < db->loc_num; ++i) {
+        for (j = db->field_base[i]; j < db->field_base[i+1]; ++j) {
+            db->inv_base[group_of[j] + 1] += loc_count[i];
+            total += loc_count[i];
+        }
+    }
+    for (i = 0; i < db->inv_num; ++i) {
+        db->inv_base[i+1] += db->inv_base[i];
+    }
+
+    db->inv_entries = malloc(sizeof(uint) * (total ? total : 1));
+    uint *cursor = malloc(sizeof(uint) * (db->inv_num ? db->inv_num : 1));
+    if (!db->inv_entries || !cursor) {
+        free(cursor);
+        free(group_of);
+        free(loc_count);
+        return -1;
+    }
+    memcpy(cursor, db->inv_base, sizeof(uint) * db->inv_num);
+
+    for (i = 0; i < n; ++i) {
+        uint loc = db->loc_of[i];
+        for (j = db->field_base[loc]; j < db->field_base[loc+1]; ++j) {
+            db->inv_entries[cursor[group_of[j]]++] = i;
+        }
+    }
+
+    free(cursor);
+    free(group_of);
+    free(loc_count);
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Decode the packed index into aligned native arrays, trading memory
+// for cheaper probes. Return 0 on success, -1 on allocation failure.
+
+static int
+ip_db_decode_index(ip_db_t *db)
+{
+    uint n = db->index_num;
+
+    // Keys are padded with IP_SIMD_SPAN max values so that the SIMD
+    // kernel can always read a whole window.
+    db->keys = ip_db_alloc_aligned(sizeof(uint) * (n + IP_SIMD_SPAN));
+    db->offsets = ip_db_alloc_aligned(sizeof(uint) * (n ? n : 1));
+    db->lens = ip_db_alloc_aligned(sizeof(uint16_t) * (n ? n : 1));
+
+    if (!db->keys || !db->offsets || !db->lens) {
+        return -1;
+    }
+
+    uint i;
+    for (i = 0; i < n; ++i) {
+        db->keys[i] = ip_db_index_get_ip(db, i);
+        db->offsets[i] = ip_db_index_get_offset(db, i);
+        db->lens[i] = ip_db_index_get_text_len(db, i);
+    }
+
+    for (i = 0; i < IP_SIMD_SPAN; ++i) {
+        db->keys[n+i] = 0xffffffff;
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Merge every entry whose text equals that of the next entry into it.
+// Keys are range ends, so dropping such an entry extends the next
+// range down over it and every lookup still lands on the same text.
+// The hints are then rebuilt as the lower bound of the first IP of
+// each segment. Requires the decoded index. Return 0 on success, -1
+// on allocation failure.
+
+static int
+ip_db_compact_index(ip_db_t *db)
+{
+    uint n = db->index_num, m = 0, i;
+
+    for (i = 0; i + 1 < n; ++i) {
+        if (db->lens[i] != db->lens[i+1] ||
+            (db->offsets[i] != db->offsets[i+1] &&
+             memcmp(ip_db_get_text(db, db->offsets[i]),
+                    ip_db_get_text(db, db->offsets[i+1]), db->lens[i]) != 0)) {
+            ++m;
+        }
+    }
+    ++m;
+
+    uint hint_num = 1 << (8*db->hindex_size);
+    uint *keys = ip_db_alloc_aligned(sizeof(uint) * (m + IP_SIMD_SPAN));
+    uint *offsets = ip_db_alloc_aligned(sizeof(uint) * m);
+    uint16_t *lens = ip_db_alloc_aligned(sizeof(uint16_t) * m);
+    uint *loc_of = db->loc_of ? malloc(sizeof(uint) * m) : NULL;
+    uint *hint = malloc(sizeof(uint) * hint_num);
+
+    if (!keys || !offsets || !lens || (db->loc_of && !loc_of) || !hint) {
+        free(keys);
+        free(offsets);
+        free(lens);
+        free(loc_of);
+        free(hint);
+        return -1;
+    }
+
+    uint k = 0;
+    for (i = 0; i < n; ++i) {
+        if (i + 1 < n && db->lens[i] == db->lens[i+1] &&
+            (db->offsets[i] == db->offsets[i+1] ||
+             memcmp(ip_db_get_text(db, db->offsets[i]),
+                    ip_db_get_text(db, db->offsets[i+1]), db->lens[i]) == 0)) {
+            continue;
+        }
+        keys[k] = db->keys[i];
+        offsets[k] = db->offsets[i];
+        lens[k] = db->lens[i];
+        if (loc_of) {
+            loc_of[k] = db->loc_of[i];
+        }
+        ++k;
+    }
+
+    for (i = 0; i < IP_SIMD_SPAN; ++i) {
+        keys[m+i] = 0xffffffff;
+    }
+
+    uint shift = 8*(4-db->hindex_size), h;
+    for (h = 0, k = 0; h < hint_num; ++h) {
+        while (k < m && keys[k] < (h << shift)) {
+            ++k;
+        }
+        hint[h] = k;
+    }
+
+    ip_db_free(db, db->keys);
+    ip_db_free(db, db->offsets);
+    ip_db_free(db, db->lens);
+    ip_db_free(db, db->loc_of);
+    if (!db->hint_inplace) {
+        free(db->hint);
+    }
+
+    db->keys = keys;
+    db->offsets = offsets;
+    db->lens = lens;
+    db->loc_of = loc_of;
+    db->hint = hint;
+    db->hint_inplace = 0;
+    db->merged_num = n - m;
+    db->index_num = m;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Native DB format written by ip_db_compile. The header is followed by
+// 64 byte aligned sections in host byte order, which are used in place
+// once the file is loaded:
+//
+//   hint        uint32 x hint number
+//   keys        uint32 x (index_num + IP_SIMD_SPAN), padded with max values
+//   offsets     uint32 x index_num, text offset of each entry
+//   lens        uint16 x index_num, text length of each entry
+//   loc_of      uint32 x index_num, location id of each entry
+//   loc_offset  uint32 x loc_num, text offset of each location
+//   loc_len     uint16 x loc_num, text length of each location
+//   text        each unique location text once
+
+#define IP_NATIVE_MAGIC     "IPLOCDB"
+#define IP_NATIVE_VERSION   1
+#define IP_NATIVE_ORDER     0x01020304
+
+typedef struct {
+    char magic[8];          // IP_NATIVE_MAGIC
+    uint32_t version;       // IP_NATIVE_VERSION
+    uint32_t byte_order;    // IP_NATIVE_ORDER as stored by the writer
+    uint32_t extended;      // compiled from a datx file?
+    uint32_t hindex_size;   // size of the index of a hint
+    uint32_t index_num;     // number of entries
+    uint32_t loc_num;       // number of unique locations
+    uint64_t hint_off;      // section offsets from the start of the file
+    uint64_t keys_off;
+    uint64_t offsets_off;
+    uint64_t lens_off;
+    uint64_t loc_of_off;
+    uint64_t loc_offset_off;
+    uint64_t loc_len_off;
+    uint64_t text_off;
+    uint64_t text_len;
+    uint64_t file_size;     // total size, a multiple of 64
+    uint64_t data_sum;      // ip_checksum of everything after the header
+    uint64_t header_sum;    // ip_checksum of the header up to this field
+} ip_native_header_t;
+
+_Static_assert(sizeof(ip_native_header_t) == 128, "native header must be 2 cache lines");
+
+// ------------------------------------------------------------------
+// 64 bit checksum over |len| bytes, |len| a multiple of 8.
+
+static uint64_t
+ip_checksum(const byte *p, size_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+    size_t i;
+    for (i = 0; i < len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 1099511628211ull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// ------------------------------------------------------------------
+// Round up to a multiple of 64.
+
+static inline size_t
+ip_align64(size_t n)
+{
+    return (n + 63) & ~(size_t)63;
+}
+
+// ------------------------------------------------------------------
+// Tell whether the raw data is a native DB.
+
+static int
+ip_db_is_native(ip_db_t *db)
+{
+    return db->raw_len >= sizeof(ip_native_header_t) &&
+           memcmp(db->raw, IP_NATIVE_MAGIC, sizeof(IP_NATIVE_MAGIC)) == 0;
+}
+
+// ------------------------------------------------------------------
+// Tell whether a section of |size| bytes at |off| lies within the file.
+
+static inline int
+ip_native_section_ok(const ip_native_header_t *h, uint64_t off, uint64_t size)
+{
+    return off % 4 == 0 && off <= h->file_size && size <= h->file_size - off;
+}
+
+// ------------------------------------------------------------------
+// Set up an ip_db_t object over the raw data of a native DB. Nothing
+// is decoded: every table points into the raw data. The data checksum
+// is only verified with IP_DB_VERIFY.
+// Return 0 on success, -1 on malformed data.
+
+static int
+ip_db_setup_native(ip_db_t *db, const char *path, uint flags)
+{
+    const ip_native_header_t *h = (const ip_native_header_t*)db->raw;
+
+    if (h->version != IP_NATIVE_VERSION || h->byte_order != IP_NATIVE_ORDER) {
+        printf("Unsupported native DB version or byte order in %s\n", path);
+        return -1;
+    }
+
+    if (h->header_sum != ip_checksum(db->raw, offsetof(ip_native_header_t, header_sum)) ||
+        h->file_size != db->raw_len || h->file_size % 64 != 0 ||
+        (h->hindex_size != 1 && h->hindex_size != 2) || h->index_num == 0) {
+        printf("Corrupted native DB header in %s\n", path);
+        return -1;
+    }
+
+    uint64_t n = h->index_num;
+    uint64_t hint_size = sizeof(uint) << (8*h->hindex_size);
+    if (!ip_native_section_ok(h, h->hint_off, hint_size) ||
+        !ip_native_section_ok(h, h->keys_off, sizeof(uint) * (n + IP_SIMD_SPAN)) ||
+        !ip_native_section_ok(h, h->offsets_off, sizeof(uint) * n) ||
+        !ip_native_section_ok(h, h->lens_off, sizeof(uint16_t) * n) ||
+        !ip_native_section_ok(h, h->loc_of_off, sizeof(uint) * n) ||
+        !ip_native_section_ok(h, h->loc_offset_off, sizeof(uint) * h->loc_num) ||
+        !ip_native_section_ok(h, h->loc_len_off, sizeof(uint16_t) * h->loc_num) ||
+        !ip_native_section_ok(h, h->text_off, h->text_len)) {
+        printf("Corrupted native DB sections in %s\n", path);
+        return -1;
+    }
+
+    if ((flags & IP_DB_VERIFY) &&
+        h->data_sum != ip_checksum(db->raw + sizeof(*h), h->file_size - sizeof(*h))) {
+        printf("Native DB checksum mismatch in %s\n", path);
+        return -1;
+    }
+
+    db->extended = h->extended != 0;
+    db->hindex_size = h->hindex_size;
+    db->hint_size = hint_size;
+    db->index_num = h->index_num;
+    db->hint = (uint*)(db->raw + h->hint_off);
+    db->hint_inplace = 1;
+    db->keys = (uint*)(db->raw + h->keys_off);
+    db->offsets = (uint*)(db->raw + h->offsets_off);
+    db->lens = (uint16_t*)(db->raw + h->lens_off);
+    db->loc_of = (uint*)(db->raw + h->loc_of_off);
+    db->loc_offset = (uint*)(db->raw + h->loc_offset_off);
+    db->loc_len = (uint16_t*)(db->raw + h->loc_len_off);
+    db->loc_num = h->loc_num;
+    db->text = db->raw + h->text_off;
+    db->text_base = db->text;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Set up an ip_db_t object over the raw data of a 17MON DB file.
+// Return 0 on success, -1 on malformed data.
+
+static int
+ip_db_setup_17mon(ip_db_t *db, const char *path, byte extended, byte mapped)
+{
+    db->extended = extended;
+    uint hindex_size = extended ? 2 : 1;
+    db->hindex_size = hindex_size;
+    db->index_size = 4 + 3 + hindex_size;
+
+    uint hint_num = 1 << (hindex_size*8);
+    uint hint_size = sizeof(uint) * hint_num;
+    db->hint_size = hint_size;
+
+    if (db->raw_len < 4 + hint_size) {
+        printf("Truncated DB file %s\n", path);
+        return -1;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // The hint table is stored little endian, so on a little endian
+    // host a mapped file can be used in place. The mapping is page
+    // aligned, which keeps the table 4 bytes aligned.
+    if (mapped) {
+        db->hint = (uint*)(db->raw + 4);
+        db->hint_inplace = 1;
+    }
+#endif
+
+    if (!db->hint_inplace) {
+        db->hint = malloc(hint_size);
+
+        int i = 0;
+        byte *pos = db->raw + 4;
+        for (; i < hint_num; i++) {
+            db->hint[i] = decode_uint32_le(pos);
+            pos += 4;
+        }
+    }
+
+    uint text_offset = decode_uint32_be(db->raw);
+    db->text = db->raw + text_offset;
+    db->text_base = db->text - hint_size;
+    db->index = db->raw + 4 + hint_size;
+
+    // There's a reserved area in the end of the index area. Its size
+    // is equal to |hint_size|.
+    db->index_num = ((db->text - db->index) - hint_size) / db->index_size;
+    db->search = extended ? ip_db_search_packed_datx : ip_db_search_packed_dat;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// IPIP .ipdb format: a 4 byte big endian length, JSON metadata, then
+// |node_count| trie nodes of two big endian uint32 children (bit 0 and
+// bit 1) followed by the records. A child equal to |node_count| is
+// empty, and a greater one is the record at (child - node_count)
+// after the nodes, stored as a big endian uint16 length and the tab
+// separated columns of every language. IPv4 addresses live under the
+// IPv4-mapped prefix ::ffff:0:0/96.
+
+#define IP_IPDB_LANGS   8
+#define IP_IPDB_FIELDS  64
+#define IP_IPDB_NAME    32
+
+typedef struct {
+    uint64_t node_count;
+    uint64_t total_size;
+    uint ip_version;
+    uint lang_num;
+    char lang_name[IP_IPDB_LANGS][IP_IPDB_NAME];
+    uint lang_off[IP_IPDB_LANGS];
+    uint field_num;
+    char field_name[IP_IPDB_FIELDS][IP_IPDB_NAME];
+} ip_ipdb_meta_t;
+
+// ------------------------------------------------------------------
+// Tell whether the raw data is an .ipdb file.
+
+static int
+ip_db_is_ipdb(ip_db_t *db)
+{
+    if (db->raw_len < 5 || db->raw[4] != '{') {
+        return 0;
+    }
+    uint len = decode_uint32_be(db->raw);
+    return len <= db->raw_len - 4 &&
+           memmem(db->raw + 4, len, "\"node_count\"", 12) != NULL;
+}
+
+// ------------------------------------------------------------------
+// Minimal JSON scanning for the .ipdb metadata: the position right
+// after the ':' following |key|, or NULL.
+
+static const char*
+ip_json_value(const char *json, const char *key)
+{
+    char quoted[IP_IPDB_NAME + 2];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+
+    const char *p = strstr(json, quoted);
+    if (!p) {
+        return NULL;
+    }
+    p += strlen(quoted);
+    p += strspn(p, " \t\r\n");
+    return *p == ':' ? p + 1 + strspn(p + 1, " \t\r\n") : NULL;
+}
+
+// ------------------------------------------------------------------
+// Scan a JSON string without escapes at |p| into |out|. Return the
+// position after it, or NULL.
+
+static const char*
+ip_json_string(const char *p, char *out)
+{
+    p += strspn(p, " \t\r\n");
+    if (*p != '"') {
+        return NULL;
+    }
+
+    const char *end = strchr(p + 1, '"');
+    if (!end || end - p - 1 >= IP_IPDB_NAME || memchr(p + 1, '\\', end - p - 1)) {
+        return NULL;
+    }
+    memcpy(out, p + 1, end - p - 1);
+    out[end - p - 1] = 0;
+    return end + 1;
+}
+
+// ------------------------------------------------------------------
+// Parse the metadata of an .ipdb file.
+// Return 0 on success, -1 on malformed metadata.
+
+static int
+ip_ipdb_parse_meta(const char *json, ip_ipdb_meta_t *meta)
+{
+    const char *p;
+    memset(meta, 0, sizeof(*meta));
+
+    if (!(p = ip_json_value(json, "node_count"))) {
+        return -1;
+    }
+    meta->node_count = strtoull(p, NULL, 10);
+    if (!(p = ip_json_value(json, "total_size"))) {
+        return -1;
+    }
+    meta->total_size = strtoull(p, NULL, 10);
+    if (!(p = ip_json_value(json, "ip_version"))) {
+        return -1;
+    }
+    meta->ip_version = strtoul(p, NULL, 10);
+
+    // "languages": {"CN": 0, "EN": 13}
+    if (!(p = ip_json_value(json, "languages")) || *p != '{') {
+        return -1;
+    }
+    for (++p;;) {
+        p += strspn(p, " \t\r\n,");
+        if (*p == '}') {
+            break;
+        }
+        if (meta->lang_num == IP_IPDB_LANGS ||
+            !(p = ip_json_string(p, meta->lang_name[meta->lang_num]))) {
+            return -1;
+        }
+        p += strspn(p, " \t\r\n");
+        if (*p != ':') {
+            return -1;
+        }
+        unsigned long off = strtoul(p + 1, (char**)&p, 10);
+        if (off > IP_IPDB_LANGS * IP_IPDB_FIELDS) {
+            return -1;
+        }
+        meta->lang_off[meta->lang_num++] = off;
+    }
+
+    // "fields": ["country_name", "region_name", ...]
+    if (!(p = ip_json_value(json, "fields")) || *p != '[') {
+        return -1;
+    }
+    for (++p;;) {
+        p += strspn(p, " \t\r\n,");
+        if (*p == ']') {
+            break;
+        }
+        if (meta->field_num == IP_IPDB_FIELDS ||
+            !(p = ip_json_string(p, meta->field_name[meta->field_num++]))) {
+            return -1;
+        }
+    }
+
+    // Every column of every language must fit the column tables.
+    uint i;
+    for (i = 0; i < meta->lang_num; ++i) {
+        if (meta->lang_off[i] + meta->field_num > IP_IPDB_LANGS * IP_IPDB_FIELDS) {
+            return -1;
+        }
+    }
+
+    return meta->lang_num && meta->field_num ? 0 : -1;
+}
+
+// ------------------------------------------------------------------
+// Resolve a comma separated list of names against |names|, appending
+// their indexes to |out|. An empty or NULL list selects |def|.
+// Return the number selected, or -1 if a name is unknown.
+
+static int
+ip_ipdb_select(const char *list, char names[][IP_IPDB_NAME], uint num,
+               int def, uint *out)
+{
+    uint count = 0, i;
+
+    if (!list || !*list) {
+        if (def >= 0) {
+            out[count++] = def;
+        } else {
+            for (i = 0; i < num; ++i) {
+                out[count++] = i;
+            }
+        }
+        return count;
+    }
+
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        for (i = 0; i < num; ++i) {
+            if (strlen(names[i]) == len && memcmp(names[i], list, len) == 0) {
+                break;
+            }
+        }
+        if (i == num || count == num) {
+            return -1;
+        }
+        out[count++] = i;
+        list += len + (list[len] == ',');
+    }
+    return count;
+}
+
+// ------------------------------------------------------------------
+// Walk of the IPv4 part of the trie into ranges.
+
+typedef struct {
+    const byte *nodes;
+    uint64_t node_count;
+    uint *keys;         // last IP of each range
+    uint64_t *leaves;   // trie leaf of each range
+    uint num;
+    uint cap;
+} ip_ipdb_walk_t;
+
+static int
+ip_ipdb_emit(ip_ipdb_walk_t *w, uint last, uint64_t leaf)
+{
+    // Neighbouring blocks of one record form a single range.
+    if (w->num && w->leaves[w->num-1] == leaf) {
+        w->keys[w->num-1] = last;
+        return 0;
+    }
+
+    if (w->num == w->cap) {
+        uint cap = w->cap ? 2*w->cap : 4096;
+        uint *keys = realloc(w->keys, sizeof(uint) * cap);
+        if (keys) {
+            w->keys = keys;
+        }
+        uint64_t *leaves = realloc(w->leaves, sizeof(uint64_t) * cap);
+        if (leaves) {
+            w->leaves = leaves;
+        }
+        if (!keys || !leaves) {
+            return -1;
+        }
+        w->cap = cap;
+    }
+
+    w->keys[w->num] = last;
+    w->leaves[w->num++] = leaf;
+    return 0;
+}
+
+static int
+ip_ipdb_walk(ip_ipdb_walk_t *w, uint64_t node, uint prefix, uint depth)
+{
+    if (node >= w->node_count || depth == 32) {
+        uint host = depth == 0 ? 0xffffffff : (1u << (32 - depth)) - 1;
+        return ip_ipdb_emit(w, prefix | host, node);
+    }
+
+    const byte *n = w->nodes + 8*node;
+    if (ip_ipdb_walk(w, decode_uint32_be((byte*)n), prefix, depth + 1) != 0) {
+        return -1;
+    }
+    return ip_ipdb_walk(w, decode_uint32_be((byte*)n + 4),
+                        prefix | (1u << (31 - depth)), depth + 1);
+}
+
+// ------------------------------------------------------------------
+// Set up an ip_db_t object over the raw data of an .ipdb file. The
+// IPv4 part of the trie, found by skipping the 96 bit IPv4-mapped
+// prefix once, is flattened into the decoded index so every search
+// engine applies. Only the |columns| of each record are read: when
+// they are adjacent the texts point into the file, else the selected
+// columns are joined into a text pool.
+// Return 0 on success, -1 on malformed data or allocation failure.
+
+static int
+ip_db_setup_ipdb(ip_db_t *db, const char *path, const char *languages,
+                 const char *fields)
+{
+    uint meta_len = decode_uint32_be(db->raw);
+    char *json = malloc(meta_len + 1);
+    ip_ipdb_meta_t meta;
+
+    if (!json) {
+        return -1;
+    }
+    memcpy(json, db->raw + 4, meta_len);
+    json[meta_len] = 0;
+    int rc = ip_ipdb_parse_meta(json, &meta);
+    free(json);
+
+    const byte *data = db->raw + 4 + meta_len;
+    uint64_t data_len = db->raw_len - 4 - meta_len;
+    if (rc != 0 || meta.total_size != data_len || data_len > 0xffffffff ||
+        meta.node_count == 0 ||
+        meta.node_count > data_len / 8 || !(meta.ip_version & 1)) {
+        printf("Corrupted or IPv6 only .ipdb file %s\n", path);
+        return -1;
+    }
+
+    // Languages and fields make up the selected columns.
+    uint langs[IP_IPDB_LANGS], picks[IP_IPDB_FIELDS];
+    uint columns[IP_IPDB_LANGS * IP_IPDB_FIELDS];
+    uint i, j, first = 0;
+    for (i = 1; i < meta.lang_num; ++i) {
+        if (meta.lang_off[i] < meta.lang_off[first]) {
+            first = i;
+        }
+    }
+    int lang_num = ip_ipdb_select(languages, meta.lang_name, meta.lang_num, first, langs);
+    int pick_num = ip_ipdb_select(fields, meta.field_name, meta.field_num, -1, picks);
+    if (lang_num < 0 || pick_num < 0) {
+        printf("Unknown language or field selected from %s\n", path);
+        return -1;
+    }
+
+    uint column_num = 0, last_column = 0, adjacent = 1;
+    for (i = 0; i < (uint)lang_num; ++i) {
+        for (j = 0; j < (uint)pick_num; ++j) {
+            uint c = meta.lang_off[langs[i]] + picks[j];
+            adjacent &= column_num == 0 || c == columns[column_num-1] + 1;
+            columns[column_num++] = c;
+            last_column = c > last_column ? c : last_column;
+        }
+    }
+
+    // Skip the IPv4-mapped prefix: 80 zero bits, then 16 one bits.
+    uint64_t node = 0;
+    for (i = 0; i < 96 && node < meta.node_count; ++i) {
+        node = decode_uint32_be((byte*)data + 8*node + 4*(i >= 80));
+    }
+
+    ip_ipdb_walk_t w = {data, meta.node_count, NULL, NULL, 0, 0};
+    if (node == meta.node_count ? ip_ipdb_emit(&w, 0xffffffff, node)
+                                : ip_ipdb_walk(&w, node, 0, 0)) {
+        free(w.keys);
+        free(w.leaves);
+        return -1;
+    }
+
+    uint n = w.num;
+    db->extended = 1;
+    db->hindex_size = 2;
+    db->hint_size = sizeof(uint) << 16;
+    db->index_num = n;
+    db->hint = malloc(db->hint_size);
+    db->keys = ip_db_alloc_aligned(sizeof(uint) * (n + IP_SIMD_SPAN));
+    db->offsets = ip_db_alloc_aligned(sizeof(uint) * n);
+    db->lens = ip_db_alloc_aligned(sizeof(uint16_t) * n);
+    if (!db->hint || !db->keys || !db->offsets || !db->lens) {
+        free(w.keys);
+        free(w.leaves);
+        return -1;
+    }
+
+    memcpy(db->keys, w.keys, sizeof(uint) * n);
+    for (i = 0; i < IP_SIMD_SPAN; ++i) {
+        db->keys[n+i] = 0xffffffff;
+    }
+
+    uint h, k;
+    for (h = 0, k = 0; h < (1 << 16); ++h) {
+        while (k < n && db->keys[k] < (h << 16)) {
+            ++k;
+        }
+        db->hint[h] = k;
+    }
+
+    // Texts of each record, resolved once and cached by leaf.
+    uint cap = 1024, pool_cap = 0;
+    while (cap < 2*n) {
+        cap *= 2;
+    }
+    uint64_t *slot_leaf = calloc(cap, sizeof(uint64_t));
+    uint *slot_entry = malloc(sizeof(uint) * cap);
+    byte *pool = NULL;
+    size_t pool_len = 0;
+    rc = slot_leaf && slot_entry ? 0 : -1;
+
+    for (i = 0; rc == 0 && i < n; ++i) {
+        uint64_t leaf = w.leaves[i];
+        uint s = (uint)(leaf * 0x9e3779b97f4a7c15ull >> 32) & (cap - 1);
+
+        if (leaf == meta.node_count) {
+            db->offsets[i] = 0;
+            db->lens[i] = 0;
+            continue;
+        }
+        while (slot_leaf[s] && slot_leaf[s] != leaf) {
+            s = (s + 1) & (cap - 1);
+        }
+        if (slot_leaf[s]) {
+            db->offsets[i] = db->offsets[slot_entry[s]];
+            db->lens[i] = db->lens[slot_entry[s]];
+            continue;
+        }
+        slot_leaf[s] = leaf;
+        slot_entry[s] = i;
+
+        uint64_t pos = leaf - meta.node_count + 8*meta.node_count;
+        if (pos + 2 > data_len || pos + 2 + decode_uint16_be((byte*)data + pos) > data_len) {
+            rc = -1;
+            break;
+        }
+        const char *rec = (const char*)data + pos + 2;
+        uint len = decode_uint16_be((byte*)data + pos);
+
+        // Column starts, scanning no further than the last selected.
+        uint start[IP_IPDB_LANGS * IP_IPDB_FIELDS + 1], c = 0, p = 0;
+        start[0] = 0;
+        while (c <= last_column && c < IP_IPDB_LANGS * IP_IPDB_FIELDS && p <= len) {
+            const char *tab = memchr(rec + p, '\t', len - p);
+            p = tab ? (uint)(tab - rec) + 1 : len + 1;
+            start[++c] = p;
+        }
+
+#define IP_COLUMN_START(x) ((x) < c ? start[x] : len)
+#define IP_COLUMN_END(x)   ((x) < c ? start[(x)+1] - 1 : len)
+
+        if (adjacent) {
+            uint from = IP_COLUMN_START(columns[0]);
+            db->offsets[i] = rec + from - (const char*)data;
+            db->lens[i] = IP_COLUMN_END(columns[column_num-1]) - from;
+            continue;
+        }
+
+        if (pool_len + len + column_num > pool_cap) {
+            pool_cap = 2*(pool_cap + len + column_num);
+            byte *more = realloc(pool, pool_cap);
+            if (!more) {
+                rc = -1;
+                break;
+            }
+            pool = more;
+        }
+
+        db->offsets[i] = pool_len;
+        for (j = 0; j < column_num; ++j) {
+            uint from = IP_COLUMN_START(columns[j]), to = IP_COLUMN_END(columns[j]);
+            if (j) {
+                pool[pool_len++] = '\t';
+            }
+            memcpy(pool + pool_len, rec + from, to - from);
+            pool_len += to - from;
+        }
+        db->lens[i] = pool_len - db->offsets[i];
+
+#undef IP_COLUMN_START
+#undef IP_COLUMN_END
+    }
+
+    free(slot_leaf);
+    free(slot_entry);
+    free(w.keys);
+    free(w.leaves);
+    if (rc != 0) {
+        free(pool);
+        printf("Corrupted .ipdb records in %s\n", path);
+        return -1;
+    }
+
+    db->pool = pool;
+    db->pool_len = pool_len;
+    db->text = adjacent ? (byte*)data : pool;
+    db->text_base = db->text;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// ip_table_t names one table searches read: the field of the DB that
+// points to it and its size in bytes.
+
+#define IP_TABLES_MAX 16
+#define IP_HUGE_PAGE  (2 << 20)
+
+typedef struct {
+    void **ptr;
+    size_t size;
+} ip_table_t;
+
+// ------------------------------------------------------------------
+// List the tables of the DB into |t|, raw data first. Return their
+// number.
+
+static uint
+ip_db_tables(ip_db_t *db, ip_table_t *t)
+{
+    size_t n = db->index_num;
+    size_t hint_num = 1 << (8*db->hindex_size);
+    uint k = 0;
+
+#define IP_TABLE(p, s) \
+    if (p) { t[k].ptr = (void**)&(p); t[k].size = (s); ++k; }
+
+    IP_TABLE(db->raw, db->raw_len);
+    IP_TABLE(db->hint, db->hint_size);
+    IP_TABLE(db->keys, sizeof(uint) * (n + IP_SIMD_SPAN));
+    IP_TABLE(db->offsets, sizeof(uint) * n);
+    IP_TABLE(db->lens, sizeof(uint16_t) * n);
+    IP_TABLE(db->pool, db->pool_len);
+    IP_TABLE(db->ey_base, sizeof(uint) * (hint_num + 1));
+    IP_TABLE(db->ey_keys, sizeof(uint) * db->ey_base[hint_num]);
+    IP_TABLE(db->ey_pos, sizeof(uint) * db->ey_base[hint_num]);
+    IP_TABLE(db->tbl24, sizeof(uint) << 24);
+    IP_TABLE(db->tbl8, sizeof(uint) * 256 * db->tbl8_num);
+    IP_TABLE(db->loc_of, sizeof(uint) * n);
+    IP_TABLE(db->loc_offset, sizeof(uint) * db->loc_num);
+    IP_TABLE(db->loc_len, sizeof(uint16_t) * db->loc_num);
+    IP_TABLE(db->field_base, sizeof(uint) * (db->loc_num + 1));
+    IP_TABLE(db->field_pos, sizeof(uint) * db->field_base[db->loc_num]);
+
+#undef IP_TABLE
+    return k;
+}
+
+// ------------------------------------------------------------------
+// Map |size| bytes of anonymous memory, rounded up to whole huge pages
+// when |huge| is set. Explicit huge pages (MAP_HUGETLB) are tried
+// first, then a 2 MB aligned range advised for transparent huge pages.
+// |kind| receives 2, 1 or 0 accordingly, and |len| the mapped length.
+// Return the mapping, or NULL on failure.
+
+static byte*
+ip_region_alloc(size_t size, int huge, byte *kind, size_t *len)
+{
+    size_t page = huge ? IP_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+    size_t n = (size + page - 1) & ~(page - 1);
+    int prot = PROT_READ | PROT_WRITE;
+    int map = MAP_PRIVATE | MAP_ANONYMOUS;
+    byte *p;
+
+    *kind = 0;
+    *len = n;
+
+    if (huge) {
+        p = mmap(NULL, n, prot, map | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *kind = 2;
+            return p;
+        }
+
+        // Over-allocate and trim to a huge page boundary.
+        p = mmap(NULL, n + IP_HUGE_PAGE, prot, map, -1, 0);
+        if (p == MAP_FAILED) {
+            return NULL;
+        }
+
+        size_t head = (IP_HUGE_PAGE - (uintptr_t)p % IP_HUGE_PAGE) % IP_HUGE_PAGE;
+        if (head) {
+            munmap(p, head);
+        }
+        munmap(p + head + n, IP_HUGE_PAGE - head);
+        p += head;
+
+        if (madvise(p, n, MADV_HUGEPAGE) == 0) {
+            *kind = 1;
+        }
+        return p;
+    }
+
+    p = mmap(NULL, n, prot, map, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// ------------------------------------------------------------------
+// Translate |p|, pointing into one of the tables |t|,
+// into the same place of its copy in |fresh|.
+
+static byte*
+ip_db_rebase(ip_table_t *t, void **fresh, uint num, byte *p)
+{
+    uint k;
+    for (k = 0; p && k < num; ++k) {
+        byte *b = *t[k].ptr;
+        if (p >= b && p < b + t[k].size) {
+            return (byte*)fresh[k] + (p - b);
+        }
+    }
+    return NULL;
+}
+
+// ------------------------------------------------------------------
+// Copy the tables of |src| into one fresh mapping and point |dst|,
+// either |src| itself or a shallow copy of it, at the copies. Tables
+// inside the raw data keep their place within its copy. The copies
+// are written by the calling thread, so their pages are first touched
+// on its NUMA node. When packing in place, the old tables are freed.
+// Return 0 on success, and -1 on failure.
+
+static int
+ip_db_pack(ip_db_t *src, ip_db_t *dst, uint flags)
+{
+    ip_table_t t[IP_TABLES_MAX], d[IP_TABLES_MAX];
+    void *fresh[IP_TABLES_MAX];
+    uint num = ip_db_tables(src, t), k;
+    size_t total = 0, off = 0, len;
+    byte kind;
+
+    ip_db_tables(dst, d);
+    for (k = 0; k < num; ++k) {
+        if (k == 0 || !ip_db_in_raw(src, *t[k].ptr)) {
+            total += ip_align64(t[k].size);
+        }
+    }
+
+    byte *region = ip_region_alloc(total, (flags & IP_DB_HUGEPAGES) != 0, &kind, &len);
+    if (!region) {
+        return -1;
+    }
+
+    byte *raw = src->raw;
+    for (k = 0; k < num; ++k) {
+        byte *p = *t[k].ptr;
+        if (k > 0 && ip_db_in_raw(src, p)) {
+            fresh[k] = region + (p - raw);
+        } else {
+            memcpy(region + off, p, t[k].size);
+            fresh[k] = region + off;
+            off += ip_align64(t[k].size);
+        }
+    }
+
+    byte *index = ip_db_rebase(t, fresh, num, src->index);
+    byte *text = ip_db_rebase(t, fresh, num, src->text);
+    byte *text_base = ip_db_rebase(t, fresh, num, src->text_base);
+
+    if (dst == src) {
+        for (k = 1; k < num; ++k) {
+            ip_db_free(src, *t[k].ptr);
+        }
+        if (src->mapped) {
+            munmap(src->raw, src->raw_len);
+        } else {
+            free(src->raw);
+        }
+    }
+
+    for (k = 0; k < num; ++k) {
+        *d[k].ptr = fresh[k];
+    }
+
+    dst->index = index;
+    dst->text = text;
+    dst->text_base = text_base;
+    dst->mapped = 0;
+    dst->region = region;
+    dst->region_len = len;
+    dst->huge = kind;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Map each CPU to its NUMA node as listed in sysfs. |node_of_cpu|
+// receives a table of |cpu_num| entries, 0 for CPUs of no listed node.
+// Return the number of node ids (highest plus one), 0 on failure.
+
+static uint
+ip_numa_nodes(int **node_of_cpu, uint *cpu_num)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    DIR *dir = opendir("/sys/devices/system/node");
+    struct dirent *ent;
+    uint nodes = 0;
+
+    if (cpus <= 0 || !dir || !(*node_of_cpu = calloc(cpus, sizeof(int)))) {
+        if (dir) {
+            closedir(dir);
+        }
+        return 0;
+    }
+    *cpu_num = cpus;
+
+    while ((ent = readdir(dir)) != NULL) {
+        char path[300];
+        int node, lo, hi;
+        if (sscanf(ent->d_name, "node%d", &node) != 1 || node < 0) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", ent->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+
+        // A list of ranges such as "0-3,8-11".
+        while (fscanf(f, "%d", &lo) == 1) {
+            hi = lo;
+            if (fscanf(f, "-%d", &hi) != 1) {
+                hi = lo;
+            }
+            for (; lo <= hi && lo < cpus; ++lo) {
+                (*node_of_cpu)[lo] = node;
+            }
+            if (fgetc(f) != ',') {
+                break;
+            }
+        }
+        fclose(f);
+
+        if ((uint)node + 1 > nodes) {
+            nodes = node + 1;
+        }
+    }
+
+    closedir(dir);
+    return nodes;
+}
+
+// ------------------------------------------------------------------
+// A thread packing one NUMA replica from CPUs of its node.
+
+typedef struct {
+    ip_db_t *db;
+    ip_db_t *replica;
+    uint node;
+    uint flags;
+} ip_replica_job_t;
+
+static void*
+ip_replica_worker(void *arg)
+{
+    ip_replica_job_t *job = (ip_replica_job_t*)arg;
+    ip_db_t *db = job->db;
+    cpu_set_t set;
+    uint cpu;
+
+    CPU_ZERO(&set);
+    for (cpu = 0; cpu < db->cpu_num && cpu < CPU_SETSIZE; ++cpu) {
+        if ((uint)db->node_of_cpu[cpu] == job->node) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    if (CPU_COUNT(&set) == 0 ||
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        return NULL;
+    }
+
+    ip_db_t *r = malloc(sizeof(ip_db_t));
+    if (r) {
+        *r = *db;
+        r->replicas = NULL;
+        r->node_num = 0;
+        r->node_of_cpu = NULL;
+        if (ip_db_pack(db, r, job->flags) != 0) {
+            free(r);
+            r = NULL;
+        }
+    }
+    job->replica = r;
+    return NULL;
+}
+
+// ------------------------------------------------------------------
+// Give every NUMA node with CPUs its own copy of the lookup tables,
+// built by a thread running on it. A host with a single node gets no
+// replica. Return 0 on success, and -1 on failure.
+
+static int
+ip_db_replicate(ip_db_t *db, uint flags)
+{
+    uint nodes = ip_numa_nodes(&db->node_of_cpu, &db->cpu_num), i;
+    if (nodes < 2) {
+        return 0;
+    }
+
+    ip_replica_job_t *jobs = calloc(nodes, sizeof(ip_replica_job_t));
+    pthread_t *tids = calloc(nodes, sizeof(pthread_t));
+    db->replicas = calloc(nodes, sizeof(ip_db_t*));
+    if (!jobs || !tids || !db->replicas) {
+        free(jobs);
+        free(tids);
+        return -1;
+    }
+    db->node_num = nodes;
+
+    // One node at a time, so each copy is read from a settled source.
+    for (i = 0; i < nodes; ++i) {
+        jobs[i].db = db;
+        jobs[i].node = i;
+        jobs[i].flags = flags;
+        if (pthread_create(&tids[i], NULL, ip_replica_worker, &jobs[i]) == 0) {
+            pthread_join(tids[i], NULL);
+            db->replicas[i] = jobs[i].replica;
+        }
+    }
+
+    free(jobs);
+    free(tids);
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// ip_db_local returns the replica of the DB on the NUMA node of the
+// calling thread, or the DB itself. The CPU is looked up again every
+// 1024 calls, so a migrated thread soon follows.
+
+static __thread int ip_cpu;
+static __thread uint ip_cpu_age;
+
+static inline ip_db_t*
+ip_db_local(ip_db_t *db)
+{
+    if (!db->replicas) {
+        return db;
+    }
+
+    if ((ip_cpu_age++ & 1023) == 0) {
+        ip_cpu = sched_getcpu();
+    }
+
+    uint cpu = ip_cpu;
+    ip_db_t *r = cpu < db->cpu_num ? db->replicas[db->node_of_cpu[cpu]] : NULL;
+    return r ? r : db;
+}
+
+// ------------------------------------------------------------------
+// Lock |size| bytes at |p| in memory, or at least fault them in when
+// the lock limit does not allow it. Return the bytes locked.
+
+static size_t
+ip_lock_range(void *p, size_t size)
+{
+    if (mlock(p, size) == 0) {
+        return size;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    volatile byte *b = (volatile byte*)p;
+    size_t i;
+    byte sum = 0;
+    for (i = 0; i < size; i += page) {
+        sum += b[i];
+    }
+    (void)sum;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Lock (or prefault) the tables of the DB and of its replicas.
+
+static void
+ip_db_lock(ip_db_t *db)
+{
+    ip_table_t t[IP_TABLES_MAX];
+    uint num, k;
+
+    if (db->region) {
+        db->locked = ip_lock_range(db->region, db->region_len);
+    } else {
+        num = ip_db_tables(db, t);
+        for (k = 0; k < num; ++k) {
+            if (k == 0 || !ip_db_in_raw(db, *t[k].ptr)) {
+                db->locked += ip_lock_range(*t[k].ptr, t[k].size);
+            }
+        }
+    }
+
+    for (k = 0; k < db->node_num; ++k) {
+        ip_db_t *r = db->replicas[k];
+        if (r) {
+            r->locked = ip_lock_range(r->region, r->region_len);
+        }
+    }
+}
+
+// ------------------------------------------------------------------
+// Create and then initialize an ip_db_t object (implementation).
+
+ip_db_t*
+ip_db_init_impl(const char *path, uint flags, const char *languages, const char *fields)
+{
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    byte extended = (flags & IP_DB_EXTENDED) != 0;
+    byte mapped = (flags & IP_DB_MMAP) != 0;
+
+    ip_db_t *db = ip_db_new();
+
+    if ((mapped ? ip_db_map_file(db, path) : ip_db_read_file(db, path)) != 0) {
+        ip_db_destroy(&db);
+        return NULL;
+    }
+
+    int rc = ip_db_is_native(db) ? ip_db_setup_native(db, path, flags)
+           : ip_db_is_ipdb(db) ? ip_db_setup_ipdb(db, path, languages, fields)
+           : ip_db_setup_17mon(db, path, extended, mapped);
+    if (rc != 0) {
+        ip_db_destroy(&db);
+        return NULL;
+    }
+
+    if ((flags & (IP_DB_DECODE | IP_DB_COMPACT)) && !db->keys) {
+        if (ip_db_decode_index(db) != 0) {
+            printf("Cannot allocate decoded index for %s\n", path);
+            ip_db_destroy(&db);
+            return NULL;
+        }
+    }
+
+    if (flags & IP_DB_COMPACT) {
+        if (ip_db_compact_index(db) != 0) {
+            printf("Cannot allocate compacted index for %s\n", path);
+            ip_db_destroy(&db);
+            return NULL;
+        }
+    }
+
+    if (db->keys) {
+        db->search = ip_db_search_keys;
+    }
+
+    if ((flags & (IP_DB_LOC_IDS | IP_DB_FIELDS | IP_DB_INVERTED)) && !db->loc_of) {
+        if (ip_db_build_locations(db) != 0) {
+            printf("Cannot allocate location table for %s\n", path);
+            ip_db_destroy(&db);
+            return NULL;
+        }
+    }
+
+    if (flags & (IP_DB_FIELDS | IP_DB_INVERTED)) {
+        if (ip_db_build_fields(db) != 0) {
+            printf("Cannot allocate field table for %s\n", path);
+            ip_db_destroy(&db);
+            return NULL;
+        }
+    }
+
+    if (flags & IP_DB_INVERTED) {
+        if (ip_db_build_inverted(db) != 0) {
+            printf("Cannot allocate inverted index for %s\n", path);
+            ip_db_destroy(&db);
+            return NULL;
+        }
+    }
+
+    if (flags & IP_DB_EYTZINGER) {
+        if (ip_db_build_eytzinger(db) != 0) {
+            printf("Cannot allocate Eytzinger index for %s\n", path);
+            ip_db_destroy(&db);
+            return NULL;
+        }
+        db->search = ip_db_search_eytzinger;
+    }
+
+    if (flags & IP_DB_SIMD) {
+        if (!db->keys && ip_db_decode_index(db) != 0) {
+            printf("Cannot allocate decoded index for %s\n", path);
+            ip_db_destroy(&db);
+            return NULL;
+        }
+        db->count_below = ip_count_below_select();
+        db->search = ip_db_search_simd;
+    }
+
+    if (flags & IP_DB_DIRECT) {
+        if (ip_db_build_direct(db) != 0) {
+            printf("Cannot build direct lookup table for %s\n", path);
+            ip_db_destroy(&db);
+            return NULL;
+        }
+        db->search = ip_db_search_direct;
+    }
+
+    // Packed DBs get a lookup specialized for their format, unless
+    // IP_DB_GENERIC asks for the runtime one; any other engine goes
+    // through its search pointer.
+    if ((flags & IP_DB_GENERIC) && (db->search == ip_db_search_packed_dat ||
+                                    db->search == ip_db_search_packed_datx)) {
+        db->search = ip_db_search_packed;
+    }
+    db->locate = db->search == ip_db_search_packed_dat ? ip_db_locate_packed_dat
+               : db->search == ip_db_search_packed_datx ? ip_db_locate_packed_datx
+               : ip_db_locate_any;
+
+#ifdef IPLOC_STATS
+    db->stats = ip_db_alloc_aligned(sizeof(ip_stats_slot_t) * IP_STATS_SLOTS);
+    if (!db->stats) {
+        printf("Cannot allocate stats for %s\n", path);
+        ip_db_destroy(&db);
+        return NULL;
+    }
+    memset(db->stats, 0, sizeof(ip_stats_slot_t) * IP_STATS_SLOTS);
+#endif
+
+    // Replicas share the counters, so they come first.
+    if (flags & IP_DB_HUGEPAGES) {
+        if (ip_db_pack(db, db, flags) != 0) {
+            printf("Cannot allocate huge page region for %s\n", path);
+            ip_db_destroy(&db);
+            return NULL;
+        }
+    }
+
+    if (flags & IP_DB_NUMA) {
+        if (ip_db_replicate(db, flags) != 0) {
+            printf("Cannot allocate NUMA replicas for %s\n", path);
+            ip_db_destroy(&db);
+            return NULL;
+        }
+    }
+
+    if (flags & IP_DB_LOCK) {
+        ip_db_lock(db);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    db->load_ns = (stop.tv_sec - start.tv_sec) * 1000000000ull + stop.tv_nsec - start.tv_nsec;
+    return db;
+}
+
+// ------------------------------------------------------------------
+// Create and then initialize an ip_db_t object using a 17MON DB file.
+
+ip_db_t*
+ip_db_init(const char *path)
+{
+    return ip_db_init_impl(path, 0, NULL, NULL);
+}
+
+// ------------------------------------------------------------------
+// Create and then initialize an ip_db_t object using an extended
+// 17MON DB file.
+
+ip_db_t*
+ip_db_init_x(const char *path)
+{
+    return ip_db_init_impl(path, IP_DB_EXTENDED, NULL, NULL);
+}
+
+// ------------------------------------------------------------------
+// Create and then initialize an ip_db_t object backed by a read-only
+// shared mapping of a 17MON DB file.
+
+ip_db_t*
+ip_db_init_mmap(const char *path)
+{
+    return ip_db_init_impl(path, IP_DB_MMAP, NULL, NULL);
+}
+
+// ------------------------------------------------------------------
+// Create and then initialize an ip_db_t object backed by a read-only
+// shared mapping of an extended 17MON DB file.
+
+ip_db_t*
+ip_db_init_x_mmap(const char *path)
+{
+    return ip_db_init_impl(path, IP_DB_EXTENDED | IP_DB_MMAP, NULL, NULL);
+}
+
+// ------------------------------------------------------------------
+// Create and then initialize an ip_db_t object with load options.
+
+ip_db_t*
+ip_db_init_ex(const char *path, uint32_t flags)
+{
+    return ip_db_init_impl(path, flags, NULL, NULL);
+}
+
+// ------------------------------------------------------------------
+// Create and then initialize an ip_db_t object over a mapped .ipdb
+// file, keeping the selected languages and fields only.
+
+ip_db_t*
+ip_db_init_ipdb(const char *path, uint32_t flags, const char *languages,
+                const char *fields)
+{
+    return ip_db_init_impl(path, flags | IP_DB_MMAP, languages, fields);
+}
+
+// ------------------------------------------------------------------
+// Parse a dotted quad of exactly |len| bytes. Accepts the same input
+// as inet_pton(AF_INET): four decimal octets up to 255, without
+// leading zeros or any other character.
+// Return 0 on success, and -1 on malformed input.
+
+int
+ip_parse_v4(const char *s, size_t len, uint32_t *ip)
+{
+    const char *end = s + len;
+    uint val = 0;
+    int octet;
+
+    if (s == NULL || ip == NULL) {
+        return -1;
+    }
+
+    for (octet = 0; octet < 4; ++octet) {
+        if (s == end || (uint)(*s - '0') > 9) {
+            return -1;
+        }
+
+        uint v = *s++ - '0';
+        if (s < end && (uint)(*s - '0') <= 9) {
+            if (v == 0) {
+                return -1;
+            }
+            v = v*10 + (*s++ - '0');
+            if (s < end && (uint)(*s - '0') <= 9) {
+                v = v*10 + (*s++ - '0');
+                if (v > 255) {
+                    return -1;
+                }
+            }
+        }
+
+        val = (val << 8) | v;
+        if (octet < 3) {
+            if (s == end || *s != '.') {
+                return -1;
+            }
+            ++s;
+        }
+    }
+
+    if (s != end) {
+        return -1;
+    }
+
+    *ip = val;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Parse newline separated dotted quads from a buffer.
+// Return the number of lines parsed.
+
+size_t
+ip_parse_v4_lines(const char *buf, size_t len, uint32_t *ips,
+                  unsigned char *valid, size_t max, size_t *consumed)
+{
+    const char *p = buf, *end = buf + len;
+    size_t n = 0;
+
+    while (n < max && p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *next = eol ? eol + 1 : end;
+        const char *stop = eol ? eol : end;
+
+        if (stop > p && stop[-1] == '\r') {
+            --stop;
+        }
+
+        int ok = ip_parse_v4(p, stop - p, &ips[n]) == 0;
+        if (!ok) {
+            ips[n] = 0;
+        }
+        if (valid) {
+            valid[n] = ok;
+        }
+
+        ++n;
+        p = next;
+    }
+
+    if (consumed) {
+        *consumed = p - buf;
+    }
+    return n;
+}
+
+// ------------------------------------------------------------------
+// Format an IP as a NUL-terminated dotted quad.
+// Return the length of the text, at most 15.
+
+int
+ip_format_v4(uint32_t ip_val, char *buf)
+{
+    char *p = buf;
+    int shift;
+    for (shift = 24; shift >= 0; shift -= 8) {
+        uint b = (ip_val >> shift) & 0xff;
+        if (b >= 100) {
+            *p++ = '0' + b / 100;
+            *p++ = '0' + b / 10 % 10;
+        } else if (b >= 10) {
+            *p++ = '0' + b / 10;
+        }
+        *p++ = '0' + b % 10;
+        *p++ = '.';
+    }
+    p[-1] = 0;
+    return p - buf - 1;
+}
+
+// ------------------------------------------------------------------
+// Get the host representation of an ipv4 address. Return 0 on 
+// malformed input.
+
+static inline uint
+get_ip_val(const char *ipv4)
+{
+    uint32_t ip;
+    return ipv4 && ip_parse_v4(ipv4, strlen(ipv4), &ip) == 0 ? ip : 0;
+}
+
+// ------------------------------------------------------------------
+// Search an ipv4 address in DB and return related description text.
+// Return 0 on success, and -1 if any input is invalid.
+
+int
+ip_locate(ip_db_t *db, const char *ipv4, char *result)
+{
+    return ip_locate_v(db, get_ip_val(ipv4), result);
+}
+
+// ------------------------------------------------------------------
+// IP search implementation.
+// Return 0 on success, and -1 if any input is invalid.
+
+int
+ip_locate_v(ip_db_t *db, uint32_t ip_val, char *result)
+{
+    if (db == NULL || ip_val == 0 || result == NULL) {
+#ifdef IPLOC_STATS
+        ip_stats_fail(db, 1);
+#endif
+        return -1;
+    }
+
+    const char *text;
+    uint len;
+    db = ip_db_local(db);
+    db->locate(db, ip_val, &text, &len);
+
+    strncpy(result, text, len);
+    result[len] = 0;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Zero-copy IP search. The text is referenced in place and is not
+// NUL-terminated.
+// Return 0 on success, and -1 if any input is invalid.
+
+int
+ip_locate_ref(ip_db_t *db, uint32_t ip_val, const char **text, uint32_t *len)
+{
+    if (db == NULL || ip_val == 0 || text == NULL || len == NULL) {
+#ifdef IPLOC_STATS
+        ip_stats_fail(db, 1);
+#endif
+        return -1;
+    }
+
+    db = ip_db_local(db);
+    db->locate(db, ip_val, text, len);
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Number of searches run in lockstep by ip_db_search_lanes.
+
+#define IP_BATCH_LANES 16
+
+// ------------------------------------------------------------------
+// ip_db_search_lanes runs up to IP_BATCH_LANES searches in lockstep.
+// Each round advances every unfinished search by one level and
+// prefetches the entry its next round will probe, so the cache misses
+// of different searches overlap instead of being paid one by one.
+// The search is the branch free form of ip_db_search_packed_* over the
+// |high-low+1| entries of a hint range, and yields the same position.
+
+static void
+ip_db_search_lanes(ip_db_t *db, const uint *ips, uint n, uint *pos)
+{
+    uint base[IP_BATCH_LANES];
+    uint len[IP_BATCH_LANES];
+    uint i, active = 0;
+
+    // With a SIMD kernel, searches stop narrowing once they fit in a
+    // window and are finished by a single window count.
+    uint stop = db->count_below ? IP_SIMD_SPAN : 1;
+
+    for (i = 0; i < n; ++i) {
+        uint low = ip_db_hint_get_low(db, ips[i]);
+        uint high = ip_db_hint_get_high(db, ips[i]);
+        base[i] = low < high ? low : high;
+        len[i] = low < high ? high - low + 1 : 1;
+        if (len[i] > stop) {
+            __builtin_prefetch(ip_db_key_addr(db, base[i] + len[i]/2 - 1));
+            active++;
+        }
+    }
+
+    while (active) {
+        active = 0;
+        for (i = 0; i < n; ++i) {
+            uint l = len[i];
+            if (l <= stop) {
+                continue;
+            }
+
+            uint half = l / 2;
+            uint b = base[i];
+            b = ip_db_key(db, b + half - 1) < ips[i] ? b + half : b;
+            l -= half;
+            base[i] = b;
+            len[i] = l;
+
+            if (l > stop) {
+                __builtin_prefetch(ip_db_key_addr(db, b + l/2 - 1));
+                active++;
+            }
+        }
+    }
+
+    if (db->count_below) {
+        for (i = 0; i < n; ++i) {
+            if (len[i] > 1) {
+                uint c = db->count_below(db->keys + base[i], ips[i]);
+                base[i] += c < len[i] - 1 ? c : len[i] - 1;
+            }
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        pos[i] = base[i];
+    }
+}
+
+// ------------------------------------------------------------------
+// ip_db_search_sorted locates a batch of ascending IPs by sweeping
+// the index forward: every search starts from the previous result
+// and gallops ahead, so the whole batch costs a single merge-like pass.
+// |cursor| carries the sweep position across calls.
+
+static void
+ip_db_search_sorted(ip_db_t *db, const uint *ips, uint n, uint *pos, uint *cursor)
+{
+    uint p = *cursor;
+    uint i;
+
+    for (i = 0; i < n; ++i) {
+        uint ip_val = ips[i];
+        uint low = ip_db_hint_get_low(db, ip_val);
+        uint high = ip_db_hint_get_high(db, ip_val);
+
+        if (p < low || p > high) {
+            p = low;
+        }
+
+        if (p < high && ip_db_key(db, p) < ip_val) {
+            uint lo = p + 1, hi, step = 1;
+
+            for (;;) {
+                hi = lo + step - 1;
+                if (hi >= high) {
+                    hi = high;
+                    break;
+                }
+                if (ip_db_key(db, hi) >= ip_val) {
+                    break;
+                }
+                lo = hi + 1;
+                step <<= 1;
+            }
+
+            while (lo < hi) {
+                uint mid = lo + (hi - lo)/2;
+                if (ip_db_key(db, mid) < ip_val) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            p = lo;
+        }
+
+        pos[i] = p;
+    }
+
+    *cursor = p;
+}
+
+// ------------------------------------------------------------------
+// IP search returning a location id.
+// Return 0 on success, and -1 if any input is invalid or the DB has
+// no location table.
+
+int
+ip_locate_id(ip_db_t *db, uint32_t ip_val, uint32_t *loc_id)
+{
+    if (db == NULL || db->loc_of == NULL || ip_val == 0 || loc_id == NULL) {
+#ifdef IPLOC_STATS
+        ip_stats_fail(db, 1);
+#endif
+        return -1;
+    }
+
+    db = ip_db_local(db);
+    *loc_id = db->loc_of[ip_db_search(db, ip_val)];
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Return the number of unique locations, 0 without a location table.
+
+uint32_t
+ip_db_loc_count(ip_db_t *db)
+{
+    return db ? db->loc_num : 0;
+}
+
+// ------------------------------------------------------------------
+// Get the description text of a location id.
+// Return 0 on success, and -1 if any input is invalid.
+
+int
+ip_db_loc_text(ip_db_t *db, uint32_t loc_id, ip_text_t *text)
+{
+    if (db == NULL || loc_id >= db->loc_num || text == NULL) {
+        return -1;
+    }
+
+    text->text = ip_db_get_text(db, db->loc_offset[loc_id]);
+    text->len = db->loc_len[loc_id];
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Get the pre-split fields of a location id.
+// Return 0 on success, and -1 if any input is invalid or the DB has
+// no field table.
+
+int
+ip_db_loc_fields(ip_db_t *db, uint32_t loc_id, ip_fields_t *fields)
+{
+    if (db == NULL || db->field_base == NULL || loc_id >= db->loc_num ||
+        fields == NULL) {
+        return -1;
+    }
+
+    const char *text = ip_db_get_text(db, db->loc_offset[loc_id]);
+    const uint *pos = db->field_pos + db->field_base[loc_id];
+    uint i, count = db->field_base[loc_id+1] - db->field_base[loc_id] - 1;
+
+    for (i = 0; i < count; ++i) {
+        fields->field[i].text = text + pos[i];
+        fields->field[i].len = pos[i+1] - pos[i] - 1;
+    }
+    fields->count = count;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// IP search returning the pre-split fields of the location.
+// Return 0 on success, and -1 if any input is invalid.
+
+int
+ip_locate_fields(ip_db_t *db, uint32_t ip_val, ip_fields_t *fields)
+{
+    uint32_t id;
+    if (db == NULL || db->field_base == NULL || ip_locate_id(db, ip_val, &id) != 0) {
+        return -1;
+    }
+    return ip_db_loc_fields(ip_db_local(db), id, fields);
+}
+
+// ------------------------------------------------------------------
+// IP search returning a single field of the location.
+// Return 0 on success, and -1 if any input is invalid or the location
+// has no such field.
+
+int
+ip_locate_field(ip_db_t *db, uint32_t ip_val, uint32_t field, ip_text_t *text)
+{
+    uint32_t id;
+    if (db == NULL || db->field_base == NULL || text == NULL ||
+        ip_locate_id(db, ip_val, &id) != 0) {
+        return -1;
+    }
+
+    db = ip_db_local(db);
+    if (field == IP_FIELD_TEXT) {
+        return ip_db_loc_text(db, id, text);
+    }
+
+    // One boundary more than fields: compare without adding to |field|,
+    // which may be as large as IP_FIELD_TEXT.
+    const uint *pos = db->field_pos + db->field_base[id];
+    if (field >= db->field_base[id+1] - db->field_base[id] - 1) {
+        return -1;
+    }
+
+    text->text = ip_db_get_text(db, db->loc_offset[id]) + pos[field];
+    text->len = pos[field+1] - pos[field] - 1;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// List the IP ranges of a location text or field text, merging ranges
+// that touch. Only the first |max| ranges are stored.
+// Return 0 on success, and -1 if any input is invalid.
+
+int
+ip_db_ranges(ip_db_t *db, uint32_t field, const char *text, uint32_t len,
+             ip_range_t *out, size_t max, size_t *count)
+{
+    if (db == NULL || db->inv_slots == NULL || (text == NULL && len > 0) ||
+        (out == NULL && max > 0) || count == NULL ||
+        (field != IP_FIELD_TEXT && field >= IP_FIELDS_MAX)) {
+        return -1;
+    }
+
+    *count = 0;
+    int g = ip_db_find_group(db, field, text, len);
+    if (g < 0) {
+        return 0;
+    }
+
+    size_t k = 0;
+    uint i, first = 0, last = 0;
+    for (i = db->inv_base[g]; i < db->inv_base[g+1]; ++i) {
+        uint e = db->inv_entries[i];
+        uint lo = e ? ip_db_key(db, e-1) + 1 : 0;
+        uint hi = ip_db_key(db, e);
+
+        if (k > 0 && lo == last + 1) {
+            last = hi;
+            continue;
+        }
+        if (k > 0 && k <= max) {
+            out[k-1].first = first;
+            out[k-1].last = last;
+        }
+        first = lo;
+        last = hi;
+        ++k;
+    }
+    if (k > 0 && k <= max) {
+        out[k-1].first = first;
+        out[k-1].last = last;
+    }
+
+    *count = k;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Split the range [first, last] into the fewest CIDR blocks. Only the
+// first |max| blocks are stored. Return the number of blocks.
+
+size_t
+ip_range_cidrs(uint32_t first, uint32_t last, ip_cidr_t *out, size_t max)
+{
+    uint64_t ip = first, end = (uint64_t)last + 1;
+    size_t k = 0;
+
+    while (ip < end) {
+        uint prefix = ip ? 32 - __builtin_ctz((uint)ip) : 0;
+        while ((1ull << (32 - prefix)) > end - ip) {
+            ++prefix;
+        }
+
+        if (k < max) {
+            out[k].ip = (uint)ip;
+            out[k].prefix = prefix;
+        }
+        ++k;
+        ip += 1ull << (32 - prefix);
+    }
+    return k;
+}
+
+// ------------------------------------------------------------------
+// List the minimal CIDR set covering a location text or field text.
+// Only the first |max| blocks are stored.
+// Return 0 on success, and -1 if any input is invalid.
+
+int
+ip_db_cidrs(ip_db_t *db, uint32_t field, const char *text, uint32_t len,
+            ip_cidr_t *out, size_t max, size_t *count)
+{
+    size_t n, i;
+    if ((out == NULL && max > 0) || count == NULL) {
+        return -1;
+    }
+    if (ip_db_ranges(db, field, text, len, NULL, 0, &n) != 0) {
+        return -1;
+    }
+
+    ip_range_t *ranges = malloc(sizeof(ip_range_t) * (n ? n : 1));
+    if (!ranges) {
+        return -1;
+    }
+    ip_db_ranges(db, field, text, len, ranges, n, &n);
+
+    size_t k = 0;
+    for (i = 0; i < n; ++i) {
+        k += ip_range_cidrs(ranges[i].first, ranges[i].last,
+                            k < max ? out + k : NULL, k < max ? max - k : 0);
+    }
+
+    free(ranges);
+    *count = k;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Batched IP search. Sorted input is swept in a single pass, other
+// input is searched IP_BATCH_LANES at a time in lockstep. With direct
+// tables each IP is a plain table lookup.
+// Return 0 on success, and -1 if any input is invalid.
+
+int
+ip_locate_batch(ip_db_t *db, const uint32_t *ips, size_t n, ip_text_t *out)
+{
+    if (db == NULL || (n > 0 && (ips == NULL || out == NULL))) {
+        return -1;
+    }
+
+    db = ip_db_local(db);
+    size_t i = 1;
+    while (i < n && ips[i-1] <= ips[i]) {
+        ++i;
+    }
+
+    int sorted = i >= n;
+    uint cursor = 0;
+    uint pos[IP_BATCH_LANES];
+    size_t done, failed = 0;
+
+    for (done = 0; done < n; done += IP_BATCH_LANES) {
+        uint m = n - done < IP_BATCH_LANES ? n - done : IP_BATCH_LANES;
+
+        if (db->tbl24) {
+            // Direct lookups are independent loads already.
+            for (i = 0; i < m; ++i) {
+                pos[i] = ip_db_search_direct(db, ips[done+i]);
+            }
+        } else if (sorted) {
+            ip_db_search_sorted(db, ips + done, m, pos, &cursor);
+        } else {
+            ip_db_search_lanes(db, ips + done, m, pos);
+        }
+
+        for (i = 0; i < m; ++i) {
+            ip_text_t *t = &out[done+i];
+            if (ips[done+i] == 0) {
+                t->text = NULL;
+                t->len = 0;
+                ++failed;
+            } else {
+                t->text = ip_db_entry_text(db, pos[i]);
+                t->len = ip_db_entry_len(db, pos[i]);
+            }
+        }
+    }
+
+#ifdef IPLOC_STATS
+    // Batched searches count as lookups, without depths or buckets.
+    ip_stats_add(&ip_stats_slot(db)->lookups, n - failed);
+    ip_stats_fail(db, failed);
+#else
+    (void)failed;
+#endif
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// IPv6 ranges are kept as a sorted array of last IPs covering the
+// whole address space, unassigned gaps included, and searched like the
+// IPv4 index: the top 16 bits pick a bucket of the hint table, and a
+// binary search over the upper halves (the lower ones only break ties)
+// finishes within it. Allocations cluster under a few /16s, so buckets
+// of more than IP_V6_CROWDED ranges are split once more by the next 8
+// bits into a chunk of 256 sub-buckets.
+
+#define IP_V6_BUCKETS (1 << 16)
+#define IP_V6_CROWDED 16
+#define IP_V6_GAP     0xffffffffu
+
+typedef unsigned __int128 ip_u128;
+
+typedef struct {
+    ip_u128 first;
+    ip_u128 last;
+    uint offset;
+    uint len;
+} ip_v6_range_t;
+
+// ------------------------------------------------------------------
+// Parse an IPv6 address, or an IPv4 one as its IPv4-mapped address.
+// Return 0 on success, and -1 if |s| is not an address.
+
+static int
+ip_parse_u128(const char *s, size_t len, ip_u128 *ip)
+{
+    char buf[64];
+    byte addr[16];
+    uint v4, i;
+
+    if (len == 0 || len >= sizeof(buf)) {
+        return -1;
+    }
+
+    if (ip_parse_v4(s, len, &v4) == 0) {
+        *ip = ((ip_u128)0xffff << 32) | v4;
+        return 0;
+    }
+
+    memcpy(buf, s, len);
+    buf[len] = 0;
+    if (inet_pton(AF_INET6, buf, addr) != 1) {
+        return -1;
+    }
+
+    *ip = 0;
+    for (i = 0; i < 16; ++i) {
+        *ip = (*ip << 8) | addr[i];
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Parse an IPv6 address in text form.
+// Return 0 on success, and -1 if any input is invalid.
+
+int
+ip_parse_v6(const char *s, size_t len, ip_v6_t *ip)
+{
+    ip_u128 v;
+    if (s == NULL || ip == NULL || ip_parse_u128(s, len, &v) != 0) {
+        return -1;
+    }
+
+    ip->hi = (uint64_t)(v >> 64);
+    ip->lo = (uint64_t)v;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Parse one line of an IPv6 range file into |r|, |text| being where
+// the text offsets are relative to.
+// Return 0 on success, and -1 if the line is malformed.
+
+static int
+ip_parse_v6_line(const char *text, const char *line, const char *end, ip_v6_range_t *r)
+{
+    const char *tab = memchr(line, '\t', end - line);
+    if (!tab) {
+        return -1;
+    }
+
+    const char *slash = memchr(line, '/', tab - line);
+    if (slash) {
+        // prefix/len<TAB>text
+        char *stop;
+        long prefix = strtol(slash + 1, &stop, 10);
+        if (stop != tab || prefix < 0 || prefix > 128 ||
+            ip_parse_u128(line, slash - line, &r->first) != 0) {
+            return -1;
+        }
+        ip_u128 host = prefix == 128 ? 0 : ~(ip_u128)0 >> prefix;
+        r->first &= ~host;
+        r->last = r->first | host;
+    } else {
+        // first<TAB>last<TAB>text
+        const char *tab2 = memchr(tab + 1, '\t', end - tab - 1);
+        if (!tab2 || ip_parse_u128(line, tab - line, &r->first) != 0 ||
+            ip_parse_u128(tab + 1, tab2 - tab - 1, &r->last) != 0 ||
+            r->last < r->first) {
+            return -1;
+        }
+        tab = tab2;
+    }
+
+    if (end - tab - 1 > 0xffff) {
+        return -1;
+    }
+    r->offset = tab + 1 - text;
+    r->len = end - tab - 1;
+    return 0;
+}
+
+static int
+ip_v6_range_cmp(const void *x, const void *y)
+{
+    const ip_v6_range_t *a = (const ip_v6_range_t*)x, *b = (const ip_v6_range_t*)y;
+    return a->first < b->first ? -1 : a->first > b->first;
+}
+
+// ------------------------------------------------------------------
+// Append a range ending at |last| to the IPv6 table of the DB.
+
+static inline void
+ip_db_push_v6(ip_db_t *db, ip_u128 last, uint offset, uint len)
+{
+    uint n = db->v6_num++;
+    db->v6_hi[n] = (uint64_t)(last >> 64);
+    db->v6_lo[n] = (uint64_t)last;
+    db->v6_offset[n] = offset;
+    db->v6_len[n] = len;
+}
+
+// ------------------------------------------------------------------
+// Load an IPv6 range file, replacing the IPv6 ranges of the DB.
+// Return 0 on success, and -1 on failure.
+
+int
+ip_db_load_v6(ip_db_t *db, const char *path)
+{
+    if (db == NULL || path == NULL) {
+        return -1;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        printf("Cannot open %s\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    char *text = NULL;
+    if (fstat(fileno(fp), &st) != 0 || !(text = malloc(st.st_size + 1)) ||
+        fread(text, 1, st.st_size, fp) != (size_t)st.st_size) {
+        printf("Failed to read %s\n", path);
+        fclose(fp);
+        free(text);
+        return -1;
+    }
+    fclose(fp);
+
+    size_t len = st.st_size, cap = 1024, num = 0;
+    ip_v6_range_t *ranges = malloc(sizeof(ip_v6_range_t) * cap);
+    const char *line = text, *stop = text + len;
+    uint lineno = 0;
+
+    while (ranges && line < stop) {
+        const char *end = memchr(line, '\n', stop - line);
+        const char *next = end ? end + 1 : stop;
+        if (!end) {
+            end = stop;
+        }
+        if (end > line && end[-1] == '\r') {
+            --end;
+        }
+        ++lineno;
+
+        if (end > line && line[0] != '#') {
+            if (num == cap) {
+                cap *= 2;
+                ip_v6_range_t *more = realloc(ranges, sizeof(ip_v6_range_t) * cap);
+                if (!more) {
+                    break;
+                }
+                ranges = more;
+            }
+            if (ip_parse_v6_line(text, line, end, &ranges[num]) != 0) {
+                printf("Invalid IPv6 range at line %u of %s\n", lineno, path);
+                free(ranges);
+                free(text);
+                return -1;
+            }
+            ++num;
+        }
+        line = next;
+    }
+
+    if (!ranges || line < stop) {
+        printf("Cannot allocate IPv6 ranges for %s\n", path);
+        free(ranges);
+        free(text);
+        return -1;
+    }
+
+    qsort(ranges, num, sizeof(ip_v6_range_t), ip_v6_range_cmp);
+
+    size_t i;
+    for (i = 1; i < num; ++i) {
+        if (ranges[i].first <= ranges[i-1].last) {
+            printf("Overlapping IPv6 ranges in %s\n", path);
+            free(ranges);
+            free(text);
+            return -1;
+        }
+    }
+
+    // Every range may be preceded by a gap, and the last followed by one.
+    ip_db_free_v6(db);
+    size_t max = 2*num + 1;
+    db->v6_hint = malloc(sizeof(uint) * (IP_V6_BUCKETS + 1));
+    db->v6_sub = calloc(IP_V6_BUCKETS, sizeof(uint));
+    db->v6_hi = malloc(sizeof(uint64_t) * max);
+    db->v6_lo = malloc(sizeof(uint64_t) * max);
+    db->v6_offset = malloc(sizeof(uint) * max);
+    db->v6_len = malloc(sizeof(uint16_t) * max);
+    db->v6_text = text;
+    db->v6_text_len = len;
+    if (!db->v6_hint || !db->v6_sub || !db->v6_hi || !db->v6_lo || !db->v6_offset || !db->v6_len) {
+        printf("Cannot allocate IPv6 ranges for %s\n", path);
+        ip_db_free_v6(db);
+        free(ranges);
+        return -1;
+    }
+
+    ip_u128 next = 0;
+    for (i = 0; i < num; ++i) {
+        if (ranges[i].first > next) {
+            ip_db_push_v6(db, ranges[i].first - 1, IP_V6_GAP, 0);
+        }
+        ip_db_push_v6(db, ranges[i].last, ranges[i].offset, ranges[i].len);
+        next = ranges[i].last + 1;
+        if (next == 0) {
+            break;
+        }
+    }
+    if (num == 0 || next != 0) {
+        ip_db_push_v6(db, ~(ip_u128)0, IP_V6_GAP, 0);
+    }
+    free(ranges);
+
+    // Bucket b holds the ranges from the first one ending in it to the
+    // one covering its last IP, the first of bucket b + 1.
+    uint b, k = 0;
+    for (b = 0; b < IP_V6_BUCKETS; ++b) {
+        while ((db->v6_hi[k] >> 48) < b) {
+            ++k;
+        }
+        db->v6_hint[b] = k;
+    }
+    db->v6_hint[IP_V6_BUCKETS] = db->v6_num - 1;
+
+    // Split crowded buckets the same way on bits 40-47.
+    for (b = 0; b < IP_V6_BUCKETS; ++b) {
+        if (db->v6_hint[b+1] - db->v6_hint[b] > IP_V6_CROWDED) {
+            db->v6_sub[b] = ++db->v6_chunk_num;
+        }
+    }
+
+    db->v6_chunks = malloc(sizeof(uint) * 256 * (db->v6_chunk_num + 1));
+    if (!db->v6_chunks) {
+        printf("Cannot allocate IPv6 ranges for %s\n", path);
+        ip_db_free_v6(db);
+        return -1;
+    }
+
+    for (b = 0; b < IP_V6_BUCKETS; ++b) {
+        if (db->v6_sub[b]) {
+            uint *chunk = db->v6_chunks + 256 * (db->v6_sub[b] - 1), c;
+            k = db->v6_hint[b];
+            for (c = 0; c < 256; ++c) {
+                while ((db->v6_hi[k] >> 40) < (b << 8 | c)) {
+                    ++k;
+                }
+                chunk[c] = k;
+            }
+        }
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Return the number of IPv6 ranges of the DB, gaps included.
+
+uint32_t
+ip_db_count_v6(ip_db_t *db)
+{
+    return db ? db->v6_num : 0;
+}
+
+// ------------------------------------------------------------------
+// Find the IPv6 range holding |hi|:|lo|.
+
+static inline uint
+ip_db_search_v6(ip_db_t *db, uint64_t hi, uint64_t lo)
+{
+    uint bucket = hi >> 48;
+    uint low = db->v6_hint[bucket];
+    uint high = db->v6_hint[bucket+1];
+    const uint64_t *his = db->v6_hi;
+
+    if (db->v6_sub[bucket]) {
+        const uint *chunk = db->v6_chunks + 256 * (db->v6_sub[bucket] - 1);
+        uint c = (hi >> 40) & 0xff;
+        low = chunk[c];
+        if (c < 255) {
+            high = chunk[c+1];
+        }
+    }
+
+    while (low < high) {
+        uint mid = low + (high - low)/2;
+
+        if (hi > his[mid] || (hi == his[mid] && lo > db->v6_lo[mid])) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return high;
+}
+
+// ------------------------------------------------------------------
+// IPv6 search. IPv4-mapped addresses in no IPv6 range are looked up
+// in the IPv4 index.
+// Return 0 on success, and -1 if any input is invalid or the address
+// is in no range.
+
+int
+ip_locate_v6(ip_db_t *db, ip_v6_t ip, ip_text_t *text)
+{
+    if (db == NULL || text == NULL) {
+        return -1;
+    }
+
+    uint n = db->v6_num ? ip_db_search_v6(db, ip.hi, ip.lo) : 0;
+    if (db->v6_num == 0 || db->v6_offset[n] == IP_V6_GAP) {
+        if (ip.hi == 0 && (ip.lo >> 32) == 0xffff) {
+            return ip_locate_ref(db, (uint)ip.lo, &text->text, &text->len);
+        }
+        return -1;
+    }
+
+    text->text = db->v6_text + db->v6_offset[n];
+    text->len = db->v6_len[n];
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Write |db| to |path|, taking location ids from |loc|, which is |db|
+// or a copy of it holding ids built for the compile.
+// Return 0 on success, and -1 otherwise.
+
+static int
+ip_db_compile_locs(ip_db_t *db, ip_db_t *loc, const char *path)
+{
+    uint n = db->index_num, i;
+    uint hint_num = 1 << (8*db->hindex_size);
+    ip_native_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IP_NATIVE_MAGIC, sizeof(IP_NATIVE_MAGIC));
+    h.version = IP_NATIVE_VERSION;
+    h.byte_order = IP_NATIVE_ORDER;
+    h.extended = db->extended;
+    h.hindex_size = db->hindex_size;
+    h.index_num = n;
+    h.loc_num = loc->loc_num;
+
+    for (i = 0; i < loc->loc_num; ++i) {
+        h.text_len += loc->loc_len[i];
+    }
+
+    size_t off = sizeof(h);
+    h.hint_off = off;       off = ip_align64(off + sizeof(uint) * hint_num);
+    h.keys_off = off;       off = ip_align64(off + sizeof(uint) * (n + IP_SIMD_SPAN));
+    h.offsets_off = off;    off = ip_align64(off + sizeof(uint) * n);
+    h.lens_off = off;       off = ip_align64(off + sizeof(uint16_t) * n);
+    h.loc_of_off = off;     off = ip_align64(off + sizeof(uint) * n);
+    h.loc_offset_off = off; off = ip_align64(off + sizeof(uint) * loc->loc_num);
+    h.loc_len_off = off;    off = ip_align64(off + sizeof(uint16_t) * loc->loc_num);
+    h.text_off = off;       off = ip_align64(off + h.text_len);
+    h.file_size = off;
+
+    byte *buf = calloc(1, h.file_size);
+    if (!buf) {
+        return -1;
+    }
+
+    uint *hint = (uint*)(buf + h.hint_off);
+    uint *keys = (uint*)(buf + h.keys_off);
+    uint *offsets = (uint*)(buf + h.offsets_off);
+    uint16_t *lens = (uint16_t*)(buf + h.lens_off);
+    uint *loc_of = (uint*)(buf + h.loc_of_off);
+    uint *loc_offset = (uint*)(buf + h.loc_offset_off);
+    uint16_t *loc_len = (uint16_t*)(buf + h.loc_len_off);
+    byte *text = buf + h.text_off;
+
+    memcpy(hint, db->hint, sizeof(uint) * hint_num);
+
+    uint text_pos = 0;
+    for (i = 0; i < loc->loc_num; ++i) {
+        loc_offset[i] = text_pos;
+        loc_len[i] = loc->loc_len[i];
+        memcpy(text + text_pos, ip_db_get_text(db, loc->loc_offset[i]), loc_len[i]);
+        text_pos += loc_len[i];
+    }
+
+    for (i = 0; i < n; ++i) {
+        keys[i] = ip_db_key(db, i);
+        loc_of[i] = loc->loc_of[i];
+        offsets[i] = loc_offset[loc_of[i]];
+        lens[i] = loc_len[loc_of[i]];
+    }
+    for (i = 0; i < IP_SIMD_SPAN; ++i) {
+        keys[n+i] = 0xffffffff;
+    }
+
+    h.data_sum = ip_checksum(buf + sizeof(h), h.file_size - sizeof(h));
+    h.header_sum = ip_checksum((const byte*)&h, offsetof(ip_native_header_t, header_sum));
+    memcpy(buf, &h, sizeof(h));
+
+    // A unique name beside |path|, so concurrent compiles to the same
+    // path never share a temporary file.
+    size_t tmp_len = strlen(path) + 8;
+    char *tmp = malloc(tmp_len);
+    if (!tmp) {
+        free(buf);
+        return -1;
+    }
+    snprintf(tmp, tmp_len, "%s.XXXXXX", path);
+
+    int fd = mkstemp(tmp);
+    int rc = -1;
+    if (fd >= 0) {
+        FILE *fp = fdopen(fd, "wb");
+        int ok = fp && fchmod(fd, 0644) == 0 && fwrite(buf, h.file_size, 1, fp) == 1;
+        ok = (fp ? fclose(fp) : close(fd)) == 0 && ok;
+        if (ok && rename(tmp, path) == 0) {
+            rc = 0;
+        } else {
+            unlink(tmp);
+        }
+    }
+
+    free(tmp);
+    free(buf);
+    return rc;
+}
+
+// ------------------------------------------------------------------
+// Write the DB in native format to |path|, via a temporary file that
+// is renamed into place so that readers mapping |path| are unaffected.
+// Return 0 on success, and -1 on failure.
+
+int
+ip_db_compile(ip_db_t *db, const char *path)
+{
+    if (db == NULL || path == NULL || db->index_num == 0) {
+        return -1;
+    }
+
+    // Without location ids, build them on a private copy: |db| may be
+    // in use by readers and must not change under them.
+    ip_db_t copy;
+    ip_db_t *loc = db;
+    if (!db->loc_of) {
+        copy = *db;
+        copy.loc_of = NULL;
+        copy.loc_offset = NULL;
+        copy.loc_len = NULL;
+        copy.loc_num = 0;
+        loc = &copy;
+        if (ip_db_build_locations(loc) != 0) {
+            free(copy.loc_of);
+            free(copy.loc_offset);
+            free(copy.loc_len);
+            return -1;
+        }
+    }
+
+    int rc = ip_db_compile_locs(db, loc, path);
+    if (loc == &copy) {
+        free(copy.loc_of);
+        free(copy.loc_offset);
+        free(copy.loc_len);
+    }
+    return rc;
+}
+
+// ------------------------------------------------------------------
+// ip_db_held tells whether |p| is a table held apart from the raw data.
+
+static inline int
+ip_db_held(ip_db_t *db, const void *p)
+{
+    return p && !ip_db_in_raw(db, p);
+}
+
+// ------------------------------------------------------------------
+// Break the memory the DB holds down by structure.
+
+static void
+ip_db_memory(ip_db_t *db, ip_db_stats_t *stats)
+{
+    size_t n = db->index_num;
+    size_t hint_num = 1 << (8*db->hindex_size);
+    size_t slots = db->field_base ? db->field_base[db->loc_num] : 0;
+    uint i;
+
+    stats->mem_raw = db->mapped ? 0 : db->raw_len;
+    stats->mem_hint = db->hint_inplace ? 0 : db->hint_size;
+    stats->mem_index = (ip_db_held(db, db->keys) ? sizeof(uint) * (n + IP_SIMD_SPAN) : 0) +
+                       (ip_db_held(db, db->pool) ? db->pool_len : 0) +
+                       (ip_db_held(db, db->offsets) ? sizeof(uint) * n : 0) +
+                       (ip_db_held(db, db->lens) ? sizeof(uint16_t) * n : 0);
+    stats->mem_eytzinger = db->ey_base ?
+            sizeof(uint) * (hint_num + 1 + 2*db->ey_base[hint_num]) : 0;
+    stats->mem_direct = (db->tbl24 ? sizeof(uint) << 24 : 0) +
+                        (db->tbl8 ? sizeof(uint) * 256 * db->tbl8_num : 0);
+    stats->mem_locations = (ip_db_held(db, db->loc_of) ? sizeof(uint) * n : 0) +
+                           (ip_db_held(db, db->loc_offset) ?
+                            (sizeof(uint) + sizeof(uint16_t)) * db->loc_num : 0);
+    stats->mem_fields = db->field_base ? sizeof(uint) * (db->loc_num + 1 + slots) : 0;
+    stats->mem_inverted = db->inv_slots ?
+            sizeof(uint) * (db->inv_cap + 3*slots + 1 + db->inv_base[db->inv_num]) : 0;
+    stats->mem_v6 = db->v6_num ? sizeof(uint) * (2*IP_V6_BUCKETS + 1) + db->v6_text_len +
+            sizeof(uint) * 256 * db->v6_chunk_num +
+            (2*sizeof(uint64_t) + sizeof(uint) + sizeof(uint16_t)) * db->v6_num : 0;
+    stats->mem_total = sizeof(ip_db_t) + stats->mem_v6 + stats->mem_raw + stats->mem_hint +
+                       stats->mem_index + stats->mem_eytzinger + stats->mem_direct +
+                       stats->mem_locations + stats->mem_fields + stats->mem_inverted;
+
+    // Packed tables are counted above; replicas copy them per node.
+    stats->huge_pages = db->huge;
+    stats->mem_locked = db->locked;
+    stats->mem_replicas = 0;
+    stats->numa_replicas = 0;
+    for (i = 0; i < db->node_num; ++i) {
+        if (db->replicas[i]) {
+            stats->numa_replicas++;
+            stats->mem_replicas += db->replicas[i]->region_len;
+            stats->mem_locked += db->replicas[i]->locked;
+        }
+    }
+    stats->mem_total += stats->mem_replicas;
+}
+
+// ------------------------------------------------------------------
+// Return the number of bytes of memory the DB holds.
+
+size_t
+ip_db_footprint(ip_db_t *db)
+{
+    if (db == NULL) {
+        return 0;
+    }
+
+    ip_db_stats_t stats;
+    ip_db_memory(db, &stats);
+    return stats.mem_total;
+}
+
+// ------------------------------------------------------------------
+// Snapshot the load figures and, when instrumented, the lookup
+// counters of the DB, summed over threads.
+// Return 0 on success, and -1 if any input is invalid.
+
+int
+ip_db_stats(ip_db_t *db, ip_db_stats_t *stats, uint64_t *bucket_lookups,
+            uint64_t *bucket_depth)
+{
+    if (db == NULL || stats == NULL) {
+        return -1;
+    }
+
+    uint hint_num = 1 << (8*db->hindex_size), h, k;
+    memset(stats, 0, sizeof(*stats));
+    stats->load_ns = db->load_ns;
+    ip_db_memory(db, stats);
+
+    // Entries whose key falls in each bucket.
+    stats->buckets = hint_num;
+    for (h = 0; h < hint_num; ++h) {
+        uint size = (h + 1 < hint_num ? db->hint[h+1] : db->index_num) - db->hint[h];
+        k = size ? 32 - __builtin_clz(size) : 0;
+        stats->bucket_sizes[k]++;
+        if (size > stats->bucket_max) {
+            stats->bucket_max = size;
+        }
+    }
+
+    if (bucket_lookups) {
+        memset(bucket_lookups, 0, sizeof(uint64_t) * hint_num);
+    }
+    if (bucket_depth) {
+        memset(bucket_depth, 0, sizeof(uint64_t) * hint_num);
+    }
+
+#ifdef IPLOC_STATS
+    stats->instrumented = 1;
+    for (k = 0; k < IP_STATS_SLOTS; ++k) {
+        ip_stats_slot_t *s = &db->stats[k];
+        uint d;
+
+        stats->lookups += atomic_load_explicit(&s->lookups, memory_order_relaxed);
+        stats->failures += atomic_load_explicit(&s->failures, memory_order_relaxed);
+        for (d = 0; d < IP_STATS_DEPTHS; ++d) {
+            stats->depth[d] += atomic_load_explicit(&s->depth[d], memory_order_relaxed);
+        }
+
+        _Atomic uint64_t *b = atomic_load_explicit(&s->buckets, memory_order_acquire);
+        for (h = 0; b && h < hint_num; ++h) {
+            if (bucket_lookups) {
+                bucket_lookups[h] += atomic_load_explicit(&b[2*h], memory_order_relaxed);
+            }
+            if (bucket_depth) {
+                bucket_depth[h] += atomic_load_explicit(&b[2*h+1], memory_order_relaxed);
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Return the number of entries in the DB index.
+
+uint32_t
+ip_db_count(ip_db_t *db)
+{
+    return db ? db->index_num : 0;
+}
+
+// ------------------------------------------------------------------
+// Return the number of entries IP_DB_COMPACT merged away.
+
+uint32_t
+ip_db_merged_count(ip_db_t *db)
+{
+    return db ? db->merged_num : 0;
+}
+
+// ------------------------------------------------------------------
+// Get the nth entry of the DB index.
+// Return 0 on success, and -1 if any input is invalid.
+
+int
+ip_db_entry(ip_db_t *db, uint32_t n, uint32_t *ip, ip_text_t *text)
+{
+    if (db == NULL || n >= db->index_num) {
+        return -1;
+    }
+
+    if (ip) {
+        *ip = ip_db_key(db, n);
+    }
+
+    if (text) {
+        text->text = ip_db_entry_text(db, n);
+        text->len = ip_db_entry_len(db, n);
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// _ip_db_reader_t is a reader's hazard pointer: the DB it is using, if
+// any. Each sits on its own cache line so readers never share one.
+
+struct _ip_db_reader_t
+{
+    _Atomic(ip_db_t*) hazard;   // DB pinned by the reader, NULL if none
+    atomic_int in_use;          // owned by a thread?
+    ip_db_reader_t *next;       // next record of the handle
+    ip_db_handle_t *handle;     // handle the record belongs to
+} __attribute__((aligned(64)));
+
+// ------------------------------------------------------------------
+// _ip_db_handle_t publishes the current DB to readers. Reader records
+// are never unlinked before the handle is destroyed, so writers can
+// scan them without synchronizing with readers.
+
+struct _ip_db_handle_t
+{
+    _Atomic(ip_db_t*) current;          // DB new readers get
+    _Atomic(ip_db_reader_t*) readers;   // list of reader records
+    pthread_mutex_t swap_lock;          // serializes writers only
+};
+
+// ------------------------------------------------------------------
+// Create a reloadable handle owning |db|.
+
+ip_db_handle_t*
+ip_db_handle_new(ip_db_t *db)
+{
+    if (db == NULL) {
+        return NULL;
+    }
+
+    ip_db_handle_t *h = (ip_db_handle_t*)malloc(sizeof(ip_db_handle_t));
+    atomic_init(&h->current, db);
+    atomic_init(&h->readers, NULL);
+    pthread_mutex_init(&h->swap_lock, NULL);
+    return h;
+}
+
+// ------------------------------------------------------------------
+// Destroy a handle, its current DB and all reader records.
+
+void
+ip_db_handle_destroy(ip_db_handle_t **h)
+{
+    if (*h) {
+        ip_db_handle_t *p = *h;
+        ip_db_t *db = atomic_load(&p->current);
+        ip_db_reader_t *r = atomic_load(&p->readers);
+
+        while (r) {
+            ip_db_reader_t *next = r->next;
+            free(r);
+            r = next;
+        }
+
+        ip_db_destroy(&db);
+        pthread_mutex_destroy(&p->swap_lock);
+        free(p);
+        *h = NULL;
+    }
+}
+
+// ------------------------------------------------------------------
+// Get a reader record for the calling thread, reusing a released one
+// when possible. Lock free.
+
+ip_db_reader_t*
+ip_db_reader_new(ip_db_handle_t *h)
+{
+    if (h == NULL) {
+        return NULL;
+    }
+
+    ip_db_reader_t *r;
+    for (r = atomic_load(&h->readers); r; r = r->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&r->in_use, &expected, 1)) {
+            return r;
+        }
+    }
+
+    if (posix_memalign((void**)&r, 64, sizeof(ip_db_reader_t)) != 0) {
+        return NULL;
+    }
+    atomic_init(&r->hazard, NULL);
+    atomic_init(&r->in_use, 1);
+    r->handle = h;
+
+    ip_db_reader_t *head = atomic_load(&h->readers);
+    do {
+        r->next = head;
+    } while (!atomic_compare_exchange_weak(&h->readers, &head, r));
+
+    return r;
+}
+
+// ------------------------------------------------------------------
+// Give a reader record back to its handle.
+
+void
+ip_db_reader_release(ip_db_reader_t **r)
+{
+    if (*r) {
+        atomic_store(&(*r)->hazard, NULL);
+        atomic_store(&(*r)->in_use, 0);
+        *r = NULL;
+    }
+}
+
+// ------------------------------------------------------------------
+// Pin the current DB: publish it as the reader's hazard, then check it
+// is still current, so a writer either sees the hazard or has not
+// swapped the DB yet. Lock free; retries only across a concurrent swap.
+
+ip_db_t*
+ip_db_pin(ip_db_reader_t *r)
+{
+    ip_db_t *db = atomic_load(&r->handle->current);
+
+    for (;;) {
+        atomic_store(&r->hazard, db);
+        ip_db_t *now = atomic_load(&r->handle->current);
+        if (now == db) {
+            return db;
+        }
+        db = now;
+    }
+}
+
+// ------------------------------------------------------------------
+// Unpin the DB pinned by ip_db_pin.
+
+void
+ip_db_unpin(ip_db_reader_t *r)
+{
+    atomic_store_explicit(&r->hazard, NULL, memory_order_release);
+}
+
+// ------------------------------------------------------------------
+// Publish |db| and destroy the previous DB once no reader holds it.
+// Return 0 on success, and -1 if any input is invalid or |db| is
+// already the current DB.
+
+int
+ip_db_handle_swap(ip_db_handle_t *h, ip_db_t *db)
+{
+    if (h == NULL || db == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&h->swap_lock);
+    if (atomic_load(&h->current) == db) {
+        pthread_mutex_unlock(&h->swap_lock);
+        return -1;
+    }
+    ip_db_t *old = atomic_exchange(&h->current, db);
+
+    ip_db_reader_t *r = atomic_load(&h->readers);
+    while (r) {
+        if (atomic_load(&r->hazard) == old) {
+            sched_yield();
+            continue;
+        }
+        r = r->next;
+    }
+
+    ip_db_destroy(&old);
+    pthread_mutex_unlock(&h->swap_lock);
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Load a DB file with ip_db_init_ex and swap it in.
+// Return 0 on success, and -1 if the DB cannot be loaded, in which
+// case the current DB stays in place.
+
+int
+ip_db_handle_reload(ip_db_handle_t *h, const char *path, uint32_t flags)
+{
+    if (h == NULL) {
+        return -1;
+    }
+
+    ip_db_t *db = ip_db_init_ex(path, flags);
+    if (db == NULL) {
+        return -1;
+    }
+    return ip_db_handle_swap(h, db);
+}
+
+// ------------------------------------------------------------------
+// Iterate the entries from |begin| to |end| (exclusive, clamped to the
+// number of entries).
+
+void
+ip_db_iter_init(ip_db_iter_t *it, ip_db_t *db, uint32_t begin, uint32_t end)
+{
+    uint n = db ? db->index_num : 0;
+    it->db = db;
+    it->end = end < n ? end : n;
+    it->pos = begin < it->end ? begin : it->end;
+}
+
+// ------------------------------------------------------------------
+// Get the next range of an iteration.
+// Return 0 on success, and -1 once the iteration is over.
+
+int
+ip_db_iter_next(ip_db_iter_t *it, ip_range_t *range, ip_text_t *text)
+{
+    if (it->pos >= it->end) {
+        return -1;
+    }
+
+    ip_db_t *db = it->db;
+    uint n = it->pos++;
+    if (range) {
+        range->first = n ? ip_db_key(db, n-1) + 1 : 0;
+        range->last = ip_db_key(db, n);
+    }
+    if (text) {
+        text->text = ip_db_entry_text(db, n);
+        text->len = ip_db_entry_len(db, n);
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// ip_buf_t is a growable output buffer of the exporters.
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} ip_buf_t;
+
+#define IP_EXPORT_FLUSH (1 << 20)   // flush a sequential export past this
+#define IP_EXPORT_CHUNK 8192        // entries per chunk of a parallel export
+
+// ------------------------------------------------------------------
+// Make room for |extra| more bytes. Return 0 on success, -1 on
+// allocation failure.
+
+static int
+ip_buf_reserve(ip_buf_t *b, size_t extra)
+{
+    if (b->len + extra <= b->cap) {
+        return 0;
+    }
+
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + extra) {
+        cap *= 2;
+    }
+    char *data = realloc(b->data, cap);
+    if (!data) {
+        return -1;
+    }
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Append a string of known length; room must have been reserved.
+
+static inline void
+ip_buf_put(ip_buf_t *b, const char *s, size_t len)
+{
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+}
+
+// ------------------------------------------------------------------
+// Append a dotted quad; room must have been reserved.
+
+static inline void
+ip_buf_put_ip(ip_buf_t *b, uint ip_val)
+{
+    b->len += ip_format_v4(ip_val, b->data + b->len);
+}
+
+// ------------------------------------------------------------------
+// Append a CSV field, quoted only if needed. Room must have been
+// reserved for twice its length plus 2.
+
+static void
+ip_buf_put_csv(ip_buf_t *b, const char *s, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        if (s[i] == ',' || s[i] == '"' || s[i] == '\n' || s[i] == '\r') {
+            break;
+        }
+    }
+    if (i == len) {
+        ip_buf_put(b, s, len);
+        return;
+    }
+
+    b->data[b->len++] = '"';
+    for (i = 0; i < len; ++i) {
+        if (s[i] == '"') {
+            b->data[b->len++] = '"';
+        }
+        b->data[b->len++] = s[i];
+    }
+    b->data[b->len++] = '"';
+}
+
+// ------------------------------------------------------------------
+// Append a JSON string. Room must have been reserved for six times its
+// length plus 2.
+
+static void
+ip_buf_put_json(ip_buf_t *b, const char *s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    b->data[b->len++] = '"';
+    for (i = 0; i < len; ++i) {
+        byte c = s[i];
+        if (c == '"' || c == '\\') {
+            b->data[b->len++] = '\\';
+            b->data[b->len++] = c;
+        } else if (c < 0x20) {
+            ip_buf_put(b, "\\u00", 4);
+            b->data[b->len++] = hex[c >> 4];
+            b->data[b->len++] = hex[c & 15];
+        } else {
+            b->data[b->len++] = c;
+        }
+    }
+    b->data[b->len++] = '"';
+}
+
+// ------------------------------------------------------------------
+// Append one range in the given format.
+// Return 0 on success, -1 on allocation failure.
+
+static int
+ip_export_range(ip_buf_t *b, uint format, const ip_range_t *r, const ip_text_t *t)
+{
+    const char *p = t->text, *end = t->text + t->len;
+
+    // Fixed parts take at most 64 bytes, plus up to 62 CIDR blocks of
+    // 19 bytes around as many copies of the text.
+    if (ip_buf_reserve(b, 64 + 6 * (size_t)t->len +
+                       (format == IP_EXPORT_CIDR ? 62 * (t->len + 20) : 0)) != 0) {
+        return -1;
+    }
+
+    switch (format) {
+    case IP_EXPORT_TSV:
+        ip_buf_put_ip(b, r->first);
+        b->data[b->len++] = '\t';
+        ip_buf_put_ip(b, r->last);
+        b->data[b->len++] = '\t';
+        ip_buf_put(b, t->text, t->len);
+        b->data[b->len++] = '\n';
+        break;
+
+    case IP_EXPORT_CSV:
+        ip_buf_put_ip(b, r->first);
+        b->data[b->len++] = ',';
+        ip_buf_put_ip(b, r->last);
+        for (;;) {
+            const char *tab = memchr(p, '\t', end - p);
+            b->data[b->len++] = ',';
+            ip_buf_put_csv(b, p, (tab ? tab : end) - p);
+            if (!tab) {
+                break;
+            }
+            p = tab + 1;
+        }
+        b->data[b->len++] = '\n';
+        break;
+
+    case IP_EXPORT_CIDR: {
+        ip_cidr_t cidrs[64];
+        size_t i, n = ip_range_cidrs(r->first, r->last, cidrs, 64);
+        for (i = 0; i < n; ++i) {
+            ip_buf_put_ip(b, cidrs[i].ip);
+            b->data[b->len++] = '/';
+            if (cidrs[i].prefix >= 10) {
+                b->data[b->len++] = '0' + cidrs[i].prefix / 10;
+            }
+            b->data[b->len++] = '0' + cidrs[i].prefix % 10;
+            b->data[b->len++] = '\t';
+            ip_buf_put(b, t->text, t->len);
+            b->data[b->len++] = '\n';
+        }
+        break;
+    }
+
+    case IP_EXPORT_JSONL:
+        ip_buf_put(b, "{\"first\":\"", 10);
+        ip_buf_put_ip(b, r->first);
+        ip_buf_put(b, "\",\"last\":\"", 10);
+        ip_buf_put_ip(b, r->last);
+        ip_buf_put(b, "\",\"fields\":[", 12);
+        for (;;) {
+            const char *tab = memchr(p, '\t', end - p);
+            ip_buf_put_json(b, p, (tab ? tab : end) - p);
+            if (!tab) {
+                break;
+            }
+            b->data[b->len++] = ',';
+            p = tab + 1;
+        }
+        ip_buf_put(b, "]}\n", 3);
+        break;
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Write a whole buffer. Return 0 on success, -1 on write failure.
+
+static int
+ip_write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Format the entries from |begin| to |end| into |b|.
+// Return 0 on success, -1 on allocation failure.
+
+static int
+ip_export_chunk(ip_db_t *db, uint format, uint begin, uint end, ip_buf_t *b)
+{
+    ip_db_iter_t it;
+    ip_range_t r;
+    ip_text_t t;
+
+    ip_db_iter_init(&it, db, begin, end);
+    while (ip_db_iter_next(&it, &r, &t) == 0) {
+        if (ip_export_range(b, format, &r, &t) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// State of a parallel export. Worker t formats chunks t, t+T, t+2T...
+// into slot t, and the calling thread writes the slots out in chunk
+// order. A slot holds chunk |ready[t]|, or none while that is below
+// the next chunk of the worker.
+
+typedef struct {
+    ip_db_t *db;
+    uint format;
+    uint threads;
+    uint chunks;
+    ip_buf_t *slot;
+    uint *ready;        // chunk + 1 held by each slot, 0 if empty
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ip_export_t;
+
+typedef struct {
+    ip_export_t *e;
+    uint id;
+} ip_export_worker_t;
+
+static void*
+ip_export_worker(void *arg)
+{
+    ip_export_worker_t *w = arg;
+    ip_export_t *e = w->e;
+    uint c;
+
+    for (c = w->id; c < e->chunks; c += e->threads) {
+        pthread_mutex_lock(&e->lock);
+        while (e->ready[w->id] && !e->failed) {
+            pthread_cond_wait(&e->cond, &e->lock);
+        }
+        int failed = e->failed;
+        pthread_mutex_unlock(&e->lock);
+        if (failed) {
+            break;
+        }
+
+        ip_buf_t *b = &e->slot[w->id];
+        b->len = 0;
+        int rc = ip_export_chunk(e->db, e->format, c * IP_EXPORT_CHUNK,
+                                 (c + 1) * IP_EXPORT_CHUNK, b);
+
+        pthread_mutex_lock(&e->lock);
+        e->ready[w->id] = c + 1;
+        e->failed |= rc != 0;
+        pthread_cond_broadcast(&e->cond);
+        pthread_mutex_unlock(&e->lock);
+    }
+    return NULL;
+}
+
+// ------------------------------------------------------------------
+// Export the whole DB to |fd| with |threads| formatting threads.
+// Return 0 on success, and -1 on failure.
+
+int
+ip_db_export(ip_db_t *db, int fd, uint32_t format, uint32_t threads)
+{
+    if (db == NULL || format > IP_EXPORT_JSONL) {
+        return -1;
+    }
+
+    ip_buf_t b = {NULL, 0, 0};
+    uint chunks = (db->index_num + IP_EXPORT_CHUNK - 1) / IP_EXPORT_CHUNK;
+    int rc = 0;
+
+    if (threads <= 1 || chunks <= 1) {
+        ip_db_iter_t it;
+        ip_range_t r;
+        ip_text_t t;
+
+        ip_db_iter_init(&it, db, 0, db->index_num);
+        while (rc == 0 && ip_db_iter_next(&it, &r, &t) == 0) {
+            rc = ip_export_range(&b, format, &r, &t);
+            if (rc == 0 && b.len >= IP_EXPORT_FLUSH) {
+                rc = ip_write_all(fd, b.data, b.len);
+                b.len = 0;
+            }
+        }
+        if (rc == 0) {
+            rc = ip_write_all(fd, b.data, b.len);
+        }
+        free(b.data);
+        return rc;
+    }
+
+    if (threads > chunks) {
+        threads = chunks;
+    }
+
+    ip_export_t e;
+    e.db = db;
+    e.format = format;
+    e.threads = threads;
+    e.chunks = chunks;
+    e.slot = calloc(threads, sizeof(ip_buf_t));
+    e.ready = calloc(threads, sizeof(uint));
+    e.failed = 0;
+    pthread_mutex_init(&e.lock, NULL);
+    pthread_cond_init(&e.cond, NULL);
+
+    ip_export_worker_t *workers = malloc(sizeof(ip_export_worker_t) * threads);
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    uint i, c;
+
+    for (i = 0; i < threads; ++i) {
+        workers[i].e = &e;
+        workers[i].id = i;
+        pthread_create(&tids[i], NULL, ip_export_worker, &workers[i]);
+    }
+
+    for (c = 0; c < chunks; ++c) {
+        uint t = c % threads;
+
+        pthread_mutex_lock(&e.lock);
+        while (e.ready[t] != c + 1 && !e.failed) {
+            pthread_cond_wait(&e.cond, &e.lock);
+        }
+        int failed = e.failed;
+        pthread_mutex_unlock(&e.lock);
+        if (failed) {
+            break;
+        }
+
+        int wrc = ip_write_all(fd, e.slot[t].data, e.slot[t].len);
+
+        pthread_mutex_lock(&e.lock);
+        e.ready[t] = 0;
+        e.failed |= wrc != 0;
+        pthread_cond_broadcast(&e.cond);
+        pthread_mutex_unlock(&e.lock);
+    }
+
+    for (i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+        free(e.slot[i].data);
+    }
+    rc = e.failed ? -1 : 0;
+
+    pthread_cond_destroy(&e.cond);
+    pthread_mutex_destroy(&e.lock);
+    free(tids);
+    free(workers);
+    free(e.ready);
+    free(e.slot);
+    return rc;
+}
+
+// ------------------------------------------------------------------
+// Dump the whole DB to stdout in the original format: the last IP of
+// each range and its text, separated by two tabs.
+
+void ip_db_dump(ip_db_t *db)
+{
+    fprintf(stderr, "extended=%u, index_num=%u\n", db->extended, db->index_num);
+    fflush(stdout);
+
+    ip_buf_t b = {NULL, 0, 0};
+    ip_db_iter_t it;
+    ip_range_t r;
+    ip_text_t t;
+
+    ip_db_iter_init(&it, db, 0, db->index_num);
+    while (ip_db_iter_next(&it, &r, &t) == 0) {
+        if (ip_buf_reserve(&b, 20 + t.len) != 0) {
+            break;
+        }
+        ip_buf_put_ip(&b, r.last);
+        ip_buf_put(&b, "\t\t", 2);
+        ip_buf_put(&b, t.text, t.len);
+        b.data[b.len++] = '\n';
+
+        if (b.len >= IP_EXPORT_FLUSH || it.pos == it.end) {
+            if (ip_write_all(STDOUT_FILENO, b.data, b.len) != 0) {
+                break;
+            }
+            b.len = 0;
+        }
+    }
+    free(b.data);
+}
+
+// ------------------------------------------------------------------
+// Tell whether the nth entry of |a| and the mth of |b| have the same
+// location text.
+
+static inline int
+ip_db_same_text(ip_db_t *a, uint n, ip_db_t *b, uint m)
+{
+    uint len = ip_db_entry_len(a, n);
+    const char *x = ip_db_entry_text(a, n);
+    const char *y = ip_db_entry_text(b, m);
+    return len == ip_db_entry_len(b, m) && (x == y || memcmp(x, y, len) == 0);
+}
+
+// ------------------------------------------------------------------
+// Compare two DBs in one merge of their indexes: each step covers the
+// IPs up to the nearer of the two current range ends, so both DBs are
+// walked once whatever their range boundaries. Touching changes with
+// the same texts are reported as one.
+// Return 0 on success, and -1 on invalid input or when |cb| stops
+// the walk.
+
+int
+ip_db_diff(ip_db_t *old_db, ip_db_t *new_db, ip_diff_cb cb, void *arg,
+           size_t *count)
+{
+    if (count) {
+        *count = 0;
+    }
+    if (old_db == NULL || new_db == NULL || cb == NULL ||
+        old_db->index_num == 0 || new_db->index_num == 0) {
+        return -1;
+    }
+
+    uint i = 0, j = 0, first = 0;
+    uint pi = 0, pj = 0;            // entries of the pending change
+    int pending = 0;
+    size_t changes = 0;
+    ip_diff_t d;
+
+    while (i < old_db->index_num && j < new_db->index_num) {
+        uint a = ip_db_key(old_db, i), b = ip_db_key(new_db, j);
+        uint last = a < b ? a : b;
+
+        if (!ip_db_same_text(old_db, i, new_db, j)) {
+            // Extend the pending change when the texts carry on.
+            if (pending && (pi == i || ip_db_same_text(old_db, pi, old_db, i)) &&
+                (pj == j || ip_db_same_text(new_db, pj, new_db, j))) {
+                d.range.last = last;
+            } else {
+                if (pending && cb(&d, arg) != 0) {
+                    return -1;
+                }
+                pending = 1;
+                pi = i;
+                pj = j;
+                d.range.first = first;
+                d.range.last = last;
+                d.before.text = ip_db_entry_text(old_db, i);
+                d.before.len = ip_db_entry_len(old_db, i);
+                d.after.text = ip_db_entry_text(new_db, j);
+                d.after.len = ip_db_entry_len(new_db, j);
+                ++changes;
+            }
+        } else if (pending) {
+            pending = 0;
+            if (cb(&d, arg) != 0) {
+                return -1;
+            }
+        }
+
+        if (last == 0xffffffff) {
+            break;
+        }
+        first = last + 1;
+        i += a == last;
+        j += b == last;
+    }
+
+    if (pending && cb(&d, arg) != 0) {
+        return -1;
+    }
+    if (count) {
+        *count = changes;
+    }
+    return 0;
+}
@@ -25,7 +25,152 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdint.h>
 
+#include <stddef.h>
+
 typedef struct _ip_db_t ip_db_t;
+typedef struct _ip_db_handle_t ip_db_handle_t;
+typedef struct _ip_db_reader_t ip_db_reader_t;
+
+//
+// ip_text_t references a location description inside a DB. The text
+// is NOT NUL-terminated and stays valid until the DB is destroyed.
+//
+typedef struct {
+    const char *text;
+    uint32_t len;
+} ip_text_t;
+
+//
+// Field numbers of a location description. The base version carries
+// the first 4 fields, the extended version more of them.
+//
+#define IP_FIELD_COUNTRY    0
+#define IP_FIELD_PROVINCE   1
+#define IP_FIELD_CITY       2
+#define IP_FIELD_OWNER      3
+#define IP_FIELD_ISP        4
+#define IP_FIELD_LATITUDE   5
+#define IP_FIELD_LONGITUDE  6
+#define IP_FIELD_TIMEZONE   7
+#define IP_FIELD_UTC_OFFSET 8
+#define IP_FIELD_AREA_CODE  9
+#define IP_FIELD_PHONE_CODE 10
+#define IP_FIELD_CC         11
+#define IP_FIELD_CONTINENT  12
+
+#define IP_FIELDS_MAX 16
+
+//
+// Pseudo field number naming the whole description text.
+//
+#define IP_FIELD_TEXT 0xffffffffu
+
+//
+// ip_fields_t holds the tab separated fields of a location
+// description, each referenced in place.
+//
+typedef struct {
+    uint32_t count;
+    ip_text_t field[IP_FIELDS_MAX];
+} ip_fields_t;
+
+//
+// ip_range_t is the inclusive range of IPs (values in host
+// representation) from |first| to |last|.
+//
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} ip_range_t;
+
+//
+// ip_cidr_t is the block of IPs sharing the first |prefix| bits of
+// |ip| (value in host representation).
+//
+typedef struct {
+    uint32_t ip;
+    uint32_t prefix;
+} ip_cidr_t;
+
+//
+// ip_v6_t is an IPv6 address as two 64 bit halves in host
+// representation, |hi| holding the first 8 bytes.
+//
+typedef struct {
+    uint64_t hi;
+    uint64_t lo;
+} ip_v6_t;
+
+//
+// ip_diff_t is a change between two DBs: the IPs of |range| moved from
+// the location |before| to |after|, both referenced in place.
+//
+typedef struct {
+    ip_range_t range;
+    ip_text_t before;
+    ip_text_t after;
+} ip_diff_t;
+
+//
+// ip_diff_cb receives each change found by ip_db_diff. Returning
+// non-zero stops the walk.
+//
+typedef int (*ip_diff_cb)(const ip_diff_t *diff, void *arg);
+
+//
+// ip_db_iter_t walks the ranges of a DB in ascending order. Its fields
+// are private.
+//
+typedef struct {
+    ip_db_t *db;
+    uint32_t pos;
+    uint32_t end;
+} ip_db_iter_t;
+
+//
+// Output formats of ip_db_export, one range (or CIDR block) per line:
+//
+//   IP_EXPORT_TSV    first, last and the location text, tab separated
+//   IP_EXPORT_CSV    first, last and each location field, quoted as needed
+//   IP_EXPORT_CIDR   each CIDR block of the range and the location text
+//   IP_EXPORT_JSONL  {"first":..,"last":..,"fields":[..]}
+//
+#define IP_EXPORT_TSV   0
+#define IP_EXPORT_CSV   1
+#define IP_EXPORT_CIDR  2
+#define IP_EXPORT_JSONL 3
+
+//
+// ip_db_stats_t is a snapshot of ip_db_stats. Lookup counters are only
+// kept by a library built with -DIPLOC_STATS (make STATS=1), as told
+// by |instrumented|; otherwise they read 0.
+//
+#define IP_STATS_DEPTHS 32
+
+typedef struct {
+    uint64_t load_ns;           // time ip_db_init_ex took
+    size_t mem_raw;             // file copy, 0 when mapped
+    size_t mem_hint;            // decoded hint table
+    size_t mem_index;           // decoded keys, offsets and lengths
+    size_t mem_eytzinger;       // IP_DB_EYTZINGER tables
+    size_t mem_direct;          // IP_DB_DIRECT tables
+    size_t mem_locations;       // IP_DB_LOC_IDS tables
+    size_t mem_fields;          // IP_DB_FIELDS tables
+    size_t mem_inverted;        // IP_DB_INVERTED tables
+    size_t mem_replicas;        // IP_DB_NUMA copies of the tables
+    size_t mem_v6;              // IPv6 ranges, see ip_db_load_v6
+    size_t mem_total;           // all of the above plus the DB object, see ip_db_footprint
+    size_t mem_locked;          // bytes IP_DB_LOCK locked in memory
+    int huge_pages;             // tables on explicit (2) or transparent (1) huge pages
+    int numa_replicas;          // number of IP_DB_NUMA replicas
+    uint32_t buckets;           // number of hint buckets
+    uint32_t bucket_max;        // most entries in one bucket
+    uint32_t bucket_sizes[33];  // buckets with 0, 1, 2-3, 4-7, ... entries
+    int instrumented;           // built with IPLOC_STATS?
+    uint64_t lookups;           // successful lookups
+    uint64_t failures;          // lookups rejected, e.g. for IP 0
+    uint64_t depth[IP_STATS_DEPTHS]; // single lookups by number of search probes
+} ip_db_stats_t;
 
 //
 // ip_db_init creates and then initializes an ip_db_t object using the
@@ -41,6 +186,111 @@ ip_db_t* ip_db_init(const char *path);
 //
 ip_db_t* ip_db_init_x(const char *path);
 
+//
+// ip_db_init_mmap works like ip_db_init, except that the DB file is
+// mapped read-only and shared instead of being copied into private
+// memory. Processes mapping the same file share one physical copy
+// through the page cache. The file must not be truncated or rewritten
+// in place while mapped; replace it via rename instead.
+//
+ip_db_t* ip_db_init_mmap(const char *path);
+
+//
+// ip_db_init_x_mmap is the extended version counterpart of
+// ip_db_init_mmap.
+//
+ip_db_t* ip_db_init_x_mmap(const char *path);
+
+//
+// Load options of ip_db_init_ex.
+//
+#define IP_DB_EXTENDED  0x0001  // the file is an extended (datx) DB
+#define IP_DB_MMAP      0x0002  // map the file instead of copying it, see ip_db_init_mmap
+#define IP_DB_DECODE    0x0004  // decode the index into native arrays at load time
+#define IP_DB_EYTZINGER 0x0008  // search hint ranges laid out in Eytzinger order
+#define IP_DB_SIMD      0x0010  // finish searches with a SIMD key comparison kernel
+#define IP_DB_DIRECT    0x0020  // O(1) DIR-24-8 lookup tables
+#define IP_DB_LOC_IDS   0x0040  // build a deduplicated location table, see ip_locate_id
+#define IP_DB_FIELDS    0x0080  // pre-split location fields, see ip_locate_fields
+#define IP_DB_VERIFY    0x0100  // verify the data checksum of a native DB
+#define IP_DB_COMPACT   0x0200  // merge adjacent entries with the same text
+#define IP_DB_INVERTED  0x0400  // index entries by location and field, see ip_db_ranges
+#define IP_DB_HUGEPAGES 0x0800  // pack the tables into memory backed by huge pages
+#define IP_DB_LOCK      0x1000  // lock the tables in memory, or at least prefault them
+#define IP_DB_NUMA      0x2000  // copy the tables to every NUMA node
+#define IP_DB_GENERIC   0x4000  // search a packed index without format specialization
+
+//
+// ip_db_init_ex creates and then initializes an ip_db_t object using
+// the given 17MON DB file and a bitwise OR of IP_DB_* load options.
+// IP_DB_DECODE decodes the packed big endian index once into aligned,
+// native endian arrays of keys, text offsets and text lengths, so
+// searches only touch a dense key array. It costs about 10 extra bytes
+// per index entry.
+//
+// IP_DB_EYTZINGER rearranges the keys of each hint range into
+// Eytzinger (BFS) order and searches them without branching, which
+// keeps the top levels of every range in a few hot cache lines. It
+// costs about 8 extra bytes per index entry and returns exactly the
+// same results as the default binary search.
+//
+// IP_DB_SIMD implies IP_DB_DECODE. Searches narrow down to a window of
+// 32 keys and then count the keys below the IP with SSE2 or AVX2
+// compares, chosen at runtime from what the CPU supports, or a scalar
+// loop elsewhere. ip_locate_batch uses the same kernel.
+//
+// IP_DB_DIRECT builds DIR-24-8 tables from the index: a 2^24 slot table
+// holds the entry of every /24 covered by a single entry, and each /24
+// split across entries gets a 256 slot chunk. Every lookup then takes
+// at most two dependent loads. It costs 64 MB plus 1 KB per split /24;
+// see ip_db_footprint.
+//
+// Lookups on the packed index of a 17MON DB run code specialized for
+// its format (dat or datx), picked once at load time. IP_DB_GENERIC
+// keeps the format-generic search instead, with the entry stride and
+// the hint shift read from the DB, for benchmarking the difference.
+//
+// IP_DB_FIELDS implies IP_DB_LOC_IDS, and IP_DB_INVERTED implies
+// IP_DB_FIELDS.
+//
+// IP_DB_COMPACT implies IP_DB_DECODE. Runs of neighbouring entries
+// with the same description text are merged into one range and the
+// hints are rebuilt to match, which makes every search shallower and
+// every table built after it smaller. Lookups return the same texts;
+// ip_db_count and ip_db_entry see the merged index, and
+// ip_db_merged_count tells how many entries were removed.
+//
+// Files written by ip_db_compile are recognized by their header, and
+// IP_DB_EXTENDED is then ignored. Such a native DB is used in place
+// without decoding, already has decoded keys and a location table,
+// and is best loaded with IP_DB_MMAP. Its header is always checked;
+// IP_DB_VERIFY also checks the data checksum, at the cost of reading
+// the whole file.
+//
+// IP_DB_EYTZINGER, IP_DB_SIMD and IP_DB_DIRECT select alternative
+// search engines; if several are given, the last one listed here
+// takes effect.
+//
+ip_db_t* ip_db_init_ex(const char *path, uint32_t flags);
+
+//
+// ip_db_init_ipdb creates and then initializes an ip_db_t object using
+// the given IPIP .ipdb file, which is always mapped, and IP_DB_* load
+// options. |languages| and |fields| are comma separated lists of the
+// languages (e.g. "CN,EN") and fields (e.g. "country_name,city_name")
+// named by the file metadata whose columns make up the description
+// texts, in that order; NULL selects the first language and all of its
+// fields. Only the selected columns of a record are ever read: when
+// they are adjacent the texts are used in place, otherwise they are
+// joined into a text pool at load time. The IPv4 part of the trie,
+// reached by skipping the IPv4-mapped prefix once, is flattened into
+// the index at load time, so every load option and lookup function
+// applies, and IPs in no range have an empty text. ip_db_init_ex
+// recognizes .ipdb files by their header too, with the defaults.
+//
+ip_db_t* ip_db_init_ipdb(const char *path, uint32_t flags, const char *languages,
+                         const char *fields);
+
 //
 // ip_db_destroy destroies an ip_db_t object and reclaim all memory 
 // allocated underneath.
@@ -53,6 +303,33 @@ void ip_db_destroy(ip_db_t **db);
 //
 int ip_locate(ip_db_t *db, const char *ipv4, char *result);
 
+//
+// ip_parse_v4 parses the dotted quad of exactly |len| bytes at |s| into
+// |ip| (host representation). It accepts what inet_pton(AF_INET) does,
+// and unlike ip_locate it tells malformed input apart from 0.0.0.0.
+// Return 0 on success, -1 on malformed input.
+//
+int ip_parse_v4(const char *s, size_t len, uint32_t *ip);
+
+//
+// ip_parse_v4_lines parses up to |max| newline separated dotted quads
+// from |buf| into |ips|, ready for ip_locate_batch. A trailing '\r' on
+// a line is ignored. Malformed lines yield 0 in |ips| and, if |valid|
+// is not NULL, 0 in |valid| (1 otherwise). The number of bytes used is
+// stored in |consumed| if not NULL; the last line of |buf| counts even
+// without a newline, so pass only complete lines when streaming.
+// Return the number of lines parsed.
+//
+size_t ip_parse_v4_lines(const char *buf, size_t len, uint32_t *ips,
+                         unsigned char *valid, size_t max, size_t *consumed);
+
+//
+// ip_format_v4 writes |ip_val| (host representation) to |buf| as a
+// NUL-terminated dotted quad; |buf| must hold 16 bytes. Unlike
+// inet_ntoa it is thread safe. Return the length of the text.
+//
+int ip_format_v4(uint32_t ip_val, char *buf);
+
 //
 // ip_locate_v searches for the specified IP (value in host representation).
 // If found, 0 is returned with its location description copied into the
@@ -62,8 +339,304 @@ int ip_locate(ip_db_t *db, const char *ipv4, char *result);
 int ip_locate_v(ip_db_t *db, uint32_t ip_val, char *result);
 
 //
-// ip_db_dump dumps the whole DB to stdout (meta info to stderr). You may
-// want to redirect the output to a file.
+// ip_locate_ref searches for the specified IP (value in host
+// representation) without copying. If found, 0 is returned with |text|
+// pointing at the location description inside the DB and |len| set to
+// its length, -1 otherwise. The text is NOT NUL-terminated and stays
+// valid until the DB is destroyed.
+//
+int ip_locate_ref(ip_db_t *db, uint32_t ip_val, const char **text, uint32_t *len);
+
+//
+// ip_db_load_v6 loads the IPv6 ranges of a text file into |db|,
+// replacing any loaded before; it must not race with lookups. Each
+// line holds a range and its description, either as
+//
+//   first<TAB>last<TAB>text    e.g. 2001:db8::<TAB>2001:db8::ffff<TAB>...
+//   prefix/len<TAB>text        e.g. 2001:db8::/32<TAB>...
+//
+// in any order, without overlaps. Empty lines and lines starting with
+// '#' are skipped, and IPv4 addresses stand for their IPv4-mapped
+// ones. Return 0 on success, -1 otherwise.
+//
+int ip_db_load_v6(ip_db_t *db, const char *path);
+
+//
+// ip_db_count_v6 returns the number of IPv6 ranges of the DB, counting
+// unassigned gaps between them.
+//
+uint32_t ip_db_count_v6(ip_db_t *db);
+
+//
+// ip_parse_v6 parses the IPv6 address in |s| (|len| bytes, any text
+// form inet_pton accepts). Return 0 on success, -1 otherwise.
+//
+int ip_parse_v6(const char *s, size_t len, ip_v6_t *ip);
+
+//
+// ip_locate_v6 finds the description of an IPv6 address. The top 16
+// bits select a bucket of a 64K entry table, crowded buckets are split
+// again on the next 8 bits, and a binary search over the bucket
+// finishes the lookup. IPv4-mapped addresses (::ffff:0:0/96) in no
+// IPv6 range are looked up in the IPv4 index. Return 0 on success, -1
+// if any input is invalid or no range holds the address.
+//
+int ip_locate_v6(ip_db_t *db, ip_v6_t ip, ip_text_t *text);
+
+//
+// ip_locate_batch searches for |n| IPs (values in host representation)
+// at once and stores a reference to each location description in the
+// matching slot of |out|. Slots of invalid IPs get a NULL text. Many
+// searches are run in lockstep so their memory accesses overlap, and
+// input sorted in ascending order is resolved in a single sweep over
+// the index. Return 0 on success, -1 if any argument is invalid.
+//
+int ip_locate_batch(ip_db_t *db, const uint32_t *ips, size_t n, ip_text_t *out);
+
+//
+// ip_locate_id searches for the specified IP (value in host
+// representation) and returns the id of its location. Ids are dense,
+// from 0 to ip_db_loc_count()-1, and equal ids mean equal description
+// texts, so they can index arrays directly. Requires a DB loaded with
+// IP_DB_LOC_IDS. Return 0 on success, -1 otherwise.
+//
+int ip_locate_id(ip_db_t *db, uint32_t ip_val, uint32_t *loc_id);
+
+//
+// ip_db_loc_count returns the number of unique locations in a DB
+// loaded with IP_DB_LOC_IDS, 0 otherwise.
+//
+uint32_t ip_db_loc_count(ip_db_t *db);
+
+//
+// ip_db_loc_text gets the description text of a location id. Each
+// unique text is stored once. Return 0 on success, -1 if the id is
+// out of range.
+//
+int ip_db_loc_text(ip_db_t *db, uint32_t loc_id, ip_text_t *text);
+
+//
+// ip_locate_fields searches for the specified IP (value in host
+// representation) and returns the fields of its location description.
+// Field boundaries are computed once per unique location at load time,
+// so no scanning happens here. Requires a DB loaded with IP_DB_FIELDS.
+// Return 0 on success, -1 otherwise.
+//
+int ip_locate_fields(ip_db_t *db, uint32_t ip_val, ip_fields_t *fields);
+
+//
+// ip_locate_field works like ip_locate_fields but only returns the
+// field numbered |field| (one of IP_FIELD_*), or the whole location
+// text for IP_FIELD_TEXT. Return 0 on success, -1 otherwise, including
+// when the location has no such field.
+//
+int ip_locate_field(ip_db_t *db, uint32_t ip_val, uint32_t field, ip_text_t *text);
+
+//
+// ip_db_loc_fields gets the fields of a location id. Requires a DB
+// loaded with IP_DB_FIELDS. Return 0 on success, -1 otherwise.
+//
+int ip_db_loc_fields(ip_db_t *db, uint32_t loc_id, ip_fields_t *fields);
+
+//
+// ip_db_ranges lists the IP ranges whose location text equals |text|
+// (for IP_FIELD_TEXT) or whose field numbered |field| equals |text|,
+// in ascending order, with touching ranges merged. It stores the first
+// |max| ranges in |out| and the total number in |count|, so a call
+// with |max| 0 sizes the output. It takes time proportional to the
+// number of index entries found. Requires a DB loaded with
+// IP_DB_INVERTED. Return 0 on success, including when nothing
+// matches, -1 otherwise.
+//
+int ip_db_ranges(ip_db_t *db, uint32_t field, const char *text, uint32_t len,
+                 ip_range_t *out, size_t max, size_t *count);
+
+//
+// ip_db_cidrs works like ip_db_ranges but lists the fewest CIDR
+// blocks covering the same IPs.
+//
+int ip_db_cidrs(ip_db_t *db, uint32_t field, const char *text, uint32_t len,
+                ip_cidr_t *out, size_t max, size_t *count);
+
+//
+// ip_range_cidrs splits the range from |first| to |last| into the
+// fewest CIDR blocks, stores the first |max| of them in |out| and
+// returns their total number.
+//
+size_t ip_range_cidrs(uint32_t first, uint32_t last, ip_cidr_t *out, size_t max);
+
+//
+// ip_db_compile writes |db| to |path| in the native iploc format: an
+// aligned, versioned header followed by host byte order key, offset
+// and location arrays plus each unique location text once. Loading it
+// with ip_db_init_ex(path, IP_DB_MMAP) takes no decoding. The file is
+// written aside and renamed into place. Return 0 on success, -1
+// otherwise.
+//
+int ip_db_compile(ip_db_t *db, const char *path);
+
+//
+// IP_DB_HUGEPAGES copies the raw data and every lookup table into one
+// region backed by explicit huge pages (MAP_HUGETLB) when some are
+// reserved, or else 2 MB aligned and advised for transparent huge
+// pages, so a few TLB entries cover the whole index. The region is a
+// private copy, even of a DB loaded with IP_DB_MMAP.
+//
+// IP_DB_NUMA gives each NUMA node its own copy of the lookup tables,
+// packed like IP_DB_HUGEPAGES by a thread running on that node. The
+// lookup functions pick the copy of the node the calling thread runs
+// on. It costs one copy per node and does nothing on a single node.
+//
+// IP_DB_LOCK locks the tables (and copies) in memory with mlock so
+// lookups never fault. When RLIMIT_MEMLOCK is too low it falls back to
+// touching every page once; ip_db_stats tells what was locked.
+//
+// ip_db_footprint returns the number of bytes of memory the DB holds,
+// including every table built by its load options. A mapped file is
+// not counted, since its pages belong to the page cache.
+//
+size_t ip_db_footprint(ip_db_t *db);
+
+//
+// ip_db_stats snapshots the load time, memory per structure and hint
+// bucket size distribution of |db| and, when instrumented, its lookup
+// counters summed over all threads. If not NULL, |bucket_lookups| and
+// |bucket_depth| receive the lookups and total search probes of each
+// of the |buckets| hint buckets. Batched lookups only count towards
+// |lookups| and |failures|. Instrumentation keeps per-thread counters
+// on separate cache lines; without it searches are not touched at
+// all. Return 0 on success, -1 otherwise.
+//
+int ip_db_stats(ip_db_t *db, ip_db_stats_t *stats, uint64_t *bucket_lookups,
+                uint64_t *bucket_depth);
+
+//
+// ip_db_count returns the number of entries in the DB index.
+//
+uint32_t ip_db_count(ip_db_t *db);
+
+//
+// ip_db_merged_count returns the number of entries IP_DB_COMPACT
+// merged into their neighbours, 0 for a DB loaded without it.
+//
+uint32_t ip_db_merged_count(ip_db_t *db);
+
+//
+// ip_db_entry gets the nth entry of the DB index: |ip| receives the
+// last IP of the range the entry covers and |text| its location
+// description. Return 0 on success, -1 if |n| is out of range.
+//
+int ip_db_entry(ip_db_t *db, uint32_t n, uint32_t *ip, ip_text_t *text);
+
+//
+// Hot reload. An ip_db_handle_t publishes a DB to many reader threads
+// and lets a writer swap in a new one without stopping them. Readers
+// never take a lock: each thread gets an ip_db_reader_t once, then
+// brackets every use of the DB with ip_db_pin and ip_db_unpin:
+//
+//     ip_db_reader_t *r = ip_db_reader_new(handle);   // once per thread
+//     ...
+//     ip_db_t *db = ip_db_pin(r);
+//     ip_locate_ref(db, ip, &text, &len);             // use text here
+//     ip_db_unpin(r);
+//
+// A swap publishes the new DB atomically and destroys the old one once
+// every reader that pinned it has unpinned, so results referencing the
+// old DB must not be used after ip_db_unpin.
+//
+
+//
+// ip_db_handle_new creates a handle that takes over |db|. Return NULL
+// if |db| is NULL.
+//
+ip_db_handle_t* ip_db_handle_new(ip_db_t *db);
+
+//
+// ip_db_handle_destroy destroies a handle together with its current
+// DB. No reader may be using it anymore.
+//
+void ip_db_handle_destroy(ip_db_handle_t **h);
+
+//
+// ip_db_reader_new gets a reader record for the calling thread. Keep
+// it for the life of the thread and give it back with
+// ip_db_reader_release.
+//
+ip_db_reader_t* ip_db_reader_new(ip_db_handle_t *h);
+
+//
+// ip_db_reader_release gives a reader record back to its handle.
+//
+void ip_db_reader_release(ip_db_reader_t **r);
+
+//
+// ip_db_pin returns the current DB and protects it from being
+// destroyed until ip_db_unpin. Pins do not nest.
+//
+ip_db_t* ip_db_pin(ip_db_reader_t *r);
+
+//
+// ip_db_unpin releases the DB pinned by ip_db_pin.
+//
+void ip_db_unpin(ip_db_reader_t *r);
+
+//
+// ip_db_handle_swap publishes |db| (taking it over) and destroies the
+// previous DB after all readers pinning it have unpinned. Concurrent
+// swaps are serialized. Swapping in the current DB again is refused
+// and leaves it in place. Return 0 on success, -1 otherwise.
+//
+int ip_db_handle_swap(ip_db_handle_t *h, ip_db_t *db);
+
+//
+// ip_db_handle_reload loads |path| with ip_db_init_ex(path, flags) and
+// swaps it in. On failure the current DB stays in place and -1 is
+// returned.
+//
+int ip_db_handle_reload(ip_db_handle_t *h, const char *path, uint32_t flags);
+
+//
+// ip_db_iter_init sets up |it| to walk the entries from |begin| up to
+// |end| (exclusive, clamped to ip_db_count). Disjoint slices of
+// [0, ip_db_count) can be walked by separate threads at once.
+//
+void ip_db_iter_init(ip_db_iter_t *it, ip_db_t *db, uint32_t begin, uint32_t end);
+
+//
+// ip_db_iter_next gets the next range of an iteration: the IPs it
+// covers in |range| and a reference to its location in |text|, either
+// of which may be NULL. The first range starts at 0 and the last ends
+// at 255.255.255.255. Return 0 on success, -1 once the iteration is
+// over.
+//
+int ip_db_iter_next(ip_db_iter_t *it, ip_range_t *range, ip_text_t *text);
+
+//
+// ip_db_export writes every range of |db| to |fd| in one of the
+// IP_EXPORT_* formats. With |threads| above 1, that many threads format
+// chunks of the DB in parallel while the calling thread writes them out
+// in order, so |fd| can be a pipe. Return 0 on success, -1 on invalid
+// input or write failure.
+//
+int ip_db_export(ip_db_t *db, int fd, uint32_t format, uint32_t threads);
+
+//
+// ip_db_diff compares the IPv4 ranges of |old_db| and |new_db| in a
+// single linear merge of their indexes and passes |cb| the ranges whose
+// location text changed, in ascending order, with touching changes of
+// the same texts merged. Ranges only split or joined without a text
+// change are not reported. The DBs may be of any format and loaded
+// with any flags. It stores the number of changes in |count| unless
+// NULL. Return 0 on success, -1 on invalid input or when |cb| stops
+// the walk.
+//
+int ip_db_diff(ip_db_t *old_db, ip_db_t *new_db, ip_diff_cb cb, void *arg,
+               size_t *count);
+
+//
+// ip_db_dump dumps the whole DB to stdout (meta info to stderr): the
+// last IP of each range and its location, separated by two tabs. You
+// may want to redirect the output to a file.
 //
 void ip_db_dump(ip_db_t *db);
 
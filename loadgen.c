@@ -0,0 +1,269 @@
+/*
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//
+// iploc-loadgen benchmarks a running iploc-daemon. Each thread opens a
+// connection and keeps |depth| requests of |batch| random IPs in
+// flight, timing every request from send to reply. It prints one JSON
+// object with the client side throughput and round trip percentiles,
+// followed by the daemon's own stats.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "proto.h"
+
+#define PANIC(reason) do { \
+    fprintf(stderr, "%s\n", reason); \
+    exit(-1); \
+} while(0)
+
+typedef struct {
+    const char *path;
+    uint16_t op;
+    uint32_t batch;
+    uint32_t depth;
+    uint32_t requests;  // per connection
+    uint32_t seed;
+    uint32_t *lat;      // round trip of each request, nsec
+} client_t;
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_uint32(const void *x, const void *y)
+{
+    uint32_t a = *(const uint32_t*)x, b = *(const uint32_t*)y;
+    return a < b ? -1 : a > b;
+}
+
+static int connect_to(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        PANIC("Cannot connect to the daemon");
+    }
+    return fd;
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            PANIC("write to the daemon failed");
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            PANIC("read from the daemon failed");
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+// ------------------------------------------------------------------
+// Read one reply into |buf| (grown as needed). Return its header.
+
+static iploc_msg_t read_reply(int fd, char **buf, size_t *cap)
+{
+    iploc_msg_t rep;
+    read_all(fd, &rep, sizeof(rep));
+    if (rep.len > *cap) {
+        *cap = rep.len;
+        *buf = realloc(*buf, *cap);
+    }
+    read_all(fd, *buf, rep.len);
+    return rep;
+}
+
+static void* client(void *arg)
+{
+    client_t *c = (client_t*)arg;
+    int fd = connect_to(c->path);
+    uint32_t x = c->seed, i;
+
+    // A ring of requests, each with its own random IPs.
+    size_t req_len = sizeof(iploc_msg_t) + sizeof(uint32_t) * c->batch;
+    char *reqs = malloc(req_len * c->depth);
+    uint64_t *sent_at = malloc(sizeof(uint64_t) * c->depth);
+    for (i = 0; i < c->depth; ++i) {
+        iploc_msg_t *m = (iploc_msg_t*)(reqs + i * req_len);
+        uint32_t *ips = (uint32_t*)(m + 1), k;
+        m->op = c->op;
+        m->status = 0;
+        m->generation = 0;
+        m->count = c->batch;
+        m->len = sizeof(uint32_t) * c->batch;
+        for (k = 0; k < c->batch; ++k) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            ips[k] = x;
+        }
+    }
+
+    char *buf = NULL;
+    size_t cap = 0;
+    uint32_t sent = 0, done = 0;
+    while (done < c->requests) {
+        while (sent < c->requests && sent - done < c->depth) {
+            iploc_msg_t *m = (iploc_msg_t*)(reqs + (sent % c->depth) * req_len);
+            m->id = sent;
+            sent_at[sent % c->depth] = now_ns();
+            write_all(fd, m, req_len);
+            ++sent;
+        }
+
+        iploc_msg_t rep = read_reply(fd, &buf, &cap);
+        if (rep.id != done || rep.status != IPLOC_STATUS_OK || rep.count != c->batch) {
+            PANIC("unexpected reply from the daemon");
+        }
+        c->lat[done] = now_ns() - sent_at[done % c->depth];
+        ++done;
+    }
+
+    close(fd);
+    free(buf);
+    free(sent_at);
+    free(reqs);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-s socket] [-c connections] [-b batch] [-d depth] [-n requests] [-t]\n"
+            "Each connection sends |requests| batches of |batch| random IPs, |depth| at\n"
+            "a time; -t asks for texts instead of location ids.\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = IPLOC_SOCKET;
+    uint32_t conns = 4, batch = 64, depth = 8, requests = 100000;
+    uint16_t op = IPLOC_OP_IDS;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            conns = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            batch = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            requests = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            op = IPLOC_OP_TEXTS;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (conns < 1 || batch < 1 || batch > IPLOC_MAX_BATCH || depth < 1 || requests < 1) {
+        usage(argv[0]);
+    }
+
+    client_t *clients = calloc(conns, sizeof(client_t));
+    pthread_t *tids = malloc(sizeof(pthread_t) * conns);
+    uint32_t *lat = malloc(sizeof(uint32_t) * conns * requests);
+    uint32_t k;
+
+    uint64_t t0 = now_ns();
+    for (k = 0; k < conns; ++k) {
+        client_t *c = &clients[k];
+        c->path = path;
+        c->op = op;
+        c->batch = batch;
+        c->depth = depth;
+        c->requests = requests;
+        c->seed = 2463534241u + k * 7919;
+        c->lat = lat + (size_t)k * requests;
+        pthread_create(&tids[k], NULL, client, c);
+    }
+    for (k = 0; k < conns; ++k) {
+        pthread_join(tids[k], NULL);
+    }
+    double secs = (now_ns() - t0) / 1e9;
+
+    size_t n = (size_t)conns * requests;
+    qsort(lat, n, sizeof(uint32_t), cmp_uint32);
+    printf("{\"op\":\"%s\",\"connections\":%u,\"batch\":%u,\"depth\":%u,\"requests\":%zu,"
+           "\"req_per_sec\":%.0f,\"ips_per_sec\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+           "\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+           op == IPLOC_OP_IDS ? "ids" : "texts", conns, batch, depth, n,
+           n / secs, n * batch / secs, lat[n/2] / 1e3, lat[n*99/100] / 1e3,
+           lat[n*999/1000] / 1e3, lat[n-1] / 1e3);
+
+    int fd = connect_to(path);
+    iploc_msg_t req = {IPLOC_OP_STATS, 0, 0, 0, 0, 0};
+    write_all(fd, &req, sizeof(req));
+    char *buf = NULL;
+    size_t cap = 0;
+    iploc_msg_t rep = read_reply(fd, &buf, &cap);
+    printf("%.*s\n", (int)rep.len, buf);
+    close(fd);
+
+    free(buf);
+    free(lat);
+    free(tids);
+    free(clients);
+    return 0;
+}
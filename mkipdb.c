@@ -0,0 +1,224 @@
+/*
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//
+// db-mkipdb writes a 17MON DB as an IPIP .ipdb file, for testing the
+// .ipdb loader without downloading one. Each location becomes a record
+// with a "CN" language holding the original fields and an "EN" one
+// holding them prefixed with "en-", and each range is inserted into
+// the binary trie as CIDR blocks under ::ffff:0:0/96.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iploc.h"
+
+#define LEAF 0x80000000u
+
+static const char *field_names[] = {
+    "country_name", "region_name", "city_name", "owner_domain", "isp_domain",
+    "latitude", "longitude", "timezone", "utc_offset", "china_admin_code",
+    "idd_code", "country_code", "continent_code",
+};
+
+typedef struct {
+    uint32_t (*child)[2];   // 0 if empty, LEAF | record, or a node
+    uint32_t num;
+    uint32_t cap;
+} trie_t;
+
+static uint32_t trie_node(trie_t *t)
+{
+    if (t->num == t->cap) {
+        t->cap = t->cap ? 2*t->cap : 4096;
+        t->child = realloc(t->child, sizeof(t->child[0]) * t->cap);
+        if (!t->child) {
+            fprintf(stderr, "Out of memory\n");
+            exit(-1);
+        }
+    }
+    t->child[t->num][0] = t->child[t->num][1] = 0;
+    return t->num++;
+}
+
+// Descend from |node| along |bit|, adding the node if missing.
+static uint32_t trie_step(trie_t *t, uint32_t node, int bit)
+{
+    if (t->child[node][bit] == 0) {
+        uint32_t next = trie_node(t);
+        t->child[node][bit] = next;
+    }
+    return t->child[node][bit];
+}
+
+static void trie_insert(trie_t *t, uint32_t v4, uint32_t ip, uint32_t prefix, uint32_t rec)
+{
+    uint32_t node = v4, d;
+    for (d = 0; d + 1 < prefix; ++d) {
+        node = trie_step(t, node, (ip >> (31 - d)) & 1);
+    }
+    t->child[node][(ip >> (31 - d)) & 1] = LEAF | rec;
+}
+
+static void put_be32(FILE *fp, uint32_t v)
+{
+    unsigned char b[4] = {v >> 24, v >> 16, v >> 8, v};
+    fwrite(b, 1, 4, fp);
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[1], "-x") != 0)) {
+        printf("Usage: %s [-x] db-file ipdb-file\n", argv[0]);
+        return 1;
+    }
+
+    const char *file = argv[argc - 2];
+    const char *out = argv[argc - 1];
+    uint32_t flags = (argc == 4 ? IP_DB_EXTENDED : 0) | IP_DB_COMPACT | IP_DB_FIELDS;
+    ip_db_t *ipdb = ip_db_init_ex(file, flags);
+
+    if (!ipdb) {
+        fprintf(stderr, "Failed to init ip db from %s\n", file);
+        return -1;
+    }
+
+    // Records, one per location, after an empty one at offset 0 since
+    // a leaf pointing there would read as an empty child.
+    uint32_t locs = ip_db_loc_count(ipdb), nfields = 1, i, j;
+    for (i = 0; i < locs; ++i) {
+        ip_fields_t f;
+        ip_db_loc_fields(ipdb, i, &f);
+        nfields = f.count > nfields ? f.count : nfields;
+    }
+    if (nfields > sizeof(field_names) / sizeof(field_names[0])) {
+        nfields = sizeof(field_names) / sizeof(field_names[0]);
+    }
+
+    size_t cap = 1 << 20, len = 2;
+    unsigned char *recs = calloc(cap, 1);
+    uint32_t *rec_off = malloc(sizeof(uint32_t) * (locs ? locs : 1));
+
+    for (i = 0; i < locs; ++i) {
+        ip_fields_t f;
+        char text[65536];
+        size_t n = 0;
+        int lang;
+
+        ip_db_loc_fields(ipdb, i, &f);
+        for (lang = 0; lang < 2; ++lang) {
+            for (j = 0; j < nfields; ++j) {
+                const ip_text_t *v = &f.field[j];
+                int has = j < f.count && v->len > 0;
+                n += snprintf(text + n, sizeof(text) - n, "%s%s%.*s",
+                              lang || j ? "\t" : "", lang && has ? "en-" : "",
+                              has ? (int)v->len : 0, has ? v->text : "");
+                if (n >= sizeof(text)) {
+                    n = sizeof(text) - 1;   // truncated, as below
+                }
+            }
+        }
+        if (n > 0xffff) {
+            n = 0xffff;
+        }
+
+        if (len + 2 + n > cap) {
+            cap = 2 * (len + 2 + n);
+            recs = realloc(recs, cap);
+        }
+        rec_off[i] = len;
+        recs[len] = n >> 8;
+        recs[len+1] = n;
+        memcpy(recs + len + 2, text, n);
+        len += 2 + n;
+    }
+
+    // The IPv4-mapped prefix: 80 zero bits, then 16 one bits.
+    trie_t t = {NULL, 0, 0};
+    uint32_t v4 = trie_node(&t);
+    for (i = 0; i < 96; ++i) {
+        v4 = trie_step(&t, v4, i >= 80);
+    }
+
+    ip_db_iter_t it;
+    ip_range_t r;
+    ip_cidr_t cidrs[64];
+    ip_db_iter_init(&it, ipdb, 0, ip_db_count(ipdb));
+    while (ip_db_iter_next(&it, &r, NULL) == 0) {
+        uint32_t id;
+        if (ip_locate_id(ipdb, r.last ? r.last : 1, &id) != 0) {
+            continue;
+        }
+
+        size_t k, n = ip_range_cidrs(r.first, r.last, cidrs, 64);
+        for (k = 0; k < n; ++k) {
+            if (cidrs[k].prefix == 0) {
+                trie_insert(&t, v4, 0, 1, id);
+                trie_insert(&t, v4, 0x80000000u, 1, id);
+            } else {
+                trie_insert(&t, v4, cidrs[k].ip, cidrs[k].prefix, id);
+            }
+        }
+    }
+
+    FILE *fp = fopen(out, "wb");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s\n", out);
+        return -1;
+    }
+
+    char meta[4096];
+    size_t m = snprintf(meta, sizeof(meta),
+            "{\"build\":%ld,\"ip_version\":1,\"languages\":{\"CN\":0,\"EN\":%u},"
+            "\"node_count\":%u,\"total_size\":%zu,\"fields\":[",
+            (long)time(NULL), nfields, t.num, (size_t)t.num * 8 + len);
+    for (j = 0; j < nfields; ++j) {
+        m += snprintf(meta + m, sizeof(meta) - m, "%s\"%s\"", j ? "," : "", field_names[j]);
+    }
+    m += snprintf(meta + m, sizeof(meta) - m, "]}");
+
+    put_be32(fp, m);
+    fwrite(meta, 1, m, fp);
+    for (i = 0; i < t.num; ++i) {
+        for (j = 0; j < 2; ++j) {
+            uint32_t c = t.child[i][j];
+            put_be32(fp, c == 0 ? t.num : c & LEAF ? t.num + rec_off[c & ~LEAF] : c);
+        }
+    }
+    fwrite(recs, 1, len, fp);
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write %s\n", out);
+        return -1;
+    }
+
+    printf("%s: %u nodes, %u records, %u fields in CN and EN\n", out, t.num, locs, nfields);
+    free(t.child);
+    free(recs);
+    free(rec_off);
+    ip_db_destroy(&ipdb);
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//
+// Wire protocol of iploc-daemon, spoken over a Unix stream socket.
+// Every message, in both directions, is an iploc_msg_t header followed
+// by |len| bytes of payload. Integers are in host byte order, since
+// both ends run on the same machine.
+//
+//   op               request payload       reply payload
+//   IPLOC_OP_IDS     uint32 IP x count     uint32 location id x count,
+//                                          IPLOC_NO_ID where not found
+//   IPLOC_OP_TEXTS   uint32 IP x count     (uint16 length, text) x count,
+//                                          empty where not found
+//   IPLOC_OP_LOCS    uint32 id x count     (uint16 length, text) x count
+//   IPLOC_OP_STATS   none                  one JSON object of daemon stats
+//
+// Location ids are dense and stable for a loaded DB, so clients can
+// cache the text of each id (IPLOC_OP_LOCS) and then ask for ids only.
+// Every reply carries the generation of the DB that answered it,
+// starting at 1 and bumped by each reload (SIGHUP), which renumbers the
+// ids: a client seeing a new generation must drop its cache. A request
+// with a non-zero |generation| is only answered by that DB; once it has
+// been replaced, the reply is IPLOC_STATUS_STALE, without payload and
+// with the current generation, so ids and texts never mix DBs.
+// A client may send any number of requests before reading the replies
+// (pipelining). Replies come back in request order and echo the op and
+// id of their request. A failed request gets an IPLOC_STATUS_ERROR
+// reply without payload; a malformed header closes the connection.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#define IPLOC_SOCKET        "/tmp/iploc.sock"
+
+#define IPLOC_OP_IDS        1
+#define IPLOC_OP_TEXTS      2
+#define IPLOC_OP_LOCS       3
+#define IPLOC_OP_STATS      4
+
+#define IPLOC_STATUS_OK     0
+#define IPLOC_STATUS_ERROR  1
+#define IPLOC_STATUS_STALE  2
+
+#define IPLOC_NO_ID         0xffffffffu
+#define IPLOC_MAX_BATCH     65536
+
+typedef struct {
+    uint16_t op;        // IPLOC_OP_*
+    uint16_t status;    // IPLOC_STATUS_* in replies, 0 in requests
+    uint32_t id;        // chosen by the client, echoed in the reply
+    uint32_t count;     // number of items
+    uint32_t len;       // payload bytes following the header
+    uint32_t generation; // DB generation of a reply, 0 or expected in requests
+} iploc_msg_t;
@@ -21,11 +21,18 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 #include <time.h>
 #include <string.h>
+#include <arpa/inet.h>
 
 #include "iploc.h"
 
@@ -50,7 +57,7 @@ void test_basic(int argc, const char *argv[])
 
 void get_time(struct timespec *tp)
 {
-    clockid_t cid = CLOCK_REALTIME;
+    clockid_t cid = CLOCK_MONOTONIC;
     if (clock_gettime(cid, tp) != 0) {
         PANIC("failed to get nano time");
     }
@@ -63,7 +70,20 @@ long time_diff(struct timespec *x, struct timespec *y)
 
 typedef void (*Action)(void *arg);
 
-void benchmark(const char *name, int N, Action action, void *arg)
+// Per-thread xorshift generator for benchmark actions: unlike rand()
+// it takes no lock, and it covers the whole 32 bit space (except 0).
+__thread uint32_t rng_state = 2463534241u;
+
+static inline uint32_t fast_rand()
+{
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rng_state = x;
+}
+
+void benchmark_n(const char *name, int N, int k, Action action, void *arg)
 {
     struct timespec start, stop;
     get_time(&start);
@@ -76,45 +96,1643 @@ void benchmark(const char *name, int N, Action action, void *arg)
     get_time(&stop);
     double nanosec = time_diff(&stop, &start);
     printf("%s\t%d ops\t%.2f msec\t%ld nsec/op\n",
-            name, N, nanosec/1e6, (long)nanosec/N);
+            name, N*k, nanosec/1e6, (long)nanosec/N/k);
+}
+
+void benchmark(const char *name, int N, Action action, void *arg)
+{
+    benchmark_n(name, N, 1, action, arg);
 }
 
 void random_ip_location(void *arg)
 {
     char result[256];
-    uint32_t ip = (uint32_t)rand() + 1;
+    uint32_t ip = fast_rand();
 
     if (ip_locate_v(ipdb, ip, result) != 0) {
         PANIC("failed to locate ip");
     }
 }
 
+uint32_t random_ip()
+{
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+void check_same(ip_db_t *other, const char *name, uint32_t ip)
+{
+    const char *x, *y;
+    uint32_t xlen, ylen;
+    int xr = ip_locate_ref(ipdb, ip, &x, &xlen);
+    int yr = ip_locate_ref(other, ip, &y, &ylen);
+
+    if (xr != yr || (xr == 0 && (xlen != ylen || memcmp(x, y, xlen) != 0))) {
+        printf("%s: mismatch at %u\n", name, ip);
+        PANIC("ip db mismatch");
+    }
+}
+
+void test_same(ip_db_t *other, const char *name)
+{
+    uint32_t i, n = ip_db_count(ipdb);
+
+    // Both ends of every range, plus the first IP of the next range.
+    for (i = 0; i < n; ++i) {
+        uint32_t ip;
+        ip_db_entry(ipdb, i, &ip, NULL);
+        check_same(other, name, ip - 1);
+        check_same(other, name, ip);
+        check_same(other, name, ip + 1);
+    }
+
+    for (i = 0; i < 200000; ++i) {
+        check_same(other, name, random_ip());
+    }
+    printf("%s: ok\n", name);
+}
+
+// Write the DB at |path| as a 17MON .datx file at |fixture|: 65536
+// hints, 9 byte entries with a 2 byte text length, texts deduplicated
+// through location ids. Unless 0, every |mutate|th entry is moved to
+// another location.
+void write_datx(const char *path, uint32_t flags, const char *fixture, uint32_t mutate)
+{
+    ip_db_t *db = ip_db_init_ex(path, flags | IP_DB_LOC_IDS);
+    if (!db) {
+        PANIC("failed to init ip db with location ids");
+    }
+
+    uint32_t i, n = ip_db_count(db), locs = ip_db_loc_count(db);
+    uint32_t *loc_offset = malloc(sizeof(uint32_t) * locs);
+    uint32_t *hint = calloc(65536, sizeof(uint32_t));
+    unsigned char *index = malloc(9 * n);
+    size_t text_len = 0;
+    ip_text_t t;
+
+    for (i = 0; i < locs; ++i) {
+        ip_db_loc_text(db, i, &t);
+        loc_offset[i] = 262144 + text_len;
+        text_len += t.len;
+    }
+
+    uint32_t h = 0;
+    for (i = 0; i < n; ++i) {
+        uint32_t ip, id;
+        ip_db_entry(db, i, &ip, &t);
+        if (ip_locate_id(db, ip, &id) != 0) {
+            PANIC("failed to locate ip id");
+        }
+        if (mutate && i % mutate == 0) {
+            id = (id + 1) % locs;
+            ip_db_loc_text(db, id, &t);
+        }
+        while (h < 65536 && (h << 16) <= ip) {
+            hint[h++] = i;
+        }
+        unsigned char *e = index + 9*i;
+        e[0] = ip >> 24; e[1] = ip >> 16; e[2] = ip >> 8; e[3] = ip;
+        e[4] = loc_offset[id]; e[5] = loc_offset[id] >> 8; e[6] = loc_offset[id] >> 16;
+        e[7] = t.len >> 8; e[8] = t.len;
+    }
+    while (h < 65536) {
+        hint[h++] = n - 1;
+    }
+
+    FILE *fp = fopen(fixture, "wb");
+    if (!fp) {
+        PANIC("failed to write datx fixture");
+    }
+    uint32_t text = 4 + 262144 + 9*n + 262144;
+    unsigned char be[4] = {text >> 24, text >> 16, text >> 8, text};
+    fwrite(be, 4, 1, fp);
+    for (i = 0; i < 65536; ++i) {
+        unsigned char le[4] = {hint[i], hint[i] >> 8, hint[i] >> 16, hint[i] >> 24};
+        fwrite(le, 4, 1, fp);
+    }
+    fwrite(index, 9, n, fp);
+    unsigned char *reserved = calloc(262144, 1);
+    fwrite(reserved, 1, 262144, fp);
+    for (i = 0; i < locs; ++i) {
+        ip_db_loc_text(db, i, &t);
+        fwrite(t.text, 1, t.len, fp);
+    }
+    fclose(fp);
+
+    free(reserved);
+    free(index);
+    free(hint);
+    free(loc_offset);
+    ip_db_destroy(&db);
+}
+
+typedef struct {
+    ip_diff_t *diffs;
+    size_t n;
+    size_t cap;
+} diff_list_t;
+
+int collect_diff(const ip_diff_t *d, void *arg)
+{
+    diff_list_t *l = (diff_list_t*)arg;
+    if (l->n == l->cap) {
+        l->cap = l->cap ? 2 * l->cap : 1024;
+        l->diffs = realloc(l->diffs, sizeof(ip_diff_t) * l->cap);
+    }
+    l->diffs[l->n++] = *d;
+    return 0;
+}
+
+int stop_diff(const ip_diff_t *d, void *arg)
+{
+    return 1;
+}
+
+static inline int same_text(const ip_text_t *x, const ip_text_t *y)
+{
+    return x->len == y->len && memcmp(x->text, y->text, x->len) == 0;
+}
+
+// The changed DB is a .datx fixture with every 997th entry moved to
+// another location.
+void test_diff(const char *path, uint32_t flags)
+{
+    ip_db_t *compact = ip_db_init_ex(path, flags | IP_DB_COMPACT | IP_DB_DIRECT);
+    diff_list_t l = {NULL, 0, 0};
+    size_t count;
+
+    if (!compact || ip_db_diff(ipdb, compact, collect_diff, &l, &count) != 0 || count || l.n) {
+        PANIC("differences between identical DBs");
+    }
+    ip_db_destroy(&compact);
+
+    write_datx(path, flags, "/tmp/iploc-test-diff.datx", 997);
+    ip_db_t *db = ip_db_init_x("/tmp/iploc-test-diff.datx");
+    unlink("/tmp/iploc-test-diff.datx");
+    if (!db) {
+        PANIC("failed to init changed ip db");
+    }
+
+    struct timespec t0, t1;
+    get_time(&t0);
+    int rc = ip_db_diff(ipdb, db, collect_diff, &l, &count);
+    get_time(&t1);
+    if (rc != 0 || count != l.n || count == 0) {
+        PANIC("failed to diff ip dbs");
+    }
+    if (ip_db_diff(ipdb, db, stop_diff, NULL, &count) != -1) {
+        PANIC("diff was not stopped");
+    }
+
+    // Changes are ascending, apart or of other texts, and tell the
+    // locations of both ends.
+    size_t k;
+    for (k = 0; k < l.n; ++k) {
+        ip_diff_t *d = &l.diffs[k];
+        ip_text_t x, y;
+        if (d->range.last < d->range.first || same_text(&d->before, &d->after) ||
+            (k && d->range.first <= l.diffs[k-1].range.last) ||
+            (k && d->range.first == l.diffs[k-1].range.last + 1 &&
+             same_text(&d->before, &l.diffs[k-1].before) &&
+             same_text(&d->after, &l.diffs[k-1].after))) {
+            PANIC("bad diff range");
+        }
+        uint32_t ends[2] = {d->range.first, d->range.last}, e;
+        for (e = 0; e < 2; ++e) {
+            if (ends[e] == 0) {
+                continue;
+            }
+            if (ip_locate_ref(ipdb, ends[e], &x.text, &x.len) != 0 ||
+                ip_locate_ref(db, ends[e], &y.text, &y.len) != 0 ||
+                !same_text(&x, &d->before) || !same_text(&y, &d->after)) {
+                PANIC("bad diff texts");
+            }
+        }
+    }
+
+    // Texts are constant up to each range end of either DB, so checking
+    // every end finds all changes.
+    ip_db_t *both[2] = {ipdb, db};
+    uint32_t i, b;
+    for (b = 0; b < 2; ++b) {
+        for (i = 0; i < ip_db_count(both[b]); ++i) {
+            uint32_t ip;
+            ip_text_t x, y;
+            ip_db_entry(both[b], i, &ip, NULL);
+            if (ip == 0) {
+                continue;
+            }
+            ip_locate_ref(ipdb, ip, &x.text, &x.len);
+            ip_locate_ref(db, ip, &y.text, &y.len);
+
+            size_t lo = 0, hi = l.n;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (l.diffs[mid].range.last < ip) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            int listed = lo < l.n && l.diffs[lo].range.first <= ip;
+            if (listed == same_text(&x, &y)) {
+                printf("diff: mismatch at %u\n", ip);
+                PANIC("diff misses or invents a change");
+            }
+        }
+    }
+
+    printf("diff: %zu changes of %u entries in %.2f msec\n", l.n, ip_db_count(db),
+            time_diff(&t1, &t0) / 1e6);
+    free(l.diffs);
+    ip_db_destroy(&db);
+    printf("diff: ok\n");
+}
+
+void test_mmap(const char *path, int extended)
+{
+    ip_db_t *mdb = extended ? ip_db_init_x_mmap(path) : ip_db_init_mmap(path);
+    if (!mdb) {
+        PANIC("failed to map ip db");
+    }
+
+    test_same(mdb, "mmap");
+    ip_db_destroy(&mdb);
+}
+
+void test_native(const char *path, uint32_t flags)
+{
+    const char *native = "/tmp/iploc-test.db";
+    if (ip_db_compile(ipdb, native) != 0) {
+        PANIC("failed to compile ip db");
+    }
+    if (ip_db_loc_count(ipdb) != 0) {
+        PANIC("compiling changed the source ip db");
+    }
+
+    struct timespec t0, t1, t2;
+    get_time(&t0);
+    ip_db_t *src = ip_db_init_ex(path, flags | IP_DB_MMAP | IP_DB_LOC_IDS);
+    get_time(&t1);
+    ip_db_t *ndb = ip_db_init_ex(native, IP_DB_MMAP);
+    get_time(&t2);
+    if (!src || !ndb) {
+        PANIC("failed to init native ip db");
+    }
+    printf("native startup: %.3f ms, 17mon with location ids: %.3f ms\n",
+            time_diff(&t2, &t1) / 1e6, time_diff(&t1, &t0) / 1e6);
+
+    test_same(ndb, "native");
+    if (ip_db_loc_count(ndb) != ip_db_loc_count(src)) {
+        PANIC("native location count mismatch");
+    }
+    ip_db_destroy(&ndb);
+    ip_db_destroy(&src);
+
+    ndb = ip_db_init_ex(native, IP_DB_VERIFY | IP_DB_SIMD | IP_DB_FIELDS);
+    if (!ndb) {
+        PANIC("failed to verify native ip db");
+    }
+    test_same(ndb, "native_simd");
+    ip_db_destroy(&ndb);
+
+    // A flipped byte in the data must fail verification.
+    FILE *fp = fopen(native, "r+b");
+    fseek(fp, -1, SEEK_END);
+    int c = fgetc(fp);
+    fseek(fp, -1, SEEK_END);
+    fputc(c ^ 0xff, fp);
+    fclose(fp);
+    ndb = ip_db_init_ex(native, IP_DB_VERIFY);
+    if (ndb) {
+        PANIC("corrupted native ip db was accepted");
+    }
+    unlink(native);
+}
+
+void random_ip_location_ref(void *arg)
+{
+    ip_db_t *db = arg ? (ip_db_t*)arg : ipdb;
+    const char *text;
+    uint32_t len;
+    uint32_t ip = fast_rand();
+
+    if (ip_locate_ref(db, ip, &text, &len) != 0) {
+        PANIC("failed to locate ip");
+    }
+}
+
+void test_ref()
+{
+    char buf[65536];
+    const char *text;
+    uint32_t len;
+    int i;
+
+    for (i = 0; i < 100000; ++i) {
+        uint32_t ip = (uint32_t)rand() * 2 + 1;
+        if (ip_locate_v(ipdb, ip, buf) != 0 ||
+            ip_locate_ref(ipdb, ip, &text, &len) != 0 ||
+            len != strlen(buf) || memcmp(buf, text, len) != 0) {
+            PANIC("zero-copy lookup mismatch");
+        }
+    }
+
+    if (ip_locate_ref(ipdb, 0, &text, &len) == 0) {
+        PANIC("zero-copy lookup accepted invalid ip");
+    }
+    printf("ref: ok\n");
+}
+
+typedef struct {
+    ip_db_t *db;
+    int n;
+    uint32_t ips[256];
+    ip_text_t out[256];
+} batch_t;
+
+void random_ip_location_batch(void *arg)
+{
+    batch_t *b = (batch_t*)arg;
+    int i;
+    for (i = 0; i < b->n; ++i) {
+        b->ips[i] = fast_rand();
+    }
+
+    if (ip_locate_batch(b->db, b->ips, b->n, b->out) != 0) {
+        PANIC("failed to locate ip batch");
+    }
+}
+
+int cmp_uint32(const void *x, const void *y)
+{
+    uint32_t a = *(const uint32_t*)x, b = *(const uint32_t*)y;
+    return a < b ? -1 : a > b;
+}
+
+void test_batch(ip_db_t *db, const char *name)
+{
+    batch_t b;
+    int round, i;
+
+    for (round = 0; round < 2000; ++round) {
+        b.n = 1 + rand() % 256;
+        for (i = 0; i < b.n; ++i) {
+            b.ips[i] = (uint32_t)rand() * 2 + (rand() & 1);
+        }
+        if (round & 1) {
+            qsort(b.ips, b.n, sizeof(uint32_t), cmp_uint32);
+        }
+
+        if (ip_locate_batch(db, b.ips, b.n, b.out) != 0) {
+            PANIC("failed to locate ip batch");
+        }
+
+        for (i = 0; i < b.n; ++i) {
+            const char *text;
+            uint32_t len;
+            if (ip_locate_ref(db, b.ips[i], &text, &len) != 0) {
+                if (b.out[i].text != NULL) {
+                    PANIC("batch lookup located invalid ip");
+                }
+            } else if (b.out[i].text != text || b.out[i].len != len) {
+                PANIC("batch lookup mismatch");
+            }
+        }
+    }
+    printf("%s: ok\n", name);
+}
+
+void test_loc_ids(const char *path, uint32_t flags)
+{
+    ip_db_t *db = ip_db_init_ex(path, flags | IP_DB_LOC_IDS);
+    if (!db) {
+        PANIC("failed to init ip db with location ids");
+    }
+
+    uint32_t i, n = ip_db_loc_count(db);
+    ip_text_t x, y;
+
+    // Every id is unique by content (checked pairwise on small DBs).
+    for (i = 0; i < n && n <= 4096; ++i) {
+        uint32_t j;
+        ip_db_loc_text(db, i, &y);
+        for (j = 0; j < i; ++j) {
+            ip_db_loc_text(db, j, &x);
+            if (x.len == y.len && memcmp(x.text, y.text, x.len) == 0) {
+                PANIC("duplicated location");
+            }
+        }
+    }
+
+    for (i = 0; i < 200000; ++i) {
+        uint32_t ip = random_ip(), id;
+        const char *text;
+        uint32_t len;
+
+        if (ip_locate_id(db, ip, &id) != 0) {
+            if (ip == 0) {
+                continue;
+            }
+            PANIC("failed to locate ip id");
+        }
+
+        if (ip_locate_ref(db, ip, &text, &len) != 0 ||
+            ip_db_loc_text(db, id, &x) != 0 ||
+            x.len != len || memcmp(x.text, text, len) != 0) {
+            PANIC("location id mismatch");
+        }
+    }
+
+    printf("loc_ids: %u entries, %u locations\n", ip_db_count(db), n);
+    ip_db_destroy(&db);
+}
+
+void test_fields(ip_db_t *db)
+{
+    int i;
+    for (i = 0; i < 200000; ++i) {
+        uint32_t ip = random_ip() | 1, f;
+        const char *text;
+        uint32_t len;
+        ip_fields_t fields;
+        ip_text_t field;
+        char joined[65536];
+        uint32_t n = 0;
+
+        if (ip_locate_ref(db, ip, &text, &len) != 0 ||
+            ip_locate_fields(db, ip, &fields) != 0) {
+            PANIC("failed to locate ip fields");
+        }
+
+        for (f = 0; f < fields.count; ++f) {
+            if (ip_locate_field(db, ip, f, &field) != 0 ||
+                field.text != fields.field[f].text ||
+                field.len != fields.field[f].len) {
+                PANIC("single field mismatch");
+            }
+            if (f > 0) {
+                joined[n++] = '\t';
+            }
+            memcpy(joined + n, field.text, field.len);
+            n += field.len;
+        }
+
+        if (n != len || memcmp(joined, text, len) != 0) {
+            PANIC("fields do not add up to the location");
+        }
+        if (ip_locate_field(db, ip, fields.count, &field) == 0 ||
+            ip_locate_field(db, ip, IP_FIELDS_MAX, &field) == 0 ||
+            ip_locate_field(db, ip, IP_FIELD_TEXT - 1, &field) == 0) {
+            PANIC("located a field out of range");
+        }
+        if (ip_locate_field(db, ip, IP_FIELD_TEXT, &field) != 0 ||
+            field.len != len || memcmp(field.text, text, len) != 0) {
+            PANIC("whole text field mismatch");
+        }
+    }
+    printf("fields: ok\n");
+}
+
+void check_range_text(ip_db_t *db, uint32_t ip, uint32_t field, ip_text_t *want)
+{
+    ip_text_t got;
+    if (ip == 0) {
+        return;     // the first range starts at 0, which cannot be located
+    }
+    if (field == IP_FIELD_TEXT) {
+        if (ip_locate_ref(db, ip, &got.text, &got.len) != 0) {
+            PANIC("failed to locate range ip");
+        }
+    } else if (ip_locate_field(db, ip, field, &got) != 0) {
+        PANIC("failed to locate range ip field");
+    }
+
+    if (got.len != want->len || memcmp(got.text, want->text, got.len) != 0) {
+        printf("range mismatch at %u\n", ip);
+        PANIC("range does not match its location");
+    }
+}
+
+void test_inverted(const char *path, uint32_t flags)
+{
+    ip_db_t *db = ip_db_init_ex(path, flags | IP_DB_INVERTED);
+    if (!db) {
+        PANIC("failed to init inverted ip db");
+    }
+
+    ip_cidr_t cidrs[8];
+    if (ip_range_cidrs(0, 0xffffffff, cidrs, 8) != 1 || cidrs[0].prefix != 0 ||
+        ip_range_cidrs(0x0a000001, 0x0a000006, cidrs, 8) != 4 ||
+        cidrs[1].ip != 0x0a000002 || cidrs[1].prefix != 31 ||
+        cidrs[3].ip != 0x0a000006 || cidrs[3].prefix != 32) {
+        PANIC("bad cidr split");
+    }
+
+    // The ranges of all locations tile the whole IPv4 space.
+    struct timespec start, stop;
+    uint32_t i, loc_num = ip_db_loc_count(db);
+    size_t max = ip_db_count(db), n, k, total = 0;
+    ip_range_t *ranges = malloc(sizeof(ip_range_t) * max);
+    uint64_t covered = 0;
+
+    get_time(&start);
+    for (i = 0; i < loc_num; ++i) {
+        ip_text_t text;
+        ip_db_loc_text(db, i, &text);
+        if (ip_db_ranges(db, IP_FIELD_TEXT, text.text, text.len, ranges, max, &n) != 0 || n == 0) {
+            PANIC("failed to list location ranges");
+        }
+        for (k = 0; k < n; ++k) {
+            covered += (uint64_t)ranges[k].last - ranges[k].first + 1;
+        }
+        total += n;
+    }
+    get_time(&stop);
+
+    if (covered != 1ull << 32) {
+        PANIC("location ranges do not cover the IPv4 space");
+    }
+    printf("inverted: %u locations, %zu ranges listed in %.3f msec\n",
+            loc_num, total, time_diff(&stop, &start) / 1e6);
+
+    // Every range, or CIDR block, of a random IP's location and
+    // province matches it at both ends and does not touch the next one.
+    for (i = 0; i < 200; ++i) {
+        uint32_t ip = random_ip(), field = i % 2 ? IP_FIELD_PROVINCE : IP_FIELD_TEXT;
+        ip_text_t want;
+        if (field == IP_FIELD_TEXT) {
+            ip_locate_ref(db, ip, &want.text, &want.len);
+        } else if (ip_locate_field(db, ip, field, &want) != 0) {
+            continue;
+        }
+
+        if (ip_db_ranges(db, field, want.text, want.len, ranges, max, &n) != 0 || n > max) {
+            PANIC("failed to list ranges");
+        }
+
+        int found = 0;
+        uint64_t size = 0;
+        for (k = 0; k < n; ++k) {
+            check_range_text(db, ranges[k].first, field, &want);
+            check_range_text(db, ranges[k].last, field, &want);
+            if (k > 0 && ranges[k].first <= (uint64_t)ranges[k-1].last + 1) {
+                PANIC("ranges overlap or touch");
+            }
+            found |= ip >= ranges[k].first && ip <= ranges[k].last;
+            size += (uint64_t)ranges[k].last - ranges[k].first + 1;
+        }
+        if (!found) {
+            PANIC("ranges miss the located ip");
+        }
+
+        ip_cidr_t *blocks = malloc(sizeof(ip_cidr_t) * 64 * n);
+        if (ip_db_cidrs(db, field, want.text, want.len, blocks, 64 * n, &k) != 0) {
+            PANIC("failed to list cidrs");
+        }
+        while (k-- > 0) {
+            uint64_t block = 1ull << (32 - blocks[k].prefix);
+            if (blocks[k].ip % block != 0) {
+                PANIC("unaligned cidr block");
+            }
+            check_range_text(db, blocks[k].ip, field, &want);
+            size -= block;
+        }
+        if (size != 0) {
+            PANIC("cidrs do not cover the ranges");
+        }
+        free(blocks);
+    }
+
+    if (ip_db_ranges(db, IP_FIELD_TEXT, "no such place", 13, ranges, max, &n) != 0 || n != 0) {
+        PANIC("found ranges of an unknown location");
+    }
+    ip_cidr_t block;
+    if (ip_db_ranges(db, IP_FIELD_TEXT, "no such place", 13, ranges, max, NULL) == 0 ||
+        ip_db_cidrs(db, IP_FIELD_TEXT, "no such place", 13, &block, 1, NULL) == 0) {
+        PANIC("listed ranges without a count");
+    }
+
+    free(ranges);
+    ip_db_destroy(&db);
+    printf("ranges: ok\n");
+}
+
+void test_export()
+{
+    uint32_t i;
+    for (i = 0; i < 100000; ++i) {
+        uint32_t ip = i < 256 ? i * 0x01010101u : random_ip();
+        char want[INET_ADDRSTRLEN], got[16];
+        struct in_addr addr;
+        addr.s_addr = htonl(ip);
+        inet_ntop(AF_INET, &addr, want, sizeof(want));
+        if (ip_format_v4(ip, got) != (int)strlen(want) || strcmp(got, want) != 0) {
+            PANIC("bad ip formatting");
+        }
+    }
+
+    // Two halves walked separately tile the whole IPv4 space.
+    uint32_t n = ip_db_count(ipdb), next = 0;
+    ip_db_iter_t head, tail;
+    ip_range_t r;
+    ip_text_t t;
+    ip_db_iter_init(&head, ipdb, 0, n / 2);
+    ip_db_iter_init(&tail, ipdb, n / 2, n + 100);
+    for (i = 0; ip_db_iter_next(&head, &r, &t) == 0 || ip_db_iter_next(&tail, &r, &t) == 0; ++i) {
+        const char *text;
+        uint32_t len;
+        if (r.first != next || r.last < r.first ||
+            ip_locate_ref(ipdb, r.last, &text, &len) != 0 ||
+            text != t.text || len != t.len) {
+            PANIC("bad iterated range");
+        }
+        next = r.last + 1;
+    }
+    if (i != n || next != 0) {
+        PANIC("iteration does not cover the DB");
+    }
+
+    // Parallel exports match sequential ones byte for byte.
+    const char *names[] = {"tsv", "csv", "cidr", "jsonl"};
+    uint32_t format;
+    for (format = IP_EXPORT_TSV; format <= IP_EXPORT_JSONL; ++format) {
+        FILE *seq = tmpfile(), *par = tmpfile();
+        struct timespec t0, t1, t2;
+
+        get_time(&t0);
+        int rc = ip_db_export(ipdb, fileno(seq), format, 1);
+        get_time(&t1);
+        rc |= ip_db_export(ipdb, fileno(par), format, 4);
+        get_time(&t2);
+        if (rc != 0) {
+            PANIC("failed to export ip db");
+        }
+
+        long size = lseek(fileno(seq), 0, SEEK_END);
+        if (size <= 0 || size != lseek(fileno(par), 0, SEEK_END)) {
+            PANIC("parallel export size mismatch");
+        }
+        char *a = malloc(size), *b = malloc(size);
+        if (pread(fileno(seq), a, size, 0) != size || pread(fileno(par), b, size, 0) != size ||
+            memcmp(a, b, size) != 0) {
+            PANIC("parallel export mismatch");
+        }
+        printf("export %s: %ld bytes, %.2f msec, 4 threads %.2f msec\n", names[format],
+                size, time_diff(&t1, &t0) / 1e6, time_diff(&t2, &t1) / 1e6);
+
+        free(a);
+        free(b);
+        fclose(seq);
+        fclose(par);
+    }
+    printf("export: ok\n");
+}
+
+void test_stats(const char *path, uint32_t flags)
+{
+    uint32_t engines[] = {0, IP_DB_DECODE, IP_DB_EYTZINGER, IP_DB_SIMD, IP_DB_DIRECT};
+    int e;
+
+    for (e = 0; e < 5; ++e) {
+        ip_db_t *db = ip_db_init_ex(path, flags | engines[e] | IP_DB_INVERTED);
+        ip_db_stats_t st;
+        if (!db || ip_db_stats(db, &st, NULL, NULL) != 0) {
+            PANIC("failed to get ip db stats");
+        }
+
+        uint32_t k, buckets = 0;
+        for (k = 0; k < 33; ++k) {
+            buckets += st.bucket_sizes[k];
+        }
+        if (st.load_ns == 0 || st.mem_total != ip_db_footprint(db) ||
+            st.mem_inverted == 0 || buckets != st.buckets || st.bucket_max == 0) {
+            PANIC("bad ip db stats");
+        }
+
+        uint32_t i;
+        const char *text;
+        uint32_t len, id;
+        for (i = 0; i < 100000; ++i) {
+            ip_locate_ref(db, random_ip(), &text, &len);
+        }
+        ip_locate_ref(db, 0, &text, &len);
+        ip_locate_id(db, 0, &id);
+
+        uint64_t *lookups = malloc(sizeof(uint64_t) * st.buckets);
+        uint64_t *depth = malloc(sizeof(uint64_t) * st.buckets);
+        ip_db_stats(db, &st, lookups, depth);
+
+        uint64_t total = 0, probes = 0, histogram = 0;
+        for (k = 0; k < st.buckets; ++k) {
+            total += lookups[k];
+            probes += depth[k];
+        }
+        for (k = 0; k < IP_STATS_DEPTHS; ++k) {
+            histogram += st.depth[k];
+        }
+
+        if (st.instrumented ? (st.lookups != 100000 || st.failures != 2 ||
+                               total != 100000 || histogram != 100000 || probes == 0)
+                            : (st.lookups || st.failures || total || histogram)) {
+            PANIC("bad lookup counters");
+        }
+        if (e == 0) {
+            printf("stats: load %.2f msec, %zu bytes, %u buckets of up to %u entries, "
+                   "%s\n", st.load_ns / 1e6, st.mem_total, st.buckets, st.bucket_max,
+                   st.instrumented ? "instrumented" : "not instrumented");
+        }
+        if (st.instrumented) {
+            printf("stats %d: %.2f probes per lookup\n", e, (double)probes / total);
+        }
+
+        free(lookups);
+        free(depth);
+        ip_db_destroy(&db);
+    }
+    printf("stats: ok\n");
+}
+
+void test_placement(const char *path, uint32_t flags)
+{
+    const char *native = "/tmp/iploc-test-huge.db";
+    uint32_t place = IP_DB_HUGEPAGES | IP_DB_LOCK | IP_DB_NUMA;
+    ip_db_stats_t st;
+
+    ip_db_t *db = ip_db_init_ex(path, flags | place | IP_DB_SIMD | IP_DB_FIELDS);
+    if (!db || ip_db_stats(db, &st, NULL, NULL) != 0) {
+        PANIC("failed to init ip db on huge pages");
+    }
+    if (st.mem_total != ip_db_footprint(db) || st.mem_raw == 0) {
+        PANIC("bad huge page ip db stats");
+    }
+    test_same(db, "huge");
+    test_batch(db, "huge_batch");
+    test_fields(db);
+    printf("huge: %s huge pages, %zu bytes locked, %d numa replicas\n",
+            st.huge_pages == 2 ? "explicit" : st.huge_pages ? "transparent" : "no",
+            st.mem_locked, st.numa_replicas);
+    ip_db_destroy(&db);
+
+    // A mapped native DB is copied, with its in-place tables.
+    if (ip_db_compile(ipdb, native) != 0) {
+        PANIC("failed to compile ip db");
+    }
+    db = ip_db_init_ex(native, IP_DB_MMAP | place);
+    if (!db) {
+        PANIC("failed to init native ip db on huge pages");
+    }
+    test_same(db, "native_huge");
+    ip_db_destroy(&db);
+    unlink(native);
+}
+
+typedef struct {
+    ip_v6_t first;
+    ip_v6_t last;
+    ip_text_t text;
+} v6_range_t;
+
+typedef struct {
+    ip_db_t *db;
+    ip_v6_t *ips;
+} v6_bench_t;
+
+static inline int v6_cmp(ip_v6_t a, ip_v6_t b)
+{
+    if (a.hi != b.hi) {
+        return a.hi < b.hi ? -1 : 1;
+    }
+    return a.lo < b.lo ? -1 : a.lo > b.lo;
+}
+
+static int cmp_v6_range(const void *x, const void *y)
+{
+    return v6_cmp(((const v6_range_t*)x)->first, ((const v6_range_t*)y)->first);
+}
+
+static uint64_t random_u64()
+{
+    return ((uint64_t)random_ip() << 32) | random_ip();
+}
+
+static void write_v6(FILE *fp, ip_v6_t ip)
+{
+    unsigned char addr[16];
+    char buf[INET6_ADDRSTRLEN];
+    int i;
+    for (i = 0; i < 8; ++i) {
+        addr[i] = ip.hi >> (56 - 8*i);
+        addr[8+i] = ip.lo >> (56 - 8*i);
+    }
+    fputs(inet_ntop(AF_INET6, addr, buf, sizeof(buf)), fp);
+}
+
+// The range of |ranges| (sorted) holding |ip|, or NULL.
+static const v6_range_t* find_v6(const v6_range_t *ranges, size_t n, ip_v6_t ip)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (v6_cmp(ranges[mid].first, ip) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 && v6_cmp(ip, ranges[lo-1].last) <= 0 ? &ranges[lo-1] : NULL;
+}
+
+void check_v6(ip_db_t *db, const v6_range_t *ranges, size_t n, ip_v6_t ip)
+{
+    const v6_range_t *want = find_v6(ranges, n, ip);
+    ip_text_t got;
+    int rc = ip_locate_v6(db, ip, &got);
+
+    if (want ? rc != 0 || got.len != want->text.len ||
+               memcmp(got.text, want->text.text, got.len) != 0
+             : rc == 0) {
+        printf("v6: mismatch at %016llx%016llx\n",
+               (unsigned long long)ip.hi, (unsigned long long)ip.lo);
+        PANIC("ipv6 mismatch");
+    }
+}
+
+// Write /48 ranges clustered under a few /16s, like real allocations,
+// as a mix of CIDRs, whole and partial ranges in random order.
+ip_db_t* test_v6(const char *path, uint32_t flags, ip_v6_t **probes)
+{
+    const char *fixture = "/tmp/iploc-test-v6.txt";
+    static const uint16_t blocks[] = {
+        0x2001, 0x2400, 0x2401, 0x2402, 0x2403, 0x2404, 0x2405, 0x2406,
+        0x2600, 0x2601, 0x2602, 0x2603, 0x2604, 0x2605, 0x2606, 0x2607,
+        0x2800, 0x2801, 0x2803, 0x2804, 0x2a00, 0x2a01, 0x2a02, 0x2a03,
+        0x2a04, 0x2a05, 0x2a06, 0x2a07, 0x2a09, 0x2a0a, 0x2a0b, 0x2c0f,
+    };
+    size_t n = 100000, i, j;
+    v6_range_t *ranges = malloc(sizeof(v6_range_t) * n);
+    uint32_t count = ip_db_count(ipdb);
+
+    for (i = 0; i < n; ++i) {
+        uint64_t hi = ((uint64_t)blocks[random_ip() % 32] << 48) |
+                      (random_u64() & 0xffffffff0000ull);
+        ranges[i].first.hi = hi;
+        ranges[i].first.lo = 0;
+        ranges[i].last.hi = hi | (i % 3 == 2 ? 0x7fff : 0xffff);
+        ranges[i].last.lo = ~0ull;
+        ip_db_entry(ipdb, random_ip() % count, NULL, &ranges[i].text);
+    }
+
+    FILE *fp = fopen(fixture, "w");
+    fprintf(fp, "# generated by test-proc\n\n");
+    for (i = 0; i < n; ++i) {
+        write_v6(fp, ranges[i].first);
+        if (i % 3 == 0) {
+            fprintf(fp, "/48");
+        } else {
+            fputc('\t', fp);
+            write_v6(fp, ranges[i].last);
+        }
+        fputc('\t', fp);
+        fwrite(ranges[i].text.text, 1, ranges[i].text.len, fp);
+        fputc('\n', fp);
+    }
+    fclose(fp);
+
+    // Random /48s may repeat, which the loader must reject.
+    qsort(ranges, n, sizeof(v6_range_t), cmp_v6_range);
+    for (i = 1, j = 1; i < n; ++i) {
+        if (ranges[i].first.hi >> 16 != ranges[j-1].first.hi >> 16) {
+            ranges[j++] = ranges[i];
+        }
+    }
+
+    ip_db_t *db = ip_db_init_ex(path, flags | IP_DB_SIMD);
+    if (!db) {
+        PANIC("failed to init ip db for ipv6");
+    }
+    if (j < n) {
+        if (ip_db_load_v6(db, fixture) == 0) {
+            PANIC("overlapping ipv6 ranges were accepted");
+        }
+        fp = fopen(fixture, "w");
+        for (i = 0; i < j; ++i) {
+            write_v6(fp, ranges[i].first);
+            fputc('\t', fp);
+            write_v6(fp, ranges[i].last);
+            fputc('\t', fp);
+            fwrite(ranges[i].text.text, 1, ranges[i].text.len, fp);
+            fputc('\n', fp);
+        }
+        fclose(fp);
+    }
+    n = j;
+
+    struct timespec t0, t1;
+    get_time(&t0);
+    if (ip_db_load_v6(db, fixture) != 0) {
+        PANIC("failed to load ipv6 ranges");
+    }
+    get_time(&t1);
+    printf("v6: %zu ranges, %u with gaps, loaded in %.2f msec\n",
+           n, ip_db_count_v6(db), time_diff(&t1, &t0) / 1e6);
+
+    // Both ends of every range and their neighbours, a random IP in
+    // each, then random IPs anywhere.
+    for (i = 0; i < n; ++i) {
+        ip_v6_t ip = ranges[i].first;
+        check_v6(db, ranges, n, ip);
+        ip.lo -= 1;
+        ip.hi -= 1;
+        check_v6(db, ranges, n, ip);
+        ip = ranges[i].last;
+        check_v6(db, ranges, n, ip);
+        ip.lo += 1;
+        ip.hi += 1;
+        check_v6(db, ranges, n, ip);
+        ip.hi = ranges[i].first.hi | (random_ip() & 0x7fff);
+        ip.lo = random_u64();
+        check_v6(db, ranges, n, ip);
+    }
+    for (i = 0; i < 200000; ++i) {
+        ip_v6_t ip = {random_u64(), random_u64()};
+        check_v6(db, ranges, n, ip);
+    }
+
+    // IPv4-mapped addresses in no range fall back to the IPv4 index.
+    ip_v6_t mapped;
+    ip_text_t want, got;
+    for (i = 0; i < 100000; ++i) {
+        uint32_t ip = random_ip();
+        mapped.hi = 0;
+        mapped.lo = 0xffff00000000ull | ip;
+        int w = ip_locate_ref(db, ip, &want.text, &want.len);
+        int g = ip_locate_v6(db, mapped, &got);
+        if (w != g || (w == 0 && (want.len != got.len ||
+                                  memcmp(want.text, got.text, got.len) != 0))) {
+            PANIC("ipv4-mapped mismatch");
+        }
+    }
+    if (ip_parse_v6("::ffff:8.8.8.8", 14, &mapped) != 0 || mapped.hi != 0 ||
+        mapped.lo != 0xffff08080808ull || ip_parse_v6("2001:db8::g", 11, &mapped) == 0) {
+        PANIC("bad ipv6 parse");
+    }
+
+    // IPv4 forms, overlaps and bad lines, on the IPv4 only DB.
+    const char *lines[] = {
+        "::ffff:1.2.3.0/120\tMAPPED\n8.8.8.0\t8.8.8.255\tDOTTED\n"
+        "2001:db8::/32\tDOC\n",
+        "2001:db8::/32\tDOC\n2001:db8:1::\t2001:db8:1::5\tINNER\n",
+        "2001:db8::/129\tBAD\n",
+    };
+    for (i = 0; i < 3; ++i) {
+        fp = fopen(fixture, "w");
+        fputs(lines[i], fp);
+        fclose(fp);
+        if ((ip_db_load_v6(ipdb, fixture) == 0) != (i == 0)) {
+            PANIC("bad ipv6 file check");
+        }
+    }
+    uint32_t v4[] = {0x01020304, 0x08080808, 0x09090909};
+    const char *v4_want[] = {"MAPPED", "DOTTED", NULL};
+    for (i = 0; i < 3; ++i) {
+        mapped.hi = 0;
+        mapped.lo = 0xffff00000000ull | v4[i];
+        ip_locate_ref(ipdb, v4[i], &want.text, &want.len);
+        if (v4_want[i]) {
+            want.text = v4_want[i];
+            want.len = strlen(v4_want[i]);
+        }
+        if (ip_locate_v6(ipdb, mapped, &got) != 0 || got.len != want.len ||
+            memcmp(got.text, want.text, got.len) != 0) {
+            PANIC("ipv4 form mismatch");
+        }
+    }
+    if (ip_db_count_v6(ipdb) != 7) {
+        PANIC("bad ipv6 range count");
+    }
+    unlink(fixture);
+
+    *probes = malloc(sizeof(ip_v6_t) * 65536);
+    for (i = 0; i < 65536; ++i) {
+        const v6_range_t *r = &ranges[random_ip() % n];
+        (*probes)[i].hi = r->first.hi | (random_ip() & 0x7fff);
+        (*probes)[i].lo = random_u64();
+    }
+    free(ranges);
+    printf("v6: ok\n");
+    return db;
+}
+
+void random_ip_v6(void *arg)
+{
+    v6_bench_t *b = (v6_bench_t*)arg;
+    ip_text_t text;
+
+    if (ip_locate_v6(b->db, b->ips[fast_rand() & 0xffff], &text) != 0) {
+        PANIC("failed to locate ipv6");
+    }
+}
+
+// Copy the .ipdb |fixture| to |out| with |from| replaced by |to| in
+// its metadata.
+void write_ipdb_meta(const char *fixture, const char *out, const char *from,
+                     const char *to)
+{
+    FILE *in = fopen(fixture, "rb");
+    if (!in || fseek(in, 0, SEEK_END) != 0) {
+        PANIC("failed to read ipdb fixture");
+    }
+    long size = ftell(in);
+    char *buf = malloc(size + 1);
+    rewind(in);
+    if (fread(buf, 1, size, in) != (size_t)size) {
+        PANIC("failed to read ipdb fixture");
+    }
+    fclose(in);
+    buf[size] = 0;
+
+    uint32_t meta_len = ((uint32_t)(unsigned char)buf[0] << 24) |
+                        ((unsigned char)buf[1] << 16) |
+                        ((unsigned char)buf[2] << 8) | (unsigned char)buf[3];
+    char meta[4096];
+    char *at = strstr(buf + 4, from);
+    if (meta_len >= sizeof(meta) || !at || at >= buf + 4 + meta_len) {
+        PANIC("unexpected ipdb fixture metadata");
+    }
+    int n = snprintf(meta, sizeof(meta), "%.*s%s%.*s", (int)(at - buf - 4), buf + 4, to,
+                     (int)(buf + 4 + meta_len - at - strlen(from)), at + strlen(from));
+
+    FILE *fp = fopen(out, "wb");
+    unsigned char be[4] = {n >> 24, n >> 16, n >> 8, n};
+    if (!fp || fwrite(be, 4, 1, fp) != 1 || fwrite(meta, 1, n, fp) != (size_t)n ||
+        fwrite(buf + 4 + meta_len, 1, size - 4 - meta_len, fp) != (size_t)(size - 4 - meta_len)) {
+        PANIC("failed to write ipdb fixture");
+    }
+    fclose(fp);
+    free(buf);
+}
+
+// The .ipdb fixture is written by db-mkipdb (make test) from the same
+// 17MON DB, with "en-" prefixed fields as a second language.
+ip_db_t* test_ipdb(const char *path, uint32_t flags, const char *fixture)
+{
+    if (access(fixture, R_OK) != 0) {
+        printf("ipdb: skipped, no %s (see make test)\n", fixture);
+        return NULL;
+    }
+
+    ip_db_t *db = ip_db_init_ex(fixture, IP_DB_SIMD | IP_DB_HUGEPAGES);
+    if (!db) {
+        PANIC("failed to init ipdb");
+    }
+    test_same(db, "ipdb");
+    ip_db_destroy(&db);
+
+    if (ip_db_init_ipdb(fixture, 0, "CN", "no_such_field") ||
+        ip_db_init_ipdb(fixture, 0, "FR", NULL)) {
+        PANIC("unknown ipdb selection was accepted");
+    }
+
+    // Language offsets past the column tables are rejected.
+    const char *offsets[] = {"\"EN\":100000", "\"EN\":4294967300", "\"EN\":510"};
+    int k;
+    for (k = 0; k < 3; ++k) {
+        write_ipdb_meta(fixture, "/tmp/iploc-test-bad.ipdb", "\"EN\":4", offsets[k]);
+        db = ip_db_init_ipdb("/tmp/iploc-test-bad.ipdb", 0, "EN", NULL);
+        if (db) {
+            PANIC("out of range ipdb language offset was accepted");
+        }
+    }
+    unlink("/tmp/iploc-test-bad.ipdb");
+
+    // Scattered columns are joined into a pool, packed here as well.
+    ip_db_t *ref = ip_db_init_ex(path, flags | IP_DB_FIELDS);
+    uint32_t options[] = {0, IP_DB_HUGEPAGES | IP_DB_DIRECT};
+    int f, i;
+    for (f = 0; f < 2; ++f) {
+        db = ip_db_init_ipdb(fixture, options[f], "EN,CN", "city_name,country_name");
+        if (!db) {
+            PANIC("failed to init ipdb with selected fields");
+        }
+
+        for (i = 0; i < 200000; ++i) {
+            uint32_t ip = random_ip() | 1;
+            ip_fields_t want;
+            ip_text_t got;
+            char text[1024];
+            int n = 0, lang;
+
+            if (ip_locate_fields(ref, ip, &want) != 0) {
+                PANIC("failed to locate fields");
+            }
+            for (lang = 0; lang < 2; ++lang) {
+                int k;
+                for (k = 0; k < 2; ++k) {
+                    const ip_text_t *v = &want.field[k ? 0 : 2];
+                    int has = (k ? 0 : 2) < (int)want.count && v->len > 0;
+                    n += snprintf(text + n, sizeof(text) - n, "%s%s%.*s",
+                                  lang || k ? "\t" : "", !lang && has ? "en-" : "",
+                                  has ? (int)v->len : 0, has ? v->text : "");
+                }
+            }
+
+            if (ip_locate_ref(db, ip, &got.text, &got.len) != 0 ||
+                got.len != (uint32_t)n || memcmp(got.text, text, n) != 0) {
+                printf("ipdb: mismatch at %u\n", ip);
+                PANIC("ipdb field selection mismatch");
+            }
+        }
+        ip_db_destroy(&db);
+    }
+    ip_db_destroy(&ref);
+    printf("ipdb_fields: ok\n");
+
+    db = ip_db_init_ipdb(fixture, IP_DB_SIMD, NULL, NULL);
+    if (!db) {
+        PANIC("failed to init ipdb");
+    }
+    return db;
+}
+
+void random_ip_fields(void *arg)
+{
+    ip_text_t city;
+    uint32_t ip = fast_rand();
+
+    ip_locate_field((ip_db_t*)arg, ip, IP_FIELD_CITY, &city);
+}
+
+typedef struct {
+    ip_db_handle_t *handle;
+    atomic_int *stop;
+    long lookups;
+} reload_reader_t;
+
+void* reload_reader(void *arg)
+{
+    reload_reader_t *rr = (reload_reader_t*)arg;
+    ip_db_reader_t *r = ip_db_reader_new(rr->handle);
+    uint32_t seed = (uint32_t)(uintptr_t)arg;
+    const char *expected;
+    uint32_t expected_len;
+
+    ip_locate_ref(ipdb, 0x08080808, &expected, &expected_len);
+
+    while (!atomic_load(rr->stop)) {
+        ip_db_t *db = ip_db_pin(r);
+        const char *text;
+        uint32_t len;
+        int i;
+
+        for (i = 0; i < 64; ++i) {
+            seed = seed * 1103515245 + 12345;
+            if (ip_locate_ref(db, seed | 1, &text, &len) != 0) {
+                PANIC("failed to locate ip while reloading");
+            }
+        }
+
+        if (ip_locate_ref(db, 0x08080808, &text, &len) != 0 ||
+            len != expected_len || memcmp(text, expected, len) != 0) {
+            PANIC("wrong location while reloading");
+        }
+
+        ip_db_unpin(r);
+        rr->lookups += 65;
+    }
+
+    ip_db_reader_release(&r);
+    return NULL;
+}
+
+void test_reload(const char *path, uint32_t flags)
+{
+    enum { THREADS = 8, RELOADS = 50 };
+    ip_db_handle_t *handle = ip_db_handle_new(ip_db_init_ex(path, flags));
+    pthread_t threads[THREADS];
+    reload_reader_t readers[THREADS];
+    atomic_int stop;
+    int i;
+
+    if (!handle) {
+        PANIC("failed to create ip db handle");
+    }
+    atomic_init(&stop, 0);
+
+    for (i = 0; i < THREADS; ++i) {
+        readers[i].handle = handle;
+        readers[i].stop = &stop;
+        readers[i].lookups = 0;
+        pthread_create(&threads[i], NULL, reload_reader, &readers[i]);
+    }
+
+    // Alternate between engines so that every swap changes the layout.
+    for (i = 0; i < RELOADS; ++i) {
+        uint32_t f = flags | (i & 1 ? IP_DB_SIMD : IP_DB_MMAP);
+        if (ip_db_handle_reload(handle, path, f) != 0) {
+            PANIC("failed to reload ip db");
+        }
+    }
+
+    if (ip_db_handle_reload(handle, "/nonexistent/17monipdb.dat", flags) == 0) {
+        PANIC("reloaded a missing ip db");
+    }
+
+    // Swapping in the current DB again keeps it alive.
+    ip_db_reader_t *r = ip_db_reader_new(handle);
+    ip_db_t *current = ip_db_pin(r);
+    ip_db_unpin(r);
+    const char *text;
+    uint32_t len;
+    if (ip_db_handle_swap(handle, current) == 0 || ip_db_pin(r) != current ||
+        ip_locate_ref(current, 0x08080808, &text, &len) != 0) {
+        PANIC("swapped in the current ip db");
+    }
+    ip_db_unpin(r);
+    ip_db_reader_release(&r);
+
+    atomic_store(&stop, 1);
+    long lookups = 0;
+    for (i = 0; i < THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        lookups += readers[i].lookups;
+    }
+
+    ip_db_handle_destroy(&handle);
+    printf("reload: ok, %d reloads, %ld lookups by %d threads\n",
+            RELOADS, lookups, THREADS);
+}
+
+void test_parse()
+{
+    static const char alphabet[] = "0123456789..x ";
+    char buf[32];
+    int i;
+
+    for (i = 0; i < 1000000; ++i) {
+        int n, j;
+        if (i & 1) {
+            uint32_t v = random_ip();
+            n = sprintf(buf, "%u.%u.%u.%u", v >> 24, (v >> 16) & 255, (v >> 8) & 255, v & 255);
+            // Mutate one byte now and then.
+            if (i % 3 == 0) {
+                buf[rand() % n] = alphabet[rand() % (sizeof(alphabet) - 1)];
+            }
+        } else {
+            n = rand() % 18;
+            for (j = 0; j < n; ++j) {
+                buf[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+            }
+            buf[n] = 0;
+        }
+
+        struct in_addr addr;
+        uint32_t ip = 0;
+        int expected = inet_pton(AF_INET, buf, &addr) == 1;
+        int got = ip_parse_v4(buf, strlen(buf), &ip) == 0;
+        if (expected != got || (got && ip != ntohl(addr.s_addr))) {
+            printf("parse: mismatch on \"%s\"\n", buf);
+            PANIC("ip parser disagrees with inet_pton");
+        }
+    }
+
+    const char *lines = "1.2.3.4\n0.0.0.0\r\nbogus\n\n255.255.255.255";
+    uint32_t ips[8];
+    unsigned char valid[8];
+    size_t consumed;
+    size_t n = ip_parse_v4_lines(lines, strlen(lines), ips, valid, 8, &consumed);
+    if (n != 5 || consumed != strlen(lines) ||
+        ips[0] != 0x01020304 || !valid[0] || ips[1] != 0 || !valid[1] ||
+        valid[2] || valid[3] || ips[4] != 0xffffffff || !valid[4]) {
+        PANIC("line parser mismatch");
+    }
+    if (ip_parse_v4_lines(lines, strlen(lines), ips, valid, 2, &consumed) != 2 ||
+        consumed != strlen("1.2.3.4\n0.0.0.0\r\n")) {
+        PANIC("line parser overran max");
+    }
+
+    printf("parse: ok\n");
+}
+
+typedef struct {
+    char text[1024][16];
+    size_t len[1024];
+    char *lines;
+    size_t lines_len;
+    uint32_t ips[1024];
+} parse_bench_t;
+
+void init_parse_bench(parse_bench_t *b)
+{
+    int i;
+    size_t off = 0;
+    b->lines = malloc(1024 * 16);
+    for (i = 0; i < 1024; ++i) {
+        uint32_t v = fast_rand();
+        b->len[i] = sprintf(b->text[i], "%u.%u.%u.%u",
+                v >> 24, (v >> 16) & 255, (v >> 8) & 255, v & 255);
+        off += sprintf(b->lines + off, "%s\n", b->text[i]);
+    }
+    b->lines_len = off;
+}
+
+void parse_inet_pton(void *arg)
+{
+    parse_bench_t *b = (parse_bench_t*)arg;
+    struct in_addr addr;
+    int i = fast_rand() & 1023;
+    if (inet_pton(AF_INET, b->text[i], &addr) != 1) {
+        PANIC("failed to parse ip");
+    }
+}
+
+void parse_fast(void *arg)
+{
+    parse_bench_t *b = (parse_bench_t*)arg;
+    uint32_t ip;
+    int i = fast_rand() & 1023;
+    if (ip_parse_v4(b->text[i], b->len[i], &ip) != 0) {
+        PANIC("failed to parse ip");
+    }
+}
+
+void parse_lines(void *arg)
+{
+    parse_bench_t *b = (parse_bench_t*)arg;
+    if (ip_parse_v4_lines(b->lines, b->lines_len, b->ips, NULL, 1024, NULL) != 1024) {
+        PANIC("failed to parse ip lines");
+    }
+}
+
+typedef struct {
+    int cpu;
+    int N;
+    Action action;
+    void *arg;
+    pthread_barrier_t *barrier;
+    double nanosec;
+    int pinned;
+} mt_worker_t;
+
+void* mt_worker(void *p)
+{
+    mt_worker_t *w = (mt_worker_t*)p;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    w->pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    rng_state = 2463534241u + 7919u * w->cpu;
+
+    pthread_barrier_wait(w->barrier);
+    struct timespec start, stop;
+    get_time(&start);
+
+    int i;
+    for (i = 0; i < w->N; ++i) {
+        w->action(w->arg);
+    }
+
+    get_time(&stop);
+    w->nanosec = time_diff(&stop, &start);
+    pthread_barrier_wait(w->barrier);
+    return NULL;
+}
+
+// Run |action| N times on each of 1, 2, 4 ... up to every CPU this
+// process may run on, one thread pinned per CPU, and report how
+// throughput scales, flagging runs where pinning failed.
+void benchmark_mt(const char *name, int N, Action action, void *arg)
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], ncpu = 0, c;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        PANIC("failed to get the cpu affinity");
+    }
+    for (c = 0; c < CPU_SETSIZE; ++c) {
+        if (CPU_ISSET(c, &allowed)) {
+            cpus[ncpu++] = c;
+        }
+    }
+
+    double base = 0;
+    int t;
+
+    for (t = 1; ; t = t*2 < ncpu ? t*2 : ncpu) {
+        pthread_t threads[t];
+        mt_worker_t workers[t];
+        pthread_barrier_t barrier;
+        struct timespec start, stop;
+        int i;
+
+        pthread_barrier_init(&barrier, NULL, t + 1);
+        for (i = 0; i < t; ++i) {
+            workers[i] = (mt_worker_t){cpus[i], N, action, arg, &barrier, 0, 0};
+            pthread_create(&threads[i], NULL, mt_worker, &workers[i]);
+        }
+
+        pthread_barrier_wait(&barrier);
+        get_time(&start);
+        pthread_barrier_wait(&barrier);
+        get_time(&stop);
+
+        double thread_ns = 0;
+        int pinned = 0;
+        for (i = 0; i < t; ++i) {
+            pthread_join(threads[i], NULL);
+            thread_ns += workers[i].nanosec;
+            pinned += workers[i].pinned;
+        }
+        pthread_barrier_destroy(&barrier);
+
+        double ops_per_sec = (double)N * t / (time_diff(&stop, &start) / 1e9);
+        if (t == 1) {
+            base = ops_per_sec;
+        }
+
+        printf("%s\t%d threads\t%.0f ops/sec\t%.1f nsec/op/thread\t%.0f%% scaling%s\n",
+                name, t, ops_per_sec, thread_ns / t / N,
+                100.0 * ops_per_sec / (base * t),
+                pinned == t ? "" : "\tnot pinned: cpu affinity refused");
+
+        if (t == ncpu) {
+            break;
+        }
+    }
+}
+
 int main(int argc, const char *argv[])
 {
     srand(time(0));
 
-    if (argc == 1) {
-        ipdb = ip_db_init("17monipdb.dat");
-    } else if (argc == 2) {
+    const char *path = "17monipdb.dat";
+    int extended = 0;
+
+    if (argc == 2) {
         if (strcmp(argv[1], "-x") == 0) {
-            ipdb = ip_db_init_x("17monipdb.datx");
+            path = "17monipdb.datx";
+            extended = 1;
         } else {
-            ipdb = ip_db_init(argv[1]);
+            path = argv[1];
         }
     } else if (argc == 3 && strcmp(argv[1], "-x") == 0) {
-        ipdb = ip_db_init_x(argv[2]);
+        path = argv[2];
+        extended = 1;
     }
 
+    ipdb = extended ? ip_db_init_x(path) : ip_db_init(path);
+
     if (!ipdb) {
         fprintf(stderr, "Failed to init ip db");
         return -1;
     }
 
     test_basic(argc, argv);
+    test_mmap(path, extended);
+    test_ref();
+    test_batch(ipdb, "batch");
+
+    uint32_t flags = extended ? IP_DB_EXTENDED : 0;
+    test_native(path, flags);
+    ip_db_t *decoded = ip_db_init_ex(path, flags | IP_DB_DECODE);
+    if (!decoded) {
+        PANIC("failed to init decoded ip db");
+    }
+    test_same(decoded, "decode");
+
+    ip_db_t *generic = ip_db_init_ex(path, flags | IP_DB_GENERIC);
+    if (!generic) {
+        PANIC("failed to init generic ip db");
+    }
+    test_same(generic, "generic");
+
+    ip_db_t *compact = ip_db_init_ex(path, flags | IP_DB_COMPACT);
+    if (!compact) {
+        PANIC("failed to init compact ip db");
+    }
+    test_same(compact, "compact");
+    test_batch(compact, "compact_batch");
+    printf("compact: %u of %u entries merged\n",
+            ip_db_merged_count(compact), ip_db_count(ipdb));
+
+    ip_db_t *compact_simd = ip_db_init_ex(path, flags | IP_DB_COMPACT | IP_DB_SIMD);
+    if (!compact_simd) {
+        PANIC("failed to init compact simd ip db");
+    }
+    test_same(compact_simd, "compact_simd");
+
+    ip_db_t *eytzinger = ip_db_init_ex(path, flags | IP_DB_EYTZINGER);
+    if (!eytzinger) {
+        PANIC("failed to init eytzinger ip db");
+    }
+    test_same(eytzinger, "eytzinger");
+
+    ip_db_t *simd = ip_db_init_ex(path, flags | IP_DB_SIMD);
+    if (!simd) {
+        PANIC("failed to init simd ip db");
+    }
+    test_same(simd, "simd");
+    test_batch(simd, "simd_batch");
+
+    ip_db_t *direct = ip_db_init_ex(path, flags | IP_DB_DIRECT);
+    if (!direct) {
+        PANIC("failed to init direct ip db");
+    }
+    test_same(direct, "direct");
+    test_batch(direct, "direct_batch");
+    test_loc_ids(path, flags);
+    test_reload(path, flags);
+    test_parse();
+
+    ip_db_t *fields = ip_db_init_ex(path, flags | IP_DB_FIELDS);
+    if (!fields) {
+        PANIC("failed to init ip db with fields");
+    }
+    test_fields(fields);
+    test_inverted(path, flags);
+    test_export();
+    test_stats(path, flags);
+    test_placement(path, flags);
+
+    v6_bench_t v6;
+    v6.db = test_v6(path, flags, &v6.ips);
+    ip_db_t *ipdb_file = test_ipdb(path, flags, "/tmp/iploc-test.ipdb");
+
+    write_datx(path, flags, "/tmp/iploc-test.datx", 0);
+    ip_db_t *datx = ip_db_init_x("/tmp/iploc-test.datx");
+    if (!datx) {
+        PANIC("failed to init datx ip db");
+    }
+    test_same(datx, "datx");
+    ip_db_t *datx_generic = ip_db_init_ex("/tmp/iploc-test.datx", IP_DB_EXTENDED | IP_DB_GENERIC);
+    if (!datx_generic) {
+        PANIC("failed to init generic datx ip db");
+    }
+    test_same(datx_generic, "datx_generic");
+    unlink("/tmp/iploc-test.datx");
+    test_diff(path, flags);
+
+    ip_db_t *direct_huge = ip_db_init_ex(path, flags | IP_DB_DIRECT | IP_DB_HUGEPAGES);
+    if (!direct_huge) {
+        PANIC("failed to init direct ip db on huge pages");
+    }
+    printf("footprint: default %zu bytes, direct %zu bytes\n",
+            ip_db_footprint(ipdb), ip_db_footprint(direct));
 
     int n = 5000000;
     benchmark("random_ip_bench:", n, random_ip_location, NULL);
+    benchmark("random_ip_ref_bench:", n, random_ip_location_ref, NULL);
+    benchmark("random_ip_generic_ref_bench:", n, random_ip_location_ref, generic);
+    benchmark("random_ip_datx_ref_bench:", n, random_ip_location_ref, datx);
+    benchmark("random_ip_datx_generic_ref_bench:", n, random_ip_location_ref, datx_generic);
+    benchmark("random_ip_decoded_bench:", n, random_ip_location_ref, decoded);
+    benchmark("random_ip_compact_bench:", n, random_ip_location_ref, compact);
+    benchmark("random_ip_eytzinger_bench:", n, random_ip_location_ref, eytzinger);
+    benchmark("random_ip_simd_bench:", n, random_ip_location_ref, simd);
+    benchmark("random_ip_compact_simd_bench:", n, random_ip_location_ref, compact_simd);
+    benchmark("random_ip_direct_bench:", n, random_ip_location_ref, direct);
+    benchmark("random_ip_direct_huge_bench:", n, random_ip_location_ref, direct_huge);
+    benchmark("random_ip_field_bench:", n, random_ip_fields, fields);
+    benchmark("random_ip_v6_bench:", n, random_ip_v6, &v6);
+    if (ipdb_file) {
+        benchmark("random_ip_ipdb_simd_bench:", n, random_ip_location_ref, ipdb_file);
+    }
+
+    batch_t batch;
+    batch.db = ipdb;
+    batch.n = 8;
+    benchmark_n("random_ip_batch8_bench:", n/8, 8, random_ip_location_batch, &batch);
+    batch.n = 32;
+    benchmark_n("random_ip_batch32_bench:", n/32, 32, random_ip_location_batch, &batch);
+    batch.n = 256;
+    benchmark_n("random_ip_batch256_bench:", n/256, 256, random_ip_location_batch, &batch);
+    batch.db = simd;
+    batch.n = 32;
+    benchmark_n("random_ip_simd_batch32_bench:", n/32, 32, random_ip_location_batch, &batch);
+
+    parse_bench_t *pb = malloc(sizeof(parse_bench_t));
+    init_parse_bench(pb);
+    benchmark("parse_inet_pton_bench:", n, parse_inet_pton, pb);
+    benchmark("parse_ip_v4_bench:", n, parse_fast, pb);
+    benchmark_n("parse_ip_v4_lines_bench:", n/1024, 1024, parse_lines, pb);
+    free(pb->lines);
+    free(pb);
+
+    benchmark_mt("mt_random_ip_bench:", n/5, random_ip_location_ref, NULL);
+    benchmark_mt("mt_random_ip_simd_bench:", n/5, random_ip_location_ref, simd);
 
+    ip_db_destroy(&fields);
+    ip_db_destroy(&v6.db);
+    ip_db_destroy(&ipdb_file);
+    free(v6.ips);
+    ip_db_destroy(&direct);
+    ip_db_destroy(&direct_huge);
+    ip_db_destroy(&datx);
+    ip_db_destroy(&datx_generic);
+    ip_db_destroy(&generic);
+    ip_db_destroy(&simd);
+    ip_db_destroy(&eytzinger);
+    ip_db_destroy(&decoded);
+    ip_db_destroy(&compact);
+    ip_db_destroy(&compact_simd);
     ip_db_destroy(&ipdb);
     return 0;
 }